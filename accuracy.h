@@ -0,0 +1,644 @@
+#pragma once
+
+// Alignment-based typing accuracy, shared by the client and the server.
+//
+// Accuracy is derived from the Levenshtein distance between the passage and
+// what was typed, so one missed or extra character only costs one edit
+// instead of shifting every later character out of place.
+//
+// The distance uses the Myers/Hyyro bit-parallel algorithm: 64 rows of the
+// DP matrix per machine word, blocked for longer passages and restricted to
+// a diagonal band that doubles until it provably contains the answer. The
+// common prefix and suffix are stripped first with SSE2/AVX2 compares, and
+// the per-word breakdown scores 2 (SSE2) or 4 (AVX2) word pairs at once. The
+// kernel is picked at runtime from the CPU's features, with a scalar
+// fallback; TYPE2C_KERNEL=scalar|sse2|avx2 forces one for testing.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define TYPE2C_X86_KERNELS 1
+    #include <immintrin.h>
+#endif
+
+enum AccuracyKernel {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2
+};
+
+struct AccuracyReport {
+    uint32_t distance;                 // edits between passage and typed text
+    uint32_t passageLength;
+    double accuracy;                   // percent of the passage typed correctly
+    std::vector<uint32_t> wordErrors;  // edits attributed to each passage word
+    uint32_t wordsWithErrors;
+};
+
+namespace accuracy_detail {
+
+inline int popcount64(uint64_t v) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<int>((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+inline AccuracyKernel detectKernel() {
+    AccuracyKernel best = KERNEL_SCALAR;
+#ifdef TYPE2C_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) best = KERNEL_SSE2;
+    if (__builtin_cpu_supports("avx2")) best = KERNEL_AVX2;
+#endif
+    // Allow forcing a slower kernel, never a faster one than the CPU has
+    const char* forced = getenv("TYPE2C_KERNEL");
+    if (forced) {
+        if (strcmp(forced, "scalar") == 0) return KERNEL_SCALAR;
+        if (strcmp(forced, "sse2") == 0 && best >= KERNEL_SSE2) return KERNEL_SSE2;
+    }
+    return best;
+}
+
+// ---- Common prefix / suffix ----------------------------------------------
+
+inline size_t commonPrefixScalar(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) i++;
+    return i;
+}
+
+inline size_t commonSuffixScalar(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    while (i < n && a[-1 - (ptrdiff_t)i] == b[-1 - (ptrdiff_t)i]) i++;
+    return i;
+}
+
+#ifdef TYPE2C_X86_KERNELS
+__attribute__((target("sse2")))
+inline size_t commonPrefixSSE2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned diff = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFFu;
+        if (diff) return i + __builtin_ctz(diff);
+    }
+    return i + commonPrefixScalar(a + i, b + i, n - i);
+}
+
+// a and b point one past the end of the strings
+__attribute__((target("sse2")))
+inline size_t commonSuffixSSE2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a - i - 16));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b - i - 16));
+        unsigned diff = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFFu;
+        if (diff) return i + (__builtin_clz(diff) - 16);
+    }
+    return i + commonSuffixScalar(a - i, b - i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t commonPrefixAVX2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        unsigned diff = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (diff) return i + __builtin_ctz(diff);
+    }
+    return i + commonPrefixSSE2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t commonSuffixAVX2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a - i - 32));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b - i - 32));
+        unsigned diff = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (diff) return i + __builtin_clz(diff);
+    }
+    return i + commonSuffixSSE2(a - i, b - i, n - i);
+}
+#endif
+
+inline size_t commonPrefix(AccuracyKernel kernel, const char* a, const char* b, size_t n) {
+#ifdef TYPE2C_X86_KERNELS
+    if (kernel == KERNEL_AVX2) return commonPrefixAVX2(a, b, n);
+    if (kernel == KERNEL_SSE2) return commonPrefixSSE2(a, b, n);
+#endif
+    (void)kernel;
+    return commonPrefixScalar(a, b, n);
+}
+
+inline size_t commonSuffix(AccuracyKernel kernel, const char* aEnd, const char* bEnd, size_t n) {
+#ifdef TYPE2C_X86_KERNELS
+    if (kernel == KERNEL_AVX2) return commonSuffixAVX2(aEnd, bEnd, n);
+    if (kernel == KERNEL_SSE2) return commonSuffixSSE2(aEnd, bEnd, n);
+#endif
+    (void)kernel;
+    return commonSuffixScalar(aEnd, bEnd, n);
+}
+
+// ---- Blocked, banded Myers -----------------------------------------------
+
+const uint64_t HIGH_BIT = 1ULL << 63;
+
+// Advance one 64-row block by one text character. hin/hout are the
+// horizontal deltas entering the top and leaving the bottom of the block.
+inline int advanceBlock(uint64_t& pv, uint64_t& mv, uint64_t eq, int hin) {
+    uint64_t xv = eq | mv;
+    if (hin < 0) eq |= 1;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+
+    int hout = 0;
+    if (ph & HIGH_BIT) hout = 1;
+    if (mh & HIGH_BIT) hout = -1;
+
+    ph <<= 1;
+    mh <<= 1;
+    if (hin < 0) mh |= 1;
+    else if (hin > 0) ph |= 1;
+
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    return hout;
+}
+
+// Reused per thread so scoring does not allocate in the steady state
+struct BlockScratch {
+    std::vector<uint64_t> peq;     // [symbol][block] match masks
+    std::vector<uint64_t> pv, mv;
+    std::vector<int64_t> score;    // DP value at each block's bottom row
+    uint8_t symbolOf[256];
+};
+
+inline BlockScratch& blockScratch() {
+    thread_local BlockScratch scratch;
+    return scratch;
+}
+
+// Exact distance if it is <= k; otherwise some value > k. Only cells on
+// diagonals that a path of cost <= k can visit are computed; anything
+// outside the band is treated as an upper bound, which cannot lower an
+// in-band cell below its true value.
+inline uint64_t bandedDistance(std::string_view p, std::string_view t, uint64_t k) {
+    const int64_t m = p.size();
+    const int64_t n = t.size();
+    const int64_t blocks = (m + 63) / 64;
+    BlockScratch& s = blockScratch();
+
+    // Compact the alphabet: symbol 0 is "not in the passage"
+    memset(s.symbolOf, 0, sizeof(s.symbolOf));
+    int symbols = 1;
+    for (unsigned char c : p) {
+        if (!s.symbolOf[c]) s.symbolOf[c] = static_cast<uint8_t>(symbols++);
+    }
+    s.peq.assign(static_cast<size_t>(symbols) * blocks, 0);
+    for (int64_t i = 0; i < m; i++) {
+        s.peq[s.symbolOf[static_cast<unsigned char>(p[i])] * blocks + i / 64] |= 1ULL << (i % 64);
+    }
+    s.pv.assign(blocks, ~0ULL);
+    s.mv.assign(blocks, 0);
+    s.score.assign(blocks, 0);
+
+    // Rows reachable at column j are j + dmin .. j + dmax
+    int64_t diff = m - n;
+    int64_t slack = (static_cast<int64_t>(k) - std::llabs(diff)) / 2;
+    int64_t dmin = std::min<int64_t>(0, diff) - slack;
+    int64_t dmax = std::max<int64_t>(0, diff) + slack;
+    auto blockOfRow = [&](int64_t row) {
+        row = std::max<int64_t>(1, std::min(m, row));
+        return (row - 1) / 64;
+    };
+
+    int64_t first = 0;
+    int64_t last = blockOfRow(dmax);
+    for (int64_t b = 0; b <= last; b++) {
+        s.score[b] = 64 * (b + 1);   // column 0 is D[i][0] = i
+    }
+
+    for (int64_t j = 1; j <= n; j++) {
+        const uint64_t* eq = &s.peq[s.symbolOf[static_cast<unsigned char>(t[j - 1])] * blocks];
+
+        // The band slides down by at most one row per column
+        int64_t newLast = blockOfRow(j + dmax);
+        while (last < newLast) {
+            last++;
+            s.pv[last] = ~0ULL;
+            s.mv[last] = 0;
+            s.score[last] = s.score[last - 1] + 64;
+        }
+        first = std::max(first, blockOfRow(j + dmin));
+
+        int hin = 1;
+        for (int64_t b = first; b <= last; b++) {
+            hin = advanceBlock(s.pv[b], s.mv[b], eq[b], hin);
+            s.score[b] += hin;
+        }
+    }
+
+    // The last block is padded past row m; walk its bottom score back up
+    int64_t lastBlock = blocks - 1;
+    int realRows = static_cast<int>(m - 64 * lastBlock);
+    int64_t result = s.score[lastBlock];
+    if (realRows < 64) {
+        uint64_t pad = ~0ULL << realRows;
+        result -= popcount64(s.pv[lastBlock] & pad) - popcount64(s.mv[lastBlock] & pad);
+    }
+    return static_cast<uint64_t>(result);
+}
+
+inline uint64_t myersDistance(std::string_view p, std::string_view t) {
+    if (p.empty()) return t.size();
+    if (t.empty()) return p.size();
+
+    // Typing errors stay near the diagonal, so a narrow band almost always
+    // suffices; widen it until the answer fits inside
+    uint64_t bound = std::max(p.size(), t.size());
+    uint64_t diff = p.size() > t.size() ? p.size() - t.size() : t.size() - p.size();
+    uint64_t k = std::max<uint64_t>(diff + 64, 128);
+    while (true) {
+        if (k >= bound) return bandedDistance(p, t, bound);
+        uint64_t d = bandedDistance(p, t, k);
+        if (d <= k) return d;
+        k *= 2;
+    }
+}
+
+// ---- Batched single-word Myers for the per-word breakdown -----------------
+
+struct WordPair {
+    std::string_view word;    // from the passage, at most 64 characters
+    std::string_view typed;
+};
+
+// Per-lane match tables; entries are set for one batch and cleared after
+struct LaneTables {
+    uint64_t peq[4][256];
+    LaneTables() { memset(peq, 0, sizeof(peq)); }
+};
+
+inline LaneTables& laneTables() {
+    thread_local LaneTables tables;
+    return tables;
+}
+
+inline void loadLane(LaneTables& lt, int lane, std::string_view word) {
+    for (size_t i = 0; i < word.size(); i++) {
+        lt.peq[lane][static_cast<unsigned char>(word[i])] |= 1ULL << i;
+    }
+}
+
+inline void clearLane(LaneTables& lt, int lane, std::string_view word) {
+    for (unsigned char c : word) lt.peq[lane][c] = 0;
+}
+
+// D[m][n] from the final column's vertical deltas
+inline uint32_t finalDistance(uint64_t pv, uint64_t mv, size_t m, size_t n) {
+    uint64_t mask = m >= 64 ? ~0ULL : ((1ULL << m) - 1);
+    return static_cast<uint32_t>(n + popcount64(pv & mask) - popcount64(mv & mask));
+}
+
+inline uint32_t wordDistanceScalar(LaneTables& lt, const WordPair& pair) {
+    if (pair.word.empty()) return static_cast<uint32_t>(pair.typed.size());
+    loadLane(lt, 0, pair.word);
+    uint64_t pv = ~0ULL, mv = 0;
+    for (unsigned char c : pair.typed) {
+        uint64_t eq = lt.peq[0][c];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    clearLane(lt, 0, pair.word);
+    return finalDistance(pv, mv, pair.word.size(), pair.typed.size());
+}
+
+#ifdef TYPE2C_X86_KERNELS
+// Two word pairs per step in the 64-bit lanes of an SSE2 register. Lanes
+// whose typed word has ended keep their state through a mask blend.
+__attribute__((target("sse2")))
+inline void wordDistancesSSE2(LaneTables& lt, const WordPair* pairs, uint32_t* out) {
+    size_t maxN = std::max(pairs[0].typed.size(), pairs[1].typed.size());
+    for (int l = 0; l < 2; l++) loadLane(lt, l, pairs[l].word);
+
+    const __m128i ones = _mm_set1_epi64x(-1);
+    const __m128i one = _mm_set1_epi64x(1);
+    __m128i pv = ones, mv = _mm_setzero_si128();
+
+    for (size_t j = 0; j < maxN; j++) {
+        long long e[2], a[2];
+        for (int l = 0; l < 2; l++) {
+            bool active = j < pairs[l].typed.size();
+            e[l] = active ? static_cast<long long>(lt.peq[l][static_cast<unsigned char>(pairs[l].typed[j])]) : 0;
+            a[l] = active ? -1 : 0;
+        }
+        __m128i eq = _mm_set_epi64x(e[1], e[0]);
+        __m128i active = _mm_set_epi64x(a[1], a[0]);
+
+        __m128i xv = _mm_or_si128(eq, mv);
+        __m128i xh = _mm_or_si128(_mm_xor_si128(_mm_add_epi64(_mm_and_si128(eq, pv), pv), pv), eq);
+        __m128i ph = _mm_or_si128(mv, _mm_xor_si128(_mm_or_si128(xh, pv), ones));
+        __m128i mh = _mm_and_si128(pv, xh);
+        ph = _mm_or_si128(_mm_slli_epi64(ph, 1), one);
+        mh = _mm_slli_epi64(mh, 1);
+        __m128i npv = _mm_or_si128(mh, _mm_xor_si128(_mm_or_si128(xv, ph), ones));
+        __m128i nmv = _mm_and_si128(ph, xv);
+
+        pv = _mm_or_si128(_mm_and_si128(active, npv), _mm_andnot_si128(active, pv));
+        mv = _mm_or_si128(_mm_and_si128(active, nmv), _mm_andnot_si128(active, mv));
+    }
+
+    alignas(16) uint64_t p[2], m[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(p), pv);
+    _mm_store_si128(reinterpret_cast<__m128i*>(m), mv);
+    for (int l = 0; l < 2; l++) {
+        clearLane(lt, l, pairs[l].word);
+        out[l] = finalDistance(p[l], m[l], pairs[l].word.size(), pairs[l].typed.size());
+    }
+}
+
+// Four word pairs per step in an AVX2 register
+__attribute__((target("avx2")))
+inline void wordDistancesAVX2(LaneTables& lt, const WordPair* pairs, uint32_t* out) {
+    size_t maxN = 0;
+    for (int l = 0; l < 4; l++) {
+        maxN = std::max(maxN, pairs[l].typed.size());
+        loadLane(lt, l, pairs[l].word);
+    }
+
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i one = _mm256_set1_epi64x(1);
+    __m256i pv = ones, mv = _mm256_setzero_si256();
+
+    for (size_t j = 0; j < maxN; j++) {
+        long long e[4], a[4];
+        for (int l = 0; l < 4; l++) {
+            bool active = j < pairs[l].typed.size();
+            e[l] = active ? static_cast<long long>(lt.peq[l][static_cast<unsigned char>(pairs[l].typed[j])]) : 0;
+            a[l] = active ? -1 : 0;
+        }
+        __m256i eq = _mm256_set_epi64x(e[3], e[2], e[1], e[0]);
+        __m256i active = _mm256_set_epi64x(a[3], a[2], a[1], a[0]);
+
+        __m256i xv = _mm256_or_si256(eq, mv);
+        __m256i xh = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(eq, pv), pv), pv), eq);
+        __m256i ph = _mm256_or_si256(mv, _mm256_xor_si256(_mm256_or_si256(xh, pv), ones));
+        __m256i mh = _mm256_and_si256(pv, xh);
+        ph = _mm256_or_si256(_mm256_slli_epi64(ph, 1), one);
+        mh = _mm256_slli_epi64(mh, 1);
+        __m256i npv = _mm256_or_si256(mh, _mm256_xor_si256(_mm256_or_si256(xv, ph), ones));
+        __m256i nmv = _mm256_and_si256(ph, xv);
+
+        pv = _mm256_blendv_epi8(pv, npv, active);
+        mv = _mm256_blendv_epi8(mv, nmv, active);
+    }
+
+    alignas(32) uint64_t p[4], m[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(p), pv);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(m), mv);
+    for (int l = 0; l < 4; l++) {
+        clearLane(lt, l, pairs[l].word);
+        out[l] = finalDistance(p[l], m[l], pairs[l].word.size(), pairs[l].typed.size());
+    }
+}
+#endif
+
+// Distances for a batch of word pairs. Words over 64 characters go through
+// the blocked algorithm; the rest are packed into SIMD lanes.
+inline void wordDistances(AccuracyKernel kernel, const std::vector<WordPair>& pairs, uint32_t* out) {
+    LaneTables& lt = laneTables();
+    int width = kernel == KERNEL_AVX2 ? 4 : kernel == KERNEL_SSE2 ? 2 : 1;
+
+    WordPair batch[4];
+    size_t index[4];
+    int filled = 0;
+
+    auto flush = [&]() {
+        if (filled == 0) return;
+        uint32_t result[4];
+#ifdef TYPE2C_X86_KERNELS
+        if (width > 1) {
+            // Pad a partial batch with empty pairs
+            for (int l = filled; l < width; l++) batch[l] = WordPair();
+            if (width == 4) wordDistancesAVX2(lt, batch, result);
+            else wordDistancesSSE2(lt, batch, result);
+        } else
+#endif
+        {
+            for (int l = 0; l < filled; l++) result[l] = wordDistanceScalar(lt, batch[l]);
+        }
+        for (int l = 0; l < filled; l++) out[index[l]] = result[l];
+        filled = 0;
+    };
+
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (pairs[i].word.size() > 64) {
+            out[i] = static_cast<uint32_t>(myersDistance(pairs[i].word, pairs[i].typed));
+            continue;
+        }
+        batch[filled] = pairs[i];
+        index[filled] = i;
+        if (++filled == width) flush();
+    }
+    flush();
+}
+
+inline void splitWords(std::string_view text, std::vector<std::string_view>& words) {
+    words.clear();
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && isspace(static_cast<unsigned char>(text[i]))) i++;
+        size_t start = i;
+        while (i < text.size() && !isspace(static_cast<unsigned char>(text[i]))) i++;
+        if (i > start) words.push_back(text.substr(start, i - start));
+    }
+}
+
+} // namespace accuracy_detail
+
+inline AccuracyKernel activeAccuracyKernel() {
+    static const AccuracyKernel kernel = accuracy_detail::detectKernel();
+    return kernel;
+}
+
+inline const char* accuracyKernelName(AccuracyKernel kernel) {
+    switch (kernel) {
+        case KERNEL_AVX2: return "avx2";
+        case KERNEL_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+// Levenshtein distance between the passage and the typed text
+inline uint64_t editDistance(std::string_view passage, std::string_view typed) {
+    using namespace accuracy_detail;
+    AccuracyKernel kernel = activeAccuracyKernel();
+
+    size_t n = std::min(passage.size(), typed.size());
+    size_t prefix = commonPrefix(kernel, passage.data(), typed.data(), n);
+    passage.remove_prefix(prefix);
+    typed.remove_prefix(prefix);
+
+    n = std::min(passage.size(), typed.size());
+    size_t suffix = commonSuffix(kernel, passage.data() + passage.size(), typed.data() + typed.size(), n);
+    passage.remove_suffix(suffix);
+    typed.remove_suffix(suffix);
+
+    return myersDistance(passage, typed);
+}
+
+// Distance from p to every prefix of t: row[j] is the distance between p
+// and t's first j characters. Unbanded, for pieces of a long passage whose
+// end in the typed text is not known yet (see KeyLogScorer).
+inline void prefixDistances(std::string_view p, std::string_view t, std::vector<uint32_t>& row) {
+    using namespace accuracy_detail;
+    const size_t m = p.size();
+    const size_t n = t.size();
+    row.resize(n + 1);
+    if (m == 0) {
+        for (size_t j = 0; j <= n; j++) row[j] = static_cast<uint32_t>(j);
+        return;
+    }
+
+    const size_t blocks = (m + 63) / 64;
+    BlockScratch& s = blockScratch();
+    memset(s.symbolOf, 0, sizeof(s.symbolOf));
+    int symbols = 1;
+    for (unsigned char c : p) {
+        if (!s.symbolOf[c]) s.symbolOf[c] = static_cast<uint8_t>(symbols++);
+    }
+    s.peq.assign(static_cast<size_t>(symbols) * blocks, 0);
+    for (size_t i = 0; i < m; i++) {
+        s.peq[s.symbolOf[static_cast<unsigned char>(p[i])] * blocks + i / 64] |= 1ULL << (i % 64);
+    }
+    s.pv.assign(blocks, ~0ULL);
+    s.mv.assign(blocks, 0);
+
+    // Track the padded bottom row and walk it back up to row m each column
+    int realRows = static_cast<int>(m - 64 * (blocks - 1));
+    uint64_t pad = realRows < 64 ? ~0ULL << realRows : 0;
+    int64_t bottom = static_cast<int64_t>(64 * blocks);
+    row[0] = static_cast<uint32_t>(m);
+    for (size_t j = 1; j <= n; j++) {
+        const uint64_t* eq = &s.peq[s.symbolOf[static_cast<unsigned char>(t[j - 1])] * blocks];
+        int hin = 1;
+        for (size_t b = 0; b < blocks; b++) {
+            hin = advanceBlock(s.pv[b], s.mv[b], eq[b], hin);
+        }
+        bottom += hin;
+        uint64_t pv = s.pv[blocks - 1];
+        uint64_t mv = s.mv[blocks - 1];
+        row[j] = static_cast<uint32_t>(bottom - (popcount64(pv & pad) - popcount64(mv & pad)));
+    }
+}
+
+// Percentage of a passage typed correctly, given the edits between them:
+// every edit costs one character
+inline double accuracyFromDistance(uint64_t passageLength, uint64_t distance) {
+    if (passageLength == 0) return distance == 0 ? 100.0 : 0.0;
+    if (distance >= passageLength) return 0.0;
+    return (passageLength - distance) * 100.0 / passageLength;
+}
+
+inline double accuracyPercent(std::string_view passage, std::string_view typed) {
+    return accuracyFromDistance(passage.size(), editDistance(passage, typed));
+}
+
+// Full report, including how many edits each passage word needed. Words are
+// lined up greedily with a short look-ahead so a skipped or doubled word
+// does not shift the rest of the breakdown.
+inline AccuracyReport scoreAccuracy(std::string_view passage, std::string_view typed) {
+    using namespace accuracy_detail;
+
+    AccuracyReport report;
+    report.passageLength = static_cast<uint32_t>(passage.size());
+    uint64_t distance = editDistance(passage, typed);
+    report.distance = static_cast<uint32_t>(distance);
+    report.accuracy = accuracyFromDistance(passage.size(), distance);
+
+    thread_local std::vector<std::string_view> words, typedWords;
+    thread_local std::vector<WordPair> pairs;
+    thread_local std::vector<uint32_t> owner;
+    splitWords(passage, words);
+    splitWords(typed, typedWords);
+    pairs.clear();
+    owner.clear();
+    report.wordErrors.assign(words.size(), 0);
+
+    const size_t LOOKAHEAD = 3;
+    size_t i = 0, j = 0;
+    while (i < words.size() && j < typedWords.size()) {
+        if (words[i] == typedWords[j]) {
+            i++;
+            j++;
+            continue;
+        }
+
+        // Skipped passage words: the typed word matches a later one
+        size_t skip = 0;
+        for (size_t d = 1; d <= LOOKAHEAD && i + d < words.size(); d++) {
+            if (words[i + d] == typedWords[j]) { skip = d; break; }
+        }
+        if (skip) {
+            for (size_t d = 0; d < skip; d++) report.wordErrors[i + d] += static_cast<uint32_t>(words[i + d].size());
+            i += skip;
+            continue;
+        }
+
+        // Extra typed words: a later typed word matches this passage word
+        size_t extra = 0;
+        for (size_t d = 1; d <= LOOKAHEAD && j + d < typedWords.size(); d++) {
+            if (typedWords[j + d] == words[i]) { extra = d; break; }
+        }
+        if (extra) {
+            for (size_t d = 0; d < extra; d++) report.wordErrors[i] += static_cast<uint32_t>(typedWords[j + d].size()) + 1;
+            j += extra;
+            continue;
+        }
+
+        // Misspelled word: score it in the batch below
+        WordPair pair;
+        pair.word = words[i];
+        pair.typed = typedWords[j];
+        pairs.push_back(pair);
+        owner.push_back(static_cast<uint32_t>(i));
+        i++;
+        j++;
+    }
+    for (; i < words.size(); i++) report.wordErrors[i] += static_cast<uint32_t>(words[i].size());
+
+    thread_local std::vector<uint32_t> distances;
+    distances.resize(pairs.size());
+    wordDistances(activeAccuracyKernel(), pairs, distances.data());
+    for (size_t p = 0; p < pairs.size(); p++) {
+        report.wordErrors[owner[p]] += distances[p];
+    }
+
+    report.wordsWithErrors = 0;
+    for (uint32_t errors : report.wordErrors) {
+        if (errors) report.wordsWithErrors++;
+    }
+    return report;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+// Minimal HTTP/1.0 endpoint for operators: GET requests only, one request
+// per connection, served on its own thread so a slow scraper never touches
+// the game loops. Bind it to loopback unless it sits behind something that
+// controls access.
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+class AdminServer {
+public:
+    using Handler = std::function<std::string()>;
+    // Gets the request's query string, without the '?'
+    using QueryHandler = std::function<std::string(const std::string& query)>;
+
+    AdminServer(const std::string& address, int port) : listenFd(-1) {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            std::cerr << "Error creating admin socket" << std::endl;
+            exit(1);
+        }
+        int opt = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) <= 0 ||
+            bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, 16) < 0) {
+            std::cerr << "Error binding admin port " << address << ":" << port << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+    }
+
+    ~AdminServer() {
+        // Wakes the blocked accept()
+        shutdown(listenFd, SHUT_RDWR);
+        if (thread.joinable()) thread.join();
+        ::close(listenFd);
+    }
+
+    // Register before start()
+    void route(const std::string& path, const std::string& contentType, Handler handler) {
+        routes[path] = Route{contentType, [handler](const std::string&) { return handler(); }};
+    }
+
+    void route(const std::string& path, const std::string& contentType, QueryHandler handler) {
+        routes[path] = Route{contentType, std::move(handler)};
+    }
+
+    // One parameter of a query string, percent-decoded; empty if absent
+    static std::string queryParam(const std::string& query, const std::string& key) {
+        size_t pos = 0;
+        while (pos <= query.size()) {
+            size_t end = query.find('&', pos);
+            if (end == std::string::npos) end = query.size();
+            size_t equals = query.find('=', pos);
+            if (equals < end && query.compare(pos, equals - pos, key) == 0 && equals - pos == key.size()) {
+                std::string value;
+                for (size_t i = equals + 1; i < end; i++) {
+                    if (query[i] == '+') {
+                        value += ' ';
+                    } else if (query[i] == '%' && i + 2 < end && isxdigit(query[i + 1]) && isxdigit(query[i + 2])) {
+                        value += static_cast<char>(std::stoi(query.substr(i + 1, 2), nullptr, 16));
+                        i += 2;
+                    } else {
+                        value += query[i];
+                    }
+                }
+                return value;
+            }
+            pos = end + 1;
+        }
+        return std::string();
+    }
+
+    void start() {
+        thread = std::thread(&AdminServer::run, this);
+    }
+
+private:
+    struct Route {
+        std::string contentType;
+        QueryHandler handler;
+    };
+
+    int listenFd;
+    std::thread thread;
+    std::unordered_map<std::string, Route> routes;
+
+    void run() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;   // shut down
+            }
+            serve(fd);
+            ::close(fd);
+        }
+    }
+
+    void serve(int fd) {
+        // Never let one stalled client hold up the next scrape
+        timeval timeout = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            request.append(buffer, n);
+        }
+
+        // Request line: METHOD SP PATH SP VERSION
+        size_t methodEnd = request.find(' ');
+        size_t pathEnd = methodEnd == std::string::npos ? std::string::npos : request.find(' ', methodEnd + 1);
+        if (pathEnd == std::string::npos) {
+            reply(fd, "400 Bad Request", "text/plain", "bad request\n");
+            return;
+        }
+        std::string method = request.substr(0, methodEnd);
+        std::string path = request.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+        size_t question = path.find('?');
+        std::string query = question == std::string::npos ? std::string() : path.substr(question + 1);
+        path = path.substr(0, question);
+
+        if (method != "GET") {
+            reply(fd, "405 Method Not Allowed", "text/plain", "only GET is supported\n");
+            return;
+        }
+        auto it = routes.find(path);
+        if (it == routes.end()) {
+            reply(fd, "404 Not Found", "text/plain", "not found\n");
+            return;
+        }
+        reply(fd, "200 OK", it->second.contentType, it->second.handler(query));
+    }
+
+    void reply(int fd, const char* status, const std::string& contentType, const std::string& body) {
+        std::string response = std::string("HTTP/1.0 ") + status + "\r\nContent-Type: " + contentType +
+                               "\r\nContent-Length: " + std::to_string(body.size()) +
+                               "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return;
+            sent += n;
+        }
+    }
+};
@@ -0,0 +1,739 @@
+#pragma once
+
+// Finished races in a columnar format for offline analysis: one row per
+// player per race, appended to files that the stats tool scans.
+//
+// File layout (all integers little-endian, varints LEB128):
+//
+//   header     32 bytes   "T2COLUMN", u32 version, u32 reserved,
+//                         u64 created (unix ms), u64 reserved
+//   groups                u32 body length, u32 rows, u16 columns, body
+//   body                  per column: u8 column, u8 encoding, u32 length, data
+//
+// Encodings:
+//
+//   PLAIN    one fixed-width value per row, the width set by the column
+//   DELTA    zigzag varint difference from the previous row, the first from 0
+//   DICT     varint entry count, the entries, u8 index width (1, 2 or 4),
+//            then one fixed-width index per row
+//   SPARSE   per row: varint list length, varint count of non-zero items,
+//            then per such item its varint gap from the one before and value
+//
+// Timestamps, room ids and durations barely move from row to row, so DELTA
+// keeps them to a byte or two; names and passages repeat, so DICT stores
+// each once per group. Every group carries its own dictionaries and decodes
+// on its own, which lets readers spread groups over threads. A group goes to
+// disk with one write(); a reader stops at a torn group at the end, as left
+// by a crash, and skips columns it does not know.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "corpus.h"
+#include "metrics.h"
+
+const char ANALYTICS_MAGIC[8] = {'T', '2', 'C', 'O', 'L', 'U', 'M', 'N'};
+const uint32_t ANALYTICS_VERSION = 1;
+const size_t ANALYTICS_HEADER_SIZE = 32;
+const size_t ANALYTICS_GROUP_HEADER_SIZE = 10;
+const size_t ANALYTICS_COLUMN_HEADER_SIZE = 6;
+// A group is written once it holds this many rows, or once its oldest row
+// has waited ANALYTICS_FLUSH_INTERVAL, so a quiet server still shows up
+const size_t ANALYTICS_GROUP_ROWS = 65536;
+const std::chrono::seconds ANALYTICS_FLUSH_INTERVAL(10);
+
+enum AnalyticsEncoding : uint8_t {
+    ENCODING_PLAIN = 1,
+    ENCODING_DELTA = 2,
+    ENCODING_DICT = 3,
+    ENCODING_SPARSE = 4
+};
+
+enum AnalyticsColumn : uint8_t {
+    COLUMN_FINISHED_AT = 1,   // DELTA, unix ms the room's results went out
+    COLUMN_STARTED_AT = 2,    // DELTA, unix ms of START
+    COLUMN_ROOM = 3,          // DELTA
+    COLUMN_PASSAGE = 4,       // DICT of u64 passage id (replayTextId), varint passage length
+    COLUMN_PLAYER = 5,        // DICT of varint length and name, empty for unrated players
+    COLUMN_FLAGS = 6,         // PLAIN u8
+    COLUMN_WPM = 7,           // PLAIN u32, hundredths
+    COLUMN_ACCURACY = 8,      // PLAIN u16, hundredths
+    COLUMN_END_MS = 9,        // DELTA, START to the player's FINISH or forfeit
+    COLUMN_KEYSTROKES = 10,   // DELTA
+    COLUMN_WORD_ERRORS = 11   // SPARSE, edits per passage word, empty when not known
+};
+
+enum AnalyticsFlags : uint8_t {
+    ANALYTICS_FORFEIT = 1     // left, went AFK or ran out of time; wpm and accuracy are 0
+};
+
+// One player's result as the server hands it to the writer
+struct AnalyticsRow {
+    uint64_t finishedAtMs;
+    uint64_t startedAtMs;
+    uint64_t roomId;
+    uint64_t passageId;
+    uint32_t passageLength;
+    std::string name;
+    uint8_t flags;
+    uint32_t wpm;             // hundredths
+    uint16_t accuracy;        // hundredths
+    uint32_t endMs;
+    uint32_t keystrokes;
+    std::vector<uint32_t> wordErrors;   // per passage word; empty for passages scored in segments
+};
+
+// One group's columns as read back. Dictionary entries are views into the
+// mapping; the per-row columns are plain arrays, ready for tight loops.
+struct AnalyticsGroup {
+    size_t rows = 0;
+    std::vector<uint64_t> finishedAtMs;
+    std::vector<uint64_t> startedAtMs;
+    std::vector<uint64_t> roomId;
+    std::vector<uint64_t> passageIds;        // dictionary
+    std::vector<uint32_t> passageLengths;    // dictionary, alongside passageIds
+    std::vector<uint32_t> passage;           // per row, index into the passage dictionary
+    std::vector<std::string_view> players;   // dictionary
+    std::vector<uint32_t> player;            // per row, index into players
+    std::vector<uint8_t> flags;
+    std::vector<uint32_t> wpm;
+    std::vector<uint16_t> accuracy;
+    std::vector<uint32_t> endMs;
+    std::vector<uint32_t> keystrokes;
+    // Word errors: a row's non-zero entries are errorWord/errorCount from
+    // errorOffset[row] to errorOffset[row + 1], and wordCount[row] is the
+    // length of its whole list
+    std::vector<uint32_t> wordCount;
+    std::vector<uint32_t> errorOffset;
+    std::vector<uint32_t> errorWord;
+    std::vector<uint32_t> errorCount;
+};
+
+namespace analytics_detail {
+
+inline void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline bool readVarint(const char*& p, const char* end, uint64_t& value) {
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = static_cast<uint8_t>(*p++);
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline void appendColumn(std::string& out, AnalyticsColumn column, AnalyticsEncoding encoding,
+                         const std::string& data) {
+    out.push_back(static_cast<char>(column));
+    out.push_back(static_cast<char>(encoding));
+    corpus_detail::storeLE32(out, static_cast<uint32_t>(data.size()));
+    out += data;
+}
+
+template <typename Field>
+void encodeDelta(std::string& data, const std::vector<AnalyticsRow>& rows, Field field) {
+    uint64_t previous = 0;
+    for (const AnalyticsRow& row : rows) {
+        uint64_t value = field(row);
+        appendVarint(data, zigzag(static_cast<int64_t>(value - previous)));
+        previous = value;
+    }
+}
+
+inline void encodeIndices(std::string& data, const std::vector<uint32_t>& indices, size_t entries) {
+    uint8_t width = entries <= 0x100 ? 1 : entries <= 0x10000 ? 2 : 4;
+    data.push_back(static_cast<char>(width));
+    for (uint32_t index : indices) {
+        if (width == 1) {
+            data.push_back(static_cast<char>(index));
+        } else if (width == 2) {
+            corpus_detail::storeLE16(data, static_cast<uint16_t>(index));
+        } else {
+            corpus_detail::storeLE32(data, index);
+        }
+    }
+}
+
+template <typename T>
+bool decodeDelta(const char* p, const char* end, size_t rows, std::vector<T>& out) {
+    out.resize(rows);
+    uint64_t value = 0;
+    for (size_t i = 0; i < rows; i++) {
+        uint64_t delta;
+        if (!readVarint(p, end, delta)) return false;
+        value += static_cast<uint64_t>(unzigzag(delta));
+        out[i] = static_cast<T>(value);
+    }
+    return p == end;
+}
+
+inline bool decodeIndices(const char* p, const char* end, size_t rows, size_t entries, std::vector<uint32_t>& out) {
+    using namespace corpus_detail;
+
+    if (p == end) return false;
+    uint8_t width = static_cast<uint8_t>(*p++);
+    if ((width != 1 && width != 2 && width != 4) || static_cast<size_t>(end - p) != rows * width) return false;
+    out.resize(rows);
+    uint32_t* dst = out.data();
+    if (width == 1) {
+        for (size_t i = 0; i < rows; i++) dst[i] = static_cast<uint8_t>(p[i]);
+    } else if (width == 2) {
+        for (size_t i = 0; i < rows; i++) dst[i] = loadLE16(p + 2 * i);
+    } else {
+        for (size_t i = 0; i < rows; i++) dst[i] = loadLE32(p + 4 * i);
+    }
+    // One bounds check for the whole column instead of one per row
+    uint32_t highest = 0;
+    for (size_t i = 0; i < rows; i++) highest = std::max(highest, dst[i]);
+    return rows == 0 || highest < entries;
+}
+
+}  // namespace analytics_detail
+
+// Encode rows as one group, header included, onto out
+inline void encodeAnalyticsGroup(const std::vector<AnalyticsRow>& rows, std::string& out) {
+    using namespace analytics_detail;
+    using namespace corpus_detail;
+
+    std::string body, data;
+    uint16_t columns = 0;
+    auto column = [&](AnalyticsColumn id, AnalyticsEncoding encoding) {
+        appendColumn(body, id, encoding, data);
+        data.clear();
+        columns++;
+    };
+
+    encodeDelta(data, rows, [](const AnalyticsRow& row) { return row.finishedAtMs; });
+    column(COLUMN_FINISHED_AT, ENCODING_DELTA);
+    encodeDelta(data, rows, [](const AnalyticsRow& row) { return row.startedAtMs; });
+    column(COLUMN_STARTED_AT, ENCODING_DELTA);
+    encodeDelta(data, rows, [](const AnalyticsRow& row) { return row.roomId; });
+    column(COLUMN_ROOM, ENCODING_DELTA);
+
+    // Dictionaries list entries in order of first use
+    std::vector<uint32_t> indices;
+    indices.reserve(rows.size());
+    {
+        std::unordered_map<uint64_t, uint32_t> seen;
+        std::string entries;
+        for (const AnalyticsRow& row : rows) {
+            auto added = seen.emplace(row.passageId, static_cast<uint32_t>(seen.size()));
+            if (added.second) {
+                storeLE64(entries, row.passageId);
+                appendVarint(entries, row.passageLength);
+            }
+            indices.push_back(added.first->second);
+        }
+        appendVarint(data, seen.size());
+        data += entries;
+        encodeIndices(data, indices, seen.size());
+        column(COLUMN_PASSAGE, ENCODING_DICT);
+    }
+    indices.clear();
+    {
+        std::unordered_map<std::string_view, uint32_t> seen;
+        std::string entries;
+        for (const AnalyticsRow& row : rows) {
+            auto added = seen.emplace(row.name, static_cast<uint32_t>(seen.size()));
+            if (added.second) {
+                appendVarint(entries, row.name.size());
+                entries += row.name;
+            }
+            indices.push_back(added.first->second);
+        }
+        appendVarint(data, seen.size());
+        data += entries;
+        encodeIndices(data, indices, seen.size());
+        column(COLUMN_PLAYER, ENCODING_DICT);
+    }
+
+    for (const AnalyticsRow& row : rows) data.push_back(static_cast<char>(row.flags));
+    column(COLUMN_FLAGS, ENCODING_PLAIN);
+    for (const AnalyticsRow& row : rows) storeLE32(data, row.wpm);
+    column(COLUMN_WPM, ENCODING_PLAIN);
+    for (const AnalyticsRow& row : rows) storeLE16(data, row.accuracy);
+    column(COLUMN_ACCURACY, ENCODING_PLAIN);
+    encodeDelta(data, rows, [](const AnalyticsRow& row) { return row.endMs; });
+    column(COLUMN_END_MS, ENCODING_DELTA);
+    encodeDelta(data, rows, [](const AnalyticsRow& row) { return row.keystrokes; });
+    column(COLUMN_KEYSTROKES, ENCODING_DELTA);
+
+    for (const AnalyticsRow& row : rows) {
+        appendVarint(data, row.wordErrors.size());
+        size_t nonZero = 0;
+        for (uint32_t errors : row.wordErrors) nonZero += errors != 0;
+        appendVarint(data, nonZero);
+        size_t next = 0;
+        for (size_t i = 0; i < row.wordErrors.size(); i++) {
+            if (!row.wordErrors[i]) continue;
+            appendVarint(data, i - next);
+            appendVarint(data, row.wordErrors[i]);
+            next = i + 1;
+        }
+    }
+    column(COLUMN_WORD_ERRORS, ENCODING_SPARSE);
+
+    storeLE32(out, static_cast<uint32_t>(body.size()));
+    storeLE32(out, static_cast<uint32_t>(rows.size()));
+    storeLE16(out, columns);
+    out += body;
+}
+
+// Decode one group's body. Columns the group lacks come back as zeros and
+// empty word lists. False if the body is malformed.
+inline bool decodeAnalyticsGroup(const char* p, const char* end, size_t rows, uint16_t columns,
+                                 AnalyticsGroup& out) {
+    using namespace analytics_detail;
+    using namespace corpus_detail;
+
+    // Every row takes at least a byte of the body
+    if (rows > static_cast<size_t>(end - p)) return false;
+    out.rows = rows;
+    out.finishedAtMs.clear();
+    out.startedAtMs.clear();
+    out.roomId.clear();
+    out.passageIds.clear();
+    out.passageLengths.clear();
+    out.passage.clear();
+    out.players.clear();
+    out.player.clear();
+    out.flags.clear();
+    out.wpm.clear();
+    out.accuracy.clear();
+    out.endMs.clear();
+    out.keystrokes.clear();
+    out.wordCount.clear();
+    out.errorOffset.clear();
+    out.errorWord.clear();
+    out.errorCount.clear();
+
+    for (uint16_t c = 0; c < columns; c++) {
+        if (static_cast<size_t>(end - p) < ANALYTICS_COLUMN_HEADER_SIZE) return false;
+        uint8_t id = static_cast<uint8_t>(p[0]);
+        uint8_t encoding = static_cast<uint8_t>(p[1]);
+        uint32_t length = loadLE32(p + 2);
+        p += ANALYTICS_COLUMN_HEADER_SIZE;
+        if (static_cast<size_t>(end - p) < length) return false;
+        const char* data = p;
+        const char* dataEnd = p + length;
+        p = dataEnd;
+
+        bool ok = true;
+        switch (id) {
+            case COLUMN_FINISHED_AT:
+                ok = encoding == ENCODING_DELTA && decodeDelta(data, dataEnd, rows, out.finishedAtMs);
+                break;
+            case COLUMN_STARTED_AT:
+                ok = encoding == ENCODING_DELTA && decodeDelta(data, dataEnd, rows, out.startedAtMs);
+                break;
+            case COLUMN_ROOM:
+                ok = encoding == ENCODING_DELTA && decodeDelta(data, dataEnd, rows, out.roomId);
+                break;
+            case COLUMN_END_MS:
+                ok = encoding == ENCODING_DELTA && decodeDelta(data, dataEnd, rows, out.endMs);
+                break;
+            case COLUMN_KEYSTROKES:
+                ok = encoding == ENCODING_DELTA && decodeDelta(data, dataEnd, rows, out.keystrokes);
+                break;
+            case COLUMN_PASSAGE: {
+                uint64_t entries, passageLength;
+                if (encoding != ENCODING_DICT || !readVarint(data, dataEnd, entries) ||
+                    entries > static_cast<uint64_t>(dataEnd - data)) {
+                    return false;
+                }
+                for (uint64_t i = 0; i < entries; i++) {
+                    if (dataEnd - data < 8) return false;
+                    out.passageIds.push_back(loadLE64(data));
+                    data += 8;
+                    if (!readVarint(data, dataEnd, passageLength)) return false;
+                    out.passageLengths.push_back(static_cast<uint32_t>(passageLength));
+                }
+                ok = decodeIndices(data, dataEnd, rows, entries, out.passage);
+                break;
+            }
+            case COLUMN_PLAYER: {
+                uint64_t entries, nameLength;
+                if (encoding != ENCODING_DICT || !readVarint(data, dataEnd, entries) ||
+                    entries > static_cast<uint64_t>(dataEnd - data)) {
+                    return false;
+                }
+                for (uint64_t i = 0; i < entries; i++) {
+                    if (!readVarint(data, dataEnd, nameLength) || nameLength > static_cast<uint64_t>(dataEnd - data)) {
+                        return false;
+                    }
+                    out.players.emplace_back(data, nameLength);
+                    data += nameLength;
+                }
+                ok = decodeIndices(data, dataEnd, rows, entries, out.player);
+                break;
+            }
+            case COLUMN_FLAGS:
+                ok = encoding == ENCODING_PLAIN && length == rows;
+                if (ok) out.flags.assign(data, dataEnd);
+                break;
+            case COLUMN_WPM:
+                ok = encoding == ENCODING_PLAIN && length == rows * 4;
+                if (ok) {
+                    out.wpm.resize(rows);
+                    for (size_t i = 0; i < rows; i++) out.wpm[i] = loadLE32(data + 4 * i);
+                }
+                break;
+            case COLUMN_ACCURACY:
+                ok = encoding == ENCODING_PLAIN && length == rows * 2;
+                if (ok) {
+                    out.accuracy.resize(rows);
+                    for (size_t i = 0; i < rows; i++) out.accuracy[i] = loadLE16(data + 2 * i);
+                }
+                break;
+            case COLUMN_WORD_ERRORS: {
+                if (encoding != ENCODING_SPARSE) return false;
+                out.wordCount.resize(rows);
+                out.errorOffset.resize(rows + 1);
+                out.errorOffset[0] = 0;
+                for (size_t i = 0; i < rows; i++) {
+                    uint64_t count, nonZero, gap, errors;
+                    if (!readVarint(data, dataEnd, count) || !readVarint(data, dataEnd, nonZero) || nonZero > count ||
+                        count > UINT32_MAX) {
+                        return false;
+                    }
+                    uint64_t word = 0;
+                    for (uint64_t e = 0; e < nonZero; e++) {
+                        if (!readVarint(data, dataEnd, gap) || !readVarint(data, dataEnd, errors)) return false;
+                        word += gap;
+                        if (word >= count) return false;
+                        out.errorWord.push_back(static_cast<uint32_t>(word));
+                        out.errorCount.push_back(static_cast<uint32_t>(errors));
+                        word++;
+                    }
+                    out.wordCount[i] = static_cast<uint32_t>(count);
+                    out.errorOffset[i + 1] = static_cast<uint32_t>(out.errorWord.size());
+                }
+                ok = data == dataEnd;
+                break;
+            }
+            default:
+                break;   // written by a newer server
+        }
+        if (!ok) return false;
+    }
+
+    // Defaults for columns an older writer did not have
+    out.finishedAtMs.resize(rows);
+    out.startedAtMs.resize(rows);
+    out.roomId.resize(rows);
+    out.endMs.resize(rows);
+    out.keystrokes.resize(rows);
+    out.flags.resize(rows);
+    out.wpm.resize(rows);
+    out.accuracy.resize(rows);
+    if (out.passage.size() != rows) {
+        out.passageIds.assign(1, 0);
+        out.passageLengths.assign(1, 0);
+        out.passage.assign(rows, 0);
+    }
+    if (out.player.size() != rows) {
+        out.players.assign(1, std::string_view());
+        out.player.assign(rows, 0);
+    }
+    if (out.wordCount.size() != rows) {
+        out.wordCount.assign(rows, 0);
+        out.errorOffset.assign(rows + 1, 0);
+    }
+    return true;
+}
+
+// Appends rows to analytics files on a thread of its own, in groups of up
+// to ANALYTICS_GROUP_ROWS. Network threads hand a race's rows over with
+// trySubmit(), which never blocks: when more than maxQueuedRows are waiting
+// the race is dropped and counted. A new file is started once the current
+// one passes fileBytes.
+class AnalyticsWriter {
+public:
+    AnalyticsWriter(std::string directory, size_t fileBytes, size_t maxQueuedRows)
+        : directory(std::move(directory)), fileBytes(fileBytes), maxQueuedRows(maxQueuedRows), stopping(false),
+          fd(-1), fileSize(0) {}
+
+    ~AnalyticsWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        if (writer.joinable()) writer.join();
+        if (fd >= 0) ::close(fd);
+    }
+
+    // Open the first file and start the writer. On failure returns false
+    // and describes why in error.
+    bool start(std::string& error) {
+        mkdir(directory.c_str(), 0755);
+        if (!openFile(error)) return false;
+        writer = std::thread(&AnalyticsWriter::run, this);
+        return true;
+    }
+
+    // Never blocks. On false the race's rows were dropped.
+    bool trySubmit(std::vector<AnalyticsRow>&& race) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() + race.size() > maxQueuedRows) {
+                countMetric(ANALYTICS_ROWS_DROPPED, race.size());
+                return false;
+            }
+            for (AnalyticsRow& row : race) queue.push_back(std::move(row));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+private:
+    std::string directory;
+    size_t fileBytes;
+    size_t maxQueuedRows;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<AnalyticsRow> queue;
+    bool stopping;
+    std::thread writer;
+
+    // Writer thread only, after start()
+    int fd;
+    size_t fileSize;
+
+    bool openFile(std::string& error) {
+        using namespace corpus_detail;
+
+        uint64_t created = std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+        int next = -1;
+        std::string path;
+        // Names sort by creation time; a name already taken moves up a millisecond
+        for (int attempt = 0; attempt < 1000 && next < 0; attempt++) {
+            char name[64];
+            snprintf(name, sizeof(name), "/analytics-%013llu.t2c", static_cast<unsigned long long>(created + attempt));
+            path = directory + name;
+            next = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+            if (next < 0 && errno != EEXIST) break;
+        }
+        if (next < 0) {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+
+        std::string header(ANALYTICS_MAGIC, sizeof(ANALYTICS_MAGIC));
+        storeLE32(header, ANALYTICS_VERSION);
+        storeLE32(header, 0);
+        storeLE64(header, created);
+        storeLE64(header, 0);
+        if (!writeAll(next, header)) {
+            error = path + ": " + strerror(errno);
+            ::close(next);
+            return false;
+        }
+        if (fd >= 0) ::close(fd);
+        fd = next;
+        fileSize = header.size();
+        return true;
+    }
+
+    static bool writeAll(int out, const std::string& bytes) {
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t n = ::write(out, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void writeGroup(std::vector<AnalyticsRow>& rows) {
+        std::string group;
+        encodeAnalyticsGroup(rows, group);
+        if (fileSize > ANALYTICS_HEADER_SIZE && fileSize + group.size() > fileBytes) {
+            std::string error;
+            if (!openFile(error)) {
+                // Keep to the old one for now rather than retry every group
+                std::cerr << "Error starting an analytics file: " << error << std::endl;
+                fileSize = ANALYTICS_HEADER_SIZE;
+            }
+        }
+        if (writeAll(fd, group)) {
+            countMetric(ANALYTICS_ROWS_WRITTEN, rows.size());
+            countMetric(ANALYTICS_BYTES_WRITTEN, group.size());
+            fileSize += group.size();
+        } else {
+            // Cut a partial write back off so the file ends on a whole group.
+            // If that fails too, readers stop at the torn group, so nothing
+            // more may follow it in this file.
+            std::cerr << "Error writing analytics: " << strerror(errno) << std::endl;
+            if (ftruncate(fd, static_cast<off_t>(fileSize)) != 0) fileSize = fileBytes;
+        }
+        rows.clear();
+    }
+
+    void run() {
+        std::vector<AnalyticsRow> group;
+        auto groupStarted = std::chrono::steady_clock::now();
+        while (true) {
+            bool last;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait_for(lock, ANALYTICS_FLUSH_INTERVAL, [this]() { return stopping || !queue.empty(); });
+                last = stopping;
+                if (group.empty() && !queue.empty()) groupStarted = std::chrono::steady_clock::now();
+                for (AnalyticsRow& row : queue) group.push_back(std::move(row));
+                queue.clear();
+            }
+
+            while (group.size() >= ANALYTICS_GROUP_ROWS) {
+                std::vector<AnalyticsRow> rest(std::make_move_iterator(group.begin() + ANALYTICS_GROUP_ROWS),
+                                               std::make_move_iterator(group.end()));
+                group.resize(ANALYTICS_GROUP_ROWS);
+                writeGroup(group);
+                group.swap(rest);
+                groupStarted = std::chrono::steady_clock::now();
+            }
+            if (!group.empty() && (last || std::chrono::steady_clock::now() - groupStarted >= ANALYTICS_FLUSH_INTERVAL)) {
+                writeGroup(group);
+            }
+            if (last) return;
+        }
+    }
+};
+
+// A file mapped for reading. Groups are indexed once when it is opened, by
+// hopping from header to header; decoding one touches only its own bytes.
+class AnalyticsFile {
+public:
+    AnalyticsFile(const AnalyticsFile&) = delete;
+    AnalyticsFile& operator=(const AnalyticsFile&) = delete;
+
+    ~AnalyticsFile() {
+        if (base) munmap(const_cast<char*>(base), length);
+    }
+
+    // Map a file. On failure returns null and describes why in error.
+    static std::unique_ptr<AnalyticsFile> open(const std::string& path, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = path + ": " + strerror(errno);
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(ANALYTICS_HEADER_SIZE)) {
+            error = path + ": not an analytics file";
+            ::close(fd);
+            return nullptr;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            error = path + ": mmap failed: " + strerror(errno);
+            return nullptr;
+        }
+        // Groups are decoded front to back
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        std::unique_ptr<AnalyticsFile> file(new AnalyticsFile(static_cast<const char*>(data), size, path));
+        if (!file->index(error)) {
+            error = path + ": " + error;
+            return nullptr;
+        }
+        return file;
+    }
+
+    size_t groups() const { return spans.size(); }
+    uint64_t rows() const { return totalRows; }
+    const std::string& source() const { return origin; }
+    uint64_t createdAtMs() const { return corpus_detail::loadLE64(base + 16); }
+    // Bytes at the end that do not form a whole group
+    size_t tornBytes() const { return torn; }
+
+    // Decode a group by position. False if it is malformed.
+    bool decode(size_t index, AnalyticsGroup& out) const {
+        const Span& span = spans[index];
+        return decodeAnalyticsGroup(base + span.offset, base + span.offset + span.length, span.rows, span.columns, out);
+    }
+
+private:
+    struct Span {
+        size_t offset;
+        uint32_t length;
+        uint32_t rows;
+        uint16_t columns;
+    };
+
+    const char* base;
+    size_t length;
+    std::string origin;
+    std::vector<Span> spans;
+    uint64_t totalRows;
+    size_t torn;
+
+    AnalyticsFile(const char* base, size_t length, const std::string& origin)
+        : base(base), length(length), origin(origin), totalRows(0), torn(0) {}
+
+    bool index(std::string& error) {
+        using namespace corpus_detail;
+
+        if (memcmp(base, ANALYTICS_MAGIC, sizeof(ANALYTICS_MAGIC)) != 0) {
+            error = "not an analytics file";
+            return false;
+        }
+        if (loadLE32(base + 8) != ANALYTICS_VERSION) {
+            error = "unsupported analytics version " + std::to_string(loadLE32(base + 8));
+            return false;
+        }
+
+        size_t pos = ANALYTICS_HEADER_SIZE;
+        while (length - pos >= ANALYTICS_GROUP_HEADER_SIZE) {
+            uint32_t body = loadLE32(base + pos);
+            uint32_t rows = loadLE32(base + pos + 4);
+            uint16_t columns = loadLE16(base + pos + 8);
+            size_t start = pos + ANALYTICS_GROUP_HEADER_SIZE;
+            if (length - start < body) break;
+            spans.push_back({start, body, rows, columns});
+            totalRows += rows;
+            pos = start + body;
+        }
+        torn = length - pos;
+        return true;
+    }
+};
@@ -0,0 +1,676 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "keylog.h"
+#include "protocol.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Headless load generator: drives many simulated players against a server
+// over non-blocking sockets and reports throughput and latency percentiles.
+// Linux only (epoll), like the server.
+
+// Bots only ever receive START, TEXT, SNAPSHOT and RESULTS, and START holds
+// at most a text window, so a smaller inbound buffer than the interactive
+// client's is enough
+const size_t BOT_INBOUND_BUFFER = FRAME_HEADER_SIZE + 16 + TEXT_WINDOW;
+
+struct BotConfig {
+    string host = "127.0.0.1";
+    int port = 8080;
+    int players = 1000;
+    int threads = 1;
+    double connectRate = 500;     // new connections per second, across all threads
+    int roomSize = 2;             // must match the server's --room-size
+    double wpmMean = 60;
+    double wpmStddev = 15;
+    double errorRate = 0.03;      // chance of a typo per character
+    double fixRate = 0.8;         // chance a typo is backspaced and fixed
+    int progressMs = 200;
+    double timeScale = 1.0;       // < 1 types faster than the simulated clock
+    uint64_t seed = 1;
+    int timeoutSec = 120;         // players still unfinished by then count as failed
+    int spectators = 0;           // watchers, connected once their thread's first room starts
+    uint64_t watchRoom = 0;       // room they watch, 0 for the latest to start
+    string namePrefix;            // players go by prefix + thread-id, so they are rated; empty plays unrated
+};
+
+// Timestamps are nanoseconds since the run began, -1 if never reached
+struct PlayerTrace {
+    uint64_t roomId = 0;
+    int64_t connectStart = -1;
+    int64_t connected = -1;
+    int64_t startAt = -1;
+    int64_t finishSent = -1;
+    int64_t resultsAt = -1;
+};
+
+enum BotState { BOT_CONNECTING, BOT_WAITING_START, BOT_TYPING, BOT_WAITING_RESULTS, BOT_DONE };
+
+struct Keystroke {
+    uint32_t timeMs;      // since START, on the simulated clock
+    uint8_t key;
+};
+
+struct Bot {
+    int fd = -1;
+    bool spectator = false;
+    BotState state = BOT_CONNECTING;
+    FrameDecoder decoder{BOT_INBOUND_BUFFER, BOT_INBOUND_BUFFER - FRAME_HEADER_SIZE};
+    string outBuf;
+    size_t outOffset = 0;
+    PlayerTrace trace;
+
+    string text;                  // the passage as far as it has arrived
+    uint32_t passageLength = 0;
+    deque<Keystroke> plan;        // keystrokes still to make, for the text so far
+    double planMs = 0;            // time of the last planned keystroke
+    KeyLogWriter log;             // keystrokes made since the last report
+    string typed;
+    uint32_t errors = 0;          // typed characters that differ from the text
+    double wpm = 0;
+    size_t snapshots = 0;         // SNAPSHOTs received
+};
+
+static steady_clock::time_point runStart;
+
+static int64_t nowNs() {
+    return duration_cast<nanoseconds>(steady_clock::now() - runStart).count();
+}
+
+class BotWorker {
+public:
+    BotWorker(const BotConfig& config, int index, int players, int spectators, const sockaddr_storage& server,
+              socklen_t serverLen)
+        : config(config), index(index), server(server), serverLen(serverLen), rng(config.seed + index),
+          playerCount(players), completed(0), failed(0), watchersDone(0), watchersFailed(0) {
+        // Players first, then spectators
+        bots.resize(players + spectators);
+        for (size_t id = players; id < bots.size(); id++) bots[id].spectator = true;
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            cerr << "epoll_create1 failed: " << strerror(errno) << endl;
+            exit(1);
+        }
+    }
+
+    ~BotWorker() {
+        for (Bot& bot : bots) {
+            if (bot.fd >= 0) close(bot.fd);
+        }
+        close(epollFd);
+    }
+
+    void run() {
+        // This thread's share of the connect rate, offset so threads interleave
+        double rate = config.connectRate / config.threads;
+        int64_t spacingNs = rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0;
+        int64_t firstNs = spacingNs * index / config.threads;
+        size_t spawned = 0;
+        size_t spawnedWatchers = playerCount;
+
+        int64_t deadline = static_cast<int64_t>(config.timeoutSec) * 1000000000;
+        epoll_event events[256];
+        while (completed + failed + watchersDone + watchersFailed < bots.size()) {
+            int64_t now = nowNs();
+            if (now >= deadline) {
+                for (size_t id = 0; id < bots.size(); id++) fail(id);
+                break;
+            }
+            while (spawned < playerCount && firstNs + static_cast<int64_t>(spawned) * spacingNs <= now) {
+                startConnect(spawned++);
+            }
+            // Spectators need a race to watch
+            while (roomStarted && spawnedWatchers < bots.size()) {
+                startConnect(spawnedWatchers++);
+            }
+
+            int64_t wake = deadline;
+            if (spawned < playerCount) wake = firstNs + static_cast<int64_t>(spawned) * spacingNs;
+            if (!timers.empty()) wake = min(wake, timers.top().first);
+            int timeout = static_cast<int>(max<int64_t>(0, (wake - now + 999999) / 1000000));
+
+            int n = epoll_wait(epollFd, events, 256, timeout);
+            if (n < 0 && errno != EINTR) {
+                cerr << "epoll_wait failed: " << strerror(errno) << endl;
+                exit(1);
+            }
+            for (int i = 0; i < n; i++) {
+                size_t id = events[i].data.u64;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    fail(id);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) handleWrite(id);
+                if (events[i].events & EPOLLIN) handleRead(id);
+            }
+
+            now = nowNs();
+            while (!timers.empty() && timers.top().first <= now) {
+                size_t id = timers.top().second;
+                timers.pop();
+                advanceTyping(id);
+            }
+        }
+    }
+
+    const vector<Bot>& players() const { return bots; }
+    size_t completedCount() const { return completed; }
+    size_t failedCount() const { return failed; }
+    size_t watchersDoneCount() const { return watchersDone; }
+    size_t watchersFailedCount() const { return watchersFailed; }
+
+private:
+    const BotConfig& config;
+    int index;
+    sockaddr_storage server;
+    socklen_t serverLen;
+    mt19937_64 rng;
+    int epollFd;
+    vector<Bot> bots;
+    // (due, bot) for every typing bot's next progress report
+    priority_queue<pair<int64_t, size_t>, vector<pair<int64_t, size_t>>, greater<pair<int64_t, size_t>>> timers;
+    size_t playerCount;
+    size_t completed;
+    size_t failed;
+    size_t watchersDone;
+    size_t watchersFailed;
+    bool roomStarted = false;      // one of this thread's players got a START
+
+    void startConnect(size_t id) {
+        Bot& bot = bots[id];
+        bot.trace.connectStart = nowNs();
+        bot.fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (bot.fd < 0) {
+            cerr << "socket failed: " << strerror(errno) << endl;
+            fail(id);
+            return;
+        }
+        int one = 1;
+        setsockopt(bot.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(bot.fd, reinterpret_cast<sockaddr*>(&server), serverLen) < 0 && errno != EINPROGRESS) {
+            fail(id);
+            return;
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = id;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, bot.fd, &ev);
+
+        // Goes out once the connection is up
+        if (bot.spectator) {
+            encodeSpectate(bot.outBuf, config.watchRoom);
+        } else {
+            string name;
+            if (!config.namePrefix.empty()) name = config.namePrefix + to_string(index) + "-" + to_string(id);
+            encodeHello(bot.outBuf, name);
+        }
+    }
+
+    void fail(size_t id) {
+        Bot& bot = bots[id];
+        if (bot.state == BOT_DONE) return;
+        if (bot.fd >= 0) {
+            close(bot.fd);
+            bot.fd = -1;
+        }
+        bot.state = BOT_DONE;
+        if (bot.spectator) {
+            watchersFailed++;
+        } else {
+            failed++;
+        }
+    }
+
+    void send(size_t id, const string& data) {
+        Bot& bot = bots[id];
+        bot.outBuf += data;
+        handleWrite(id);
+    }
+
+    void handleWrite(size_t id) {
+        Bot& bot = bots[id];
+        if (bot.state == BOT_DONE) return;
+        if (bot.state == BOT_CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(bot.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                fail(id);
+                return;
+            }
+            bot.trace.connected = nowNs();
+            bot.state = BOT_WAITING_START;
+        }
+        while (bot.outOffset < bot.outBuf.size()) {
+            ssize_t n = ::send(bot.fd, bot.outBuf.data() + bot.outOffset, bot.outBuf.size() - bot.outOffset, MSG_NOSIGNAL);
+            if (n > 0) {
+                bot.outOffset += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                return;   // EPOLLOUT picks it up
+            } else {
+                fail(id);
+                return;
+            }
+        }
+        bot.outBuf.clear();
+        bot.outOffset = 0;
+    }
+
+    void handleRead(size_t id) {
+        Bot& bot = bots[id];
+        while (bot.state != BOT_DONE) {
+            RingBuffer::Segment segments[2];
+            int count = bot.decoder.buffer().writableSegments(segments);
+            if (count == 0) {
+                fail(id);
+                return;
+            }
+            ssize_t n = recv(bot.fd, segments[0].data, segments[0].len, 0);
+            if (n > 0) {
+                bot.decoder.buffer().commit(n);
+                if (!dispatchFrames(id)) return;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                return;
+            } else {
+                fail(id);
+                return;
+            }
+        }
+    }
+
+    bool dispatchFrames(size_t id) {
+        Bot& bot = bots[id];
+        Frame frame;
+        while (true) {
+            DecodeStatus status = bot.decoder.next(frame);
+            if (status == DECODE_NEED_MORE) return true;
+            if (status == DECODE_ERROR) {
+                fail(id);
+                return false;
+            }
+
+            if (bot.spectator) {
+                if (!watchFrame(id, frame)) return false;
+                continue;
+            }
+            if (frame.type == MSG_START && bot.state == BOT_WAITING_START) {
+                StartMessage start;
+                if (!parseStart(frame.payload, start)) {
+                    fail(id);
+                    return false;
+                }
+                bot.trace.startAt = nowNs();
+                bot.trace.roomId = start.roomId;
+                bot.text.assign(start.text);
+                bot.passageLength = start.passageLength;
+                planTyping(bot);
+                bot.state = BOT_TYPING;
+                roomStarted = true;
+                timers.push({bot.trace.startAt + scaledNs(config.progressMs), id});
+            } else if (frame.type == MSG_TEXT && bot.state == BOT_TYPING) {
+                uint32_t offset;
+                string_view piece;
+                if (!parseText(frame.payload, offset, piece) || offset != bot.text.size() ||
+                    piece.size() > bot.passageLength - bot.text.size()) {
+                    fail(id);
+                    return false;
+                }
+                bot.text.append(piece.data(), piece.size());
+                planText(bot, piece);
+            } else if (frame.type == MSG_RESULTS && bot.state == BOT_WAITING_RESULTS) {
+                bot.trace.resultsAt = nowNs();
+                close(bot.fd);
+                bot.fd = -1;
+                bot.state = BOT_DONE;
+                completed++;
+                return false;
+            } else if (frame.type == MSG_ERROR) {
+                fail(id);
+                return false;
+            }
+            // SNAPSHOTs only cost us the read
+        }
+    }
+
+    // A spectator follows its room until RESULTS. Returns false once done.
+    bool watchFrame(size_t id, const Frame& frame) {
+        Bot& bot = bots[id];
+        if (frame.type == MSG_START) {
+            StartMessage start;
+            if (!parseStart(frame.payload, start) || start.playerId != SPECTATOR_ID) {
+                fail(id);
+                return false;
+            }
+            bot.trace.startAt = nowNs();
+            bot.trace.roomId = start.roomId;
+        } else if (frame.type == MSG_TEXT) {
+            // The rest of the passage; a bot has no use for it
+        } else if (frame.type == MSG_SNAPSHOT) {
+            bot.snapshots++;
+        } else if (frame.type == MSG_RESULTS) {
+            bot.trace.resultsAt = nowNs();
+            close(bot.fd);
+            bot.fd = -1;
+            bot.state = BOT_DONE;
+            watchersDone++;
+            return false;
+        } else {
+            fail(id);
+            return false;
+        }
+        return true;
+    }
+
+    int64_t scaledNs(double simulatedMs) const {
+        return static_cast<int64_t>(simulatedMs * config.timeScale * 1e6);
+    }
+
+    // Draw a speed for this player, then plan its keystrokes for the text
+    // START brought
+    void planTyping(Bot& bot) {
+        normal_distribution<double> speed(config.wpmMean, config.wpmStddev);
+        bot.wpm = clamp(speed(rng), 10.0, 250.0);
+        bot.plan.clear();
+        bot.planMs = 0;
+        bot.log = KeyLogWriter();
+        bot.typed.clear();
+        bot.errors = 0;
+        planText(bot, bot.text);
+    }
+
+    // Plan the keystrokes for another piece of the passage
+    void planText(Bot& bot, string_view text) {
+        uniform_real_distribution<double> unit(0.0, 1.0);
+        uniform_int_distribution<int> letter('a', 'z');
+
+        double interval = 12000.0 / bot.wpm;   // 5 characters per word
+        auto press = [&](uint8_t key) {
+            bot.planMs += interval * (0.5 + unit(rng));
+            bot.plan.push_back({static_cast<uint32_t>(bot.planMs), key});
+        };
+
+        for (char c : text) {
+            if (unit(rng) < config.errorRate) {
+                char wrong = static_cast<char>(letter(rng));
+                if (wrong == c) wrong = wrong == 'z' ? 'a' : wrong + 1;
+                press(static_cast<uint8_t>(wrong));
+                if (unit(rng) >= config.fixRate) continue;
+                press(KEY_BACKSPACE);
+            }
+            press(static_cast<uint8_t>(c));
+        }
+    }
+
+    // Replay keystrokes up to the simulated time, then report progress and
+    // the keystrokes since the last report, or finish once every key of the
+    // whole passage is in
+    void advanceTyping(size_t id) {
+        Bot& bot = bots[id];
+        if (bot.state != BOT_TYPING) return;
+
+        double elapsedMs = (nowNs() - bot.trace.startAt) / 1e6 / config.timeScale;
+        while (!bot.plan.empty() && bot.plan.front().timeMs <= elapsedMs) {
+            Keystroke k = bot.plan.front();
+            bot.plan.pop_front();
+            bot.log.add(k.timeMs, k.key);
+            uint8_t key = k.key;
+            if (key == KEY_BACKSPACE) {
+                if (bot.typed.empty()) continue;
+                size_t pos = bot.typed.size() - 1;
+                if (pos < bot.text.size() && bot.typed[pos] != bot.text[pos]) bot.errors--;
+                bot.typed.pop_back();
+            } else {
+                size_t pos = bot.typed.size();
+                if (pos >= bot.text.size() || static_cast<char>(key) != bot.text[pos]) bot.errors++;
+                bot.typed.push_back(static_cast<char>(key));
+            }
+        }
+
+        string out;
+        uint32_t elapsed = static_cast<uint32_t>(elapsedMs);
+        encodeProgress(out, static_cast<uint32_t>(bot.typed.size()), bot.errors, elapsed);
+        encodeKeyLog(out, bot.log.take());
+        if (!bot.plan.empty() || bot.text.size() < bot.passageLength) {
+            timers.push({nowNs() + scaledNs(config.progressMs), id});
+            send(id, out);
+            return;
+        }
+
+        double accuracy = bot.passageLength == 0 ? 100.0
+                                                 : 100.0 * (1.0 - static_cast<double>(bot.errors) / bot.passageLength);
+        encodeFinish(out, bot.wpm, max(0.0, accuracy));
+        bot.state = BOT_WAITING_RESULTS;
+        bot.trace.finishSent = nowNs();
+        send(id, out);
+    }
+};
+
+struct Percentiles {
+    size_t count = 0;
+    double p50 = 0, p99 = 0, p999 = 0, max = 0;
+};
+
+static Percentiles percentiles(vector<int64_t>& samplesNs) {
+    Percentiles p;
+    p.count = samplesNs.size();
+    if (samplesNs.empty()) return p;
+    sort(samplesNs.begin(), samplesNs.end());
+    auto at = [&](double q) {
+        size_t i = static_cast<size_t>(q * (samplesNs.size() - 1) + 0.5);
+        return samplesNs[i] / 1e6;
+    };
+    p.p50 = at(0.50);
+    p.p99 = at(0.99);
+    p.p999 = at(0.999);
+    p.max = samplesNs.back() / 1e6;
+    return p;
+}
+
+static void printLatency(const string& name, const Percentiles& p) {
+    cout << name << " (ms, " << p.count << " samples): p50 " << p.p50 << "  p99 " << p.p99
+         << "  p999 " << p.p999 << "  max " << p.max << endl;
+}
+
+int main(int argc, char* argv[]) {
+    BotConfig config;
+
+    // --host A, --port N, --players N, --threads N, --connect-rate N, --room-size N,
+    // --wpm-mean N, --wpm-stddev N, --error-rate P, --fix-rate P, --progress-ms N,
+    // --time-scale X, --seed N, --timeout S, --spectators N, --watch-room ID,
+    // --name-prefix P
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        const char* value = argv[i + 1];
+        if (arg == "--host") {
+            config.host = value;
+        } else if (arg == "--port") {
+            config.port = atoi(value);
+        } else if (arg == "--players") {
+            config.players = max(1, atoi(value));
+        } else if (arg == "--threads") {
+            config.threads = max(1, atoi(value));
+        } else if (arg == "--connect-rate") {
+            config.connectRate = atof(value);
+        } else if (arg == "--room-size") {
+            config.roomSize = max(1, atoi(value));
+        } else if (arg == "--wpm-mean") {
+            config.wpmMean = atof(value);
+        } else if (arg == "--wpm-stddev") {
+            config.wpmStddev = max(0.0, atof(value));
+        } else if (arg == "--error-rate") {
+            config.errorRate = clamp(atof(value), 0.0, 1.0);
+        } else if (arg == "--fix-rate") {
+            config.fixRate = clamp(atof(value), 0.0, 1.0);
+        } else if (arg == "--progress-ms") {
+            config.progressMs = max(1, atoi(value));
+        } else if (arg == "--time-scale") {
+            config.timeScale = max(0.001, atof(value));
+        } else if (arg == "--timeout") {
+            config.timeoutSec = max(1, atoi(value));
+        } else if (arg == "--spectators") {
+            config.spectators = max(0, atoi(value));
+        } else if (arg == "--watch-room") {
+            config.watchRoom = strtoull(value, nullptr, 10);
+        } else if (arg == "--name-prefix") {
+            config.namePrefix = value;
+            if (config.namePrefix.size() + 16 > MAX_PLAYER_NAME) {
+                cerr << "Name prefix too long: " << value << endl;
+                return 1;
+            }
+        } else if (arg == "--seed") {
+            config.seed = strtoull(value, nullptr, 10);
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+
+    // A partly filled room never starts
+    if (config.players % config.roomSize != 0) {
+        config.players += config.roomSize - config.players % config.roomSize;
+        cout << "Rounding up to " << config.players << " players to fill every room" << endl;
+    }
+    config.threads = min(config.threads, config.players);
+
+    // IPv4 or IPv6 literal
+    sockaddr_storage server;
+    socklen_t serverLen;
+    memset(&server, 0, sizeof(server));
+    sockaddr_in* v4 = reinterpret_cast<sockaddr_in*>(&server);
+    sockaddr_in6* v6 = reinterpret_cast<sockaddr_in6*>(&server);
+    if (inet_pton(AF_INET, config.host.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(config.port);
+        serverLen = sizeof(sockaddr_in);
+    } else if (inet_pton(AF_INET6, config.host.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(config.port);
+        serverLen = sizeof(sockaddr_in6);
+    } else {
+        cerr << "Invalid address: " << config.host << endl;
+        return 1;
+    }
+
+    cout << "Driving " << config.players << " players at " << config.host << ":" << config.port << " from "
+         << config.threads << " threads, " << config.connectRate << " connections/s" << endl;
+
+    runStart = steady_clock::now();
+    vector<unique_ptr<BotWorker>> workers;
+    for (int i = 0; i < config.threads; i++) {
+        int share = config.players / config.threads + (i < config.players % config.threads ? 1 : 0);
+        int watchers = config.spectators / config.threads + (i < config.spectators % config.threads ? 1 : 0);
+        workers.emplace_back(new BotWorker(config, i, share, watchers, server, serverLen));
+    }
+    vector<thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(&BotWorker::run, worker.get());
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+    double elapsed = nowNs() / 1e9;
+
+    // Per room: the last player in, the first START out and the last FINISH sent
+    struct RoomTrace {
+        int64_t lastConnected = -1;
+        int64_t firstStart = INT64_MAX;
+        int64_t lastFinish = -1;
+        int completed = 0;
+    };
+    unordered_map<uint64_t, RoomTrace> rooms;
+    size_t completed = 0, failed = 0, connected = 0, watchersDone = 0, watchersFailed = 0, snapshots = 0;
+    int64_t firstConnect = INT64_MAX, lastConnected = 0;
+    for (auto& worker : workers) {
+        completed += worker->completedCount();
+        failed += worker->failedCount();
+        watchersDone += worker->watchersDoneCount();
+        watchersFailed += worker->watchersFailedCount();
+        for (const Bot& bot : worker->players()) {
+            snapshots += bot.snapshots;
+            if (bot.spectator) continue;
+            const PlayerTrace& t = bot.trace;
+            if (t.connectStart >= 0) firstConnect = min(firstConnect, t.connectStart);
+            if (t.connected >= 0) {
+                connected++;
+                lastConnected = max(lastConnected, t.connected);
+            }
+            if (t.startAt < 0) continue;
+            RoomTrace& room = rooms[t.roomId];
+            room.lastConnected = max(room.lastConnected, t.connected);
+            room.firstStart = min(room.firstStart, t.startAt);
+            room.lastFinish = max(room.lastFinish, t.finishSent);
+            if (t.resultsAt >= 0) room.completed++;
+        }
+    }
+
+    vector<int64_t> startLatency, resultsLatency, watcherLatency;
+    size_t games = 0;
+    for (const auto& entry : rooms) {
+        const RoomTrace& room = entry.second;
+        startLatency.push_back(max<int64_t>(0, room.firstStart - room.lastConnected));
+        if (room.completed == config.roomSize) games++;
+    }
+    for (auto& worker : workers) {
+        for (const Bot& bot : worker->players()) {
+            if (bot.trace.resultsAt < 0) continue;
+            auto room = rooms.find(bot.trace.roomId);
+            if (room == rooms.end()) continue;   // watched a room no bot played in
+            int64_t latency = max<int64_t>(0, bot.trace.resultsAt - room->second.lastFinish);
+            (bot.spectator ? watcherLatency : resultsLatency).push_back(latency);
+        }
+    }
+
+    double connectSeconds = connected ? max(1e-9, (lastConnected - firstConnect) / 1e9) : 0;
+    double connectionsPerSec = connectSeconds > 0 ? connected / connectSeconds : 0;
+    double gamesPerSec = elapsed > 0 ? games / elapsed : 0;
+    Percentiles start = percentiles(startLatency);
+    Percentiles results = percentiles(resultsLatency);
+
+    cout << fixed << setprecision(3);
+    cout << "\nPlayers: " << completed << " completed, " << failed << " failed, " << games << " games in "
+         << elapsed << " s" << endl;
+    cout << "Connections/sec: " << connectionsPerSec << endl;
+    cout << "Games/sec: " << gamesPerSec << endl;
+    printLatency("Last connect to START", start);
+    printLatency("Last FINISH to RESULTS", results);
+    if (config.spectators > 0) {
+        cout << "Spectators: " << watchersDone << " saw results, " << watchersFailed << " failed, " << snapshots
+             << " snapshots received" << endl;
+        Percentiles watched = percentiles(watcherLatency);
+        printLatency("Last FINISH to spectator RESULTS", watched);
+    }
+
+    // One line to keep for comparing runs
+    cout << "\nsummary players=" << config.players << " completed=" << completed << " failed=" << failed
+         << " games=" << games << " elapsed_s=" << elapsed << " conn_per_s=" << connectionsPerSec
+         << " games_per_s=" << gamesPerSec << " start_p50_ms=" << start.p50 << " start_p99_ms=" << start.p99
+         << " start_p999_ms=" << start.p999 << " results_p50_ms=" << results.p50
+         << " results_p99_ms=" << results.p99 << " results_p999_ms=" << results.p999 << endl;
+
+    return failed == 0 ? 0 : 1;
+}
@@ -1,215 +1,731 @@
-#include <iostream>
-#include <string>
-#include <chrono>
-#include <cstring>
-
-#ifdef _WIN32
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #pragma comment(lib, "ws2_32.lib")
-#else
-    #include <sys/socket.h>
-    #include <arpa/inet.h>
-    #include <unistd.h>
-#endif
-
-using namespace std;
-using namespace std::chrono;
-
-// Cross-platform socket close function
-void closeSocket(int socket) {
-    #ifdef _WIN32
-        closesocket(socket);
-    #else
-        close(socket);
-    #endif
-}
-
-class TypingClient {
-private:
-    int clientSocket;
-    string serverIP;
-    int serverPort;
-    
-    // Calculate words per minute
-    double calculateWPM(const string& text, double timeInSeconds) {
-        // Standard: 5 characters = 1 word
-        return (text.length() / 5.0) / (timeInSeconds / 60.0);
-    }
-    
-    // Calculate accuracy percentage
-    double calculateAccuracy(const string& original, const string& typed) {
-        int correctChars = 0;
-        int minLength = min(original.length(), typed.length());
-        
-        for (int i = 0; i < minLength; i++) {
-            if (original[i] == typed[i]) {
-                correctChars++;
-            }
-        }
-        
-        return (double)correctChars / original.length() * 100.0;
-    }
-
-public:
-    TypingClient(const string& ip, int port) : serverIP(ip), serverPort(port) {
-        #ifdef _WIN32
-            // Initialize Winsock
-            WSADATA wsaData;
-            if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-                cerr << "WSAStartup failed" << endl;
-                exit(1);
-            }
-        #endif
-
-        // Create socket
-        clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (clientSocket < 0) {
-            cerr << "Error creating socket" << endl;
-            exit(1);
-        }
-    }
-    
-    bool connectToServer() {
-        struct sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(serverPort);
-        
-        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
-            cerr << "Invalid address or address not supported" << endl;
-            return false;
-        }
-        
-        if (connect(clientSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-            cerr << "Connection failed" << endl;
-            return false;
-        }
-        
-        cout << "Connected to server at " << serverIP << ":" << serverPort << endl;
-        return true;
-    }
-    
-    void startGame() {
-        char buffer[1024] = {0};
-        
-        cout << "Waiting for another player to join..." << endl;
-        
-        // Wait for START message from server
-        memset(buffer, 0, sizeof(buffer));
-        int bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-        
-        if (bytesRead <= 0) {
-            cerr << "Server disconnected" << endl;
-            return;
-        }
-        
-        string message(buffer);
-        
-        if (message.substr(0, 6) != "START|") {
-            cerr << "Unexpected message from server" << endl;
-            return;
-        }
-        
-        // Extract text to type
-        string textToType = message.substr(6);
-        
-        cout << "\n=== Typing Test Started ===\n" << endl;
-        cout << "Type the following text:" << endl;
-        cout << textToType << endl;
-        cout << "\nType the text and press Enter when finished." << endl;
-        
-        cin.ignore(); // Wait for user to press Enter
-        
-        // Start timing
-        auto startTime = high_resolution_clock::now();
-        
-        // Get user input
-        string userInput;
-        getline(cin, userInput);
-        
-        // Stop timing
-        auto endTime = high_resolution_clock::now();
-        auto duration = duration_cast<milliseconds>(endTime - startTime);
-        double seconds = duration.count() / 1000.0;
-        
-        // Calculate results
-        double wpm = calculateWPM(userInput, seconds);
-        double accuracy = calculateAccuracy(textToType, userInput);
-        
-        // Display local results
-        cout << "\n=== Your Results ===\n" << endl;
-        cout << "Time: " << seconds << " seconds" << endl;
-        cout << "WPM: " << wpm << endl;
-        cout << "Accuracy: " << accuracy << "%" << endl;
-        
-        // Send results to server
-        string resultMsg = "FINISH|" + to_string(wpm) + "|" + to_string(accuracy);
-        send(clientSocket, resultMsg.c_str(), resultMsg.length(), 0);
-        
-        cout << "\nWaiting for other player to finish..." << endl;
-        
-        // Wait for results from server
-        memset(buffer, 0, sizeof(buffer));
-        bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-        
-        if (bytesRead <= 0) {
-            cerr << "Server disconnected" << endl;
-            return;
-        }
-        
-        message = string(buffer);
-        
-        if (message.substr(0, 8) == "RESULTS|") {
-            cout << "\n=== Final Results ===\n" << endl;
-            
-            // Parse results
-            string resultsStr = message.substr(8);
-            size_t pos = 0;
-            while ((pos = resultsStr.find("|")) != string::npos) {
-                string playerResult = resultsStr.substr(0, pos);
-                resultsStr.erase(0, pos + 1);
-                
-                if (playerResult.empty()) continue;
-                
-                // Parse player result (id,wpm,accuracy)
-                size_t commaPos1 = playerResult.find(",");
-                size_t commaPos2 = playerResult.find(",", commaPos1 + 1);
-                
-                int playerId = stoi(playerResult.substr(0, commaPos1));
-                double playerWpm = stod(playerResult.substr(commaPos1 + 1, commaPos2 - commaPos1 - 1));
-                double playerAccuracy = stod(playerResult.substr(commaPos2 + 1));
-                
-                cout << "Player " << playerId + 1 << ":" << endl;
-                cout << "  WPM: " << playerWpm << endl;
-                cout << "  Accuracy: " << playerAccuracy << "%" << endl;
-                cout << endl;
-            }
-        }
-    cout << "Press Enter to quit..." << endl;
-    string dummy;
-    getline(cin, dummy);
-    }
-    
-    ~TypingClient() {
-        closeSocket(clientSocket);
-        
-        #ifdef _WIN32
-            WSACleanup();
-        #endif
-    }
-};
-
-int main(int argc, char* argv[]) {
-    string serverIP;
-    int serverPort = 8080; // Default port
-
-    cout << "Enter the server's IP address: ";
-    cin >> serverIP;
-
-    TypingClient client(serverIP, serverPort);
-    if (client.connectToServer()) {
-        client.startGame();
-    }
-
-    return 0;
-}
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "accuracy.h"
+#include "keylog.h"
+#include "protocol.h"
+#include "terminal.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #pragma comment(lib, "ws2_32.lib")
+#else
+    #include <sys/socket.h>
+    #include <arpa/inet.h>
+    #include <netdb.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <unistd.h>
+    #include <cerrno>
+#endif
+
+using namespace std;
+using namespace std::chrono;
+
+// How often the race reports progress and its keystrokes so far
+const milliseconds PROGRESS_INTERVAL(200);
+// How long the socket thread waits for data before it looks for anything to send
+const int SOCKET_POLL_MS = 10;
+// The race's status line and passage lines stay within a standard terminal
+const size_t STATUS_WIDTH = 79;
+// The passage is shown this far ahead of the cursor, a line at a time
+const size_t PASSAGE_AHEAD = 8 * STATUS_WIDTH;
+
+// Cross-platform socket close function
+void closeSocket(int socket) {
+    #ifdef _WIN32
+        closesocket(socket);
+    #else
+        close(socket);
+    #endif
+}
+
+void setNonBlocking(int socket) {
+    #ifdef _WIN32
+        u_long on = 1;
+        ioctlsocket(socket, FIONBIO, &on);
+    #else
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+    #endif
+}
+
+// Wait up to timeoutMs for the socket to have data or to fail. Returns
+// false on a poll error.
+bool waitReadable(int socket, int timeoutMs) {
+    #ifdef _WIN32
+        WSAPOLLFD wait = {(SOCKET)socket, POLLRDNORM, 0};
+        return WSAPoll(&wait, 1, timeoutMs) >= 0;
+    #else
+        pollfd wait = {socket, POLLIN, 0};
+        return poll(&wait, 1, timeoutMs) >= 0 || errno == EINTR;
+    #endif
+}
+
+// The last socket call failed only because it would have blocked
+bool wouldBlock() {
+    #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    #endif
+}
+
+class TypingClient {
+private:
+    int clientSocket;
+    string serverIP;
+    int serverPort;
+    FrameDecoder decoder;
+
+    // During a race the socket belongs to its own thread, and the keyboard
+    // to another; both hand what they get to the game through the inbox
+    struct InboundFrame {
+        uint8_t type;
+        string payload;      // a copy, as the decoder reuses its buffer
+    };
+    struct TimedKey {
+        uint8_t key;
+        steady_clock::time_point at;
+    };
+    mutex inboxMutex;
+    condition_variable inboxReady;
+    vector<InboundFrame> inboundFrames;
+    vector<TimedKey> inboundKeys;
+    bool serverClosed = false;
+    bool inputClosed = false;
+    string socketError;
+
+    mutex outboxMutex;
+    string outbox;                   // frames for the socket thread to send
+    atomic<bool> stopSocket{false};
+    thread socketThread;
+
+    // Block until the next complete frame arrives. The payload view stays
+    // valid until the next call.
+    bool readFrame(Frame& frame) {
+        while (true) {
+            DecodeStatus status = decoder.next(frame);
+            if (status == DECODE_FRAME) return true;
+            if (status == DECODE_ERROR) {
+                cerr << "Bad data from server: " << errorCodeName(decoder.lastError()) << endl;
+                return false;
+            }
+
+            // A full buffer without a whole frame in it is a frame we cannot hold
+            RingBuffer::Segment segments[2];
+            if (decoder.buffer().writableSegments(segments) == 0) {
+                cerr << "Bad data from server: frame larger than the receive buffer" << endl;
+                return false;
+            }
+            int bytesRead = recv(clientSocket, segments[0].data, (int)segments[0].len, 0);
+            if (bytesRead <= 0) {
+                cerr << "Server disconnected" << endl;
+                return false;
+            }
+            decoder.buffer().commit(bytesRead);
+        }
+    }
+
+    // Socket thread: read and decode whatever has arrived, handing every
+    // frame to the game, and send whatever the game queued. Never waits on
+    // anything but the socket.
+    void runSocket() {
+        setNonBlocking(clientSocket);
+        string sending;
+        size_t sent = 0;
+        vector<InboundFrame> frames;
+        while (!stopSocket) {
+            {
+                lock_guard<mutex> lock(outboxMutex);
+                sending += outbox;
+                outbox.clear();
+            }
+            while (sent < sending.size()) {
+                int n = send(clientSocket, sending.data() + sent, (int)(sending.size() - sent), 0);
+                if (n > 0) {
+                    sent += n;
+                } else {
+                    if (!wouldBlock()) return closeInbox("Server disconnected");
+                    break;
+                }
+            }
+            if (sent == sending.size()) {
+                sending.clear();
+                sent = 0;
+            }
+
+            if (!waitReadable(clientSocket, SOCKET_POLL_MS)) return closeInbox("Server disconnected");
+            while (true) {
+                Frame frame;
+                DecodeStatus status;
+                while ((status = decoder.next(frame)) == DECODE_FRAME) {
+                    frames.push_back(InboundFrame{frame.type, string(frame.payload)});
+                }
+                if (status == DECODE_ERROR) {
+                    return closeInbox(string("Bad data from server: ") + errorCodeName(decoder.lastError()));
+                }
+                RingBuffer::Segment segments[2];
+                if (decoder.buffer().writableSegments(segments) == 0) {
+                    deliverFrames(frames);
+                    return closeInbox("Bad data from server: frame larger than the receive buffer");
+                }
+                int bytesRead = recv(clientSocket, segments[0].data, (int)segments[0].len, 0);
+                if (bytesRead > 0) {
+                    decoder.buffer().commit(bytesRead);
+                    continue;
+                }
+                if (bytesRead == 0 || !wouldBlock()) {
+                    deliverFrames(frames);
+                    return closeInbox("Server disconnected");
+                }
+                break;
+            }
+            deliverFrames(frames);
+        }
+    }
+
+    void deliverFrames(vector<InboundFrame>& frames) {
+        if (frames.empty()) return;
+        {
+            lock_guard<mutex> lock(inboxMutex);
+            for (InboundFrame& frame : frames) inboundFrames.push_back(move(frame));
+        }
+        frames.clear();
+        inboxReady.notify_one();
+    }
+
+    void closeInbox(const string& error) {
+        {
+            lock_guard<mutex> lock(inboxMutex);
+            serverClosed = true;
+            socketError = error;
+        }
+        inboxReady.notify_one();
+    }
+
+    // Keyboard thread
+    void onKey(uint8_t key, steady_clock::time_point at, bool closed) {
+        {
+            lock_guard<mutex> lock(inboxMutex);
+            if (closed) {
+                inputClosed = true;
+            } else {
+                inboundKeys.push_back(TimedKey{key, at});
+            }
+        }
+        inboxReady.notify_one();
+    }
+
+    void queueSend(const string& frames) {
+        lock_guard<mutex> lock(outboxMutex);
+        outbox += frames;
+    }
+
+    void stopSocketThread() {
+        stopSocket = true;
+        if (socketThread.joinable()) socketThread.join();
+    }
+
+    bool sendAll(const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            int n = send(clientSocket, data.data() + sent, (int)(data.size() - sent), 0);
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    // Redraw the one-line view of the other players' progress
+    void showProgress(const vector<ProgressEntry>& progress, int myId, size_t textLength) {
+        cout << "\r";
+        for (const ProgressEntry& entry : progress) {
+            if (entry.playerId == myId) continue;
+            cout << "Player " << entry.playerId + 1 << ": ";
+            if (entry.flags & PROGRESS_LEFT) {
+                cout << "left";
+            } else if (entry.flags & PROGRESS_FINISHED) {
+                cout << "finished";
+            } else {
+                cout << entry.cursor << "/" << textLength << " (" << entry.errors << " errors)";
+            }
+            cout << "   ";
+        }
+        cout << flush;
+    }
+
+    // Redraw the status line of a race in progress: our progress, everyone
+    // else's, the time left and the end of what we have typed, which leaves
+    // the cursor where the next key goes
+    void showRace(uint32_t passageLength, uint64_t position, const string& typed, const vector<ProgressEntry>& progress,
+                  int myId, uint32_t timeLimitMs, uint32_t elapsedMs, size_t& lastWidth) {
+        string status = "[" + to_string(position) + "/" + to_string(passageLength) + "]";
+        for (const ProgressEntry& entry : progress) {
+            if (entry.playerId == myId) continue;
+            status += " P" + to_string(entry.playerId + 1) + ":";
+            if (entry.flags & PROGRESS_LEFT) {
+                status += "left";
+            } else if (entry.flags & PROGRESS_FINISHED) {
+                status += "done";
+            } else {
+                status += to_string(entry.cursor);
+            }
+        }
+        if (timeLimitMs > 0) {
+            uint32_t leftMs = elapsedMs < timeLimitMs ? timeLimitMs - elapsedMs : 0;
+            status += " " + to_string((leftMs + 999) / 1000) + "s";
+        }
+        status += " > ";
+        size_t room = status.size() < STATUS_WIDTH ? STATUS_WIDTH - status.size() : 0;
+        string line = status + (typed.size() > room ? typed.substr(typed.size() - room) : typed);
+        // Blank out whatever is left of a longer previous line, then write
+        // the line again to bring the cursor back to its end
+        string padding(lastWidth > line.size() ? lastWidth - line.size() : 0, ' ');
+        cout << "\r" << line << padding;
+        if (!padding.empty()) cout << "\r" << line;
+        cout << flush;
+        lastWidth = line.size();
+    }
+
+    // Print an ERROR frame from the server
+    void reportError(const Frame& frame) {
+        uint16_t code;
+        string_view text;
+        if (parseError(frame.payload, code, text)) {
+            cerr << "Server error: " << text << endl;
+        } else {
+            cerr << "Unexpected message from server" << endl;
+        }
+    }
+    
+    // Calculate accuracy from the edit distance, so one missed or extra
+    // character costs one error instead of misaligning the rest of the line
+    AccuracyReport calculateAccuracy(const string& original, const string& typed) {
+        return scoreAccuracy(original, typed);
+    }
+
+public:
+    TypingClient(const string& ip, int port)
+        : serverIP(ip), serverPort(port), decoder(FRAME_HEADER_SIZE + CLIENT_MAX_PAYLOAD, CLIENT_MAX_PAYLOAD) {
+        #ifdef _WIN32
+            // Initialize Winsock
+            WSADATA wsaData;
+            if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+                cerr << "WSAStartup failed" << endl;
+                exit(1);
+            }
+        #endif
+
+        // The socket is created once the address family is known
+        clientSocket = -1;
+    }
+    
+    // The server may be given as an IPv4 or IPv6 address or a host name;
+    // every address it resolves to is tried in turn
+    bool connectToServer() {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        string port = to_string(serverPort);
+
+        struct addrinfo* addresses = nullptr;
+        if (getaddrinfo(serverIP.c_str(), port.c_str(), &hints, &addresses) != 0) {
+            cerr << "Invalid address or address not supported" << endl;
+            return false;
+        }
+        for (struct addrinfo* addr = addresses; addr; addr = addr->ai_next) {
+            clientSocket = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (clientSocket < 0) continue;
+            if (connect(clientSocket, addr->ai_addr, static_cast<int>(addr->ai_addrlen)) == 0) break;
+            closeSocket(clientSocket);
+            clientSocket = -1;
+        }
+        freeaddrinfo(addresses);
+
+        if (clientSocket < 0) {
+            cerr << "Connection failed" << endl;
+            return false;
+        }
+        
+        cout << "Connected to server at " << serverIP << ":" << serverPort << endl;
+        return true;
+    }
+    
+    // A name keeps a rating across races, so later races match players of
+    // similar speed; without one every race is matched as a newcomer
+    void startGame(const string& name) {
+        Frame frame;
+        
+        string hello;
+        encodeHello(hello, name);
+        if (!sendAll(hello)) {
+            cerr << "Server disconnected" << endl;
+            return;
+        }
+        cout << "Waiting for players of similar speed to join..." << endl;
+        
+        // Wait for START message from server, announced by a countdown once
+        // the room is full
+        if (!readFrame(frame)) {
+            return;
+        }
+        uint32_t startsInMs, timeLimitMs = 0;
+        if (frame.type == MSG_COUNTDOWN && parseCountdown(frame.payload, startsInMs, timeLimitMs)) {
+            cout << "Room full, the race starts in " << (startsInMs + 999) / 1000 << " seconds";
+            if (timeLimitMs > 0) cout << " (time limit " << timeLimitMs / 1000 << " seconds)";
+            cout << endl;
+            if (!readFrame(frame)) {
+                return;
+            }
+        }
+        
+        StartMessage start;
+        if (frame.type != MSG_START || !parseStart(frame.payload, start)) {
+            reportError(frame);
+            return;
+        }
+        
+        // The passage arrives a window at a time. Only the stretch a
+        // backspace or the scorer can still reach is kept, of both the
+        // passage and what was typed; key times are measured from here.
+        auto startReceived = steady_clock::now();
+        uint32_t passageLength = start.passageLength;
+        uint64_t base = 0;                 // passage offset of text[0] and typed[0]
+        string text(start.text);
+        string typed;
+        vector<bool> wrong;                // per typed character
+        uint64_t furthest = 0;             // most characters ever typed
+        uint32_t errors = 0;
+
+        // Print the passage in lines a few ahead of the cursor, above the
+        // status line, so a book scrolls by as it is typed
+        uint64_t shown = 0;
+        size_t statusWidth = 0;
+        auto showPassage = [&]() {
+            while (shown < base + text.size() && shown < base + typed.size() + PASSAGE_AHEAD) {
+                string_view rest = string_view(text).substr(shown - base);
+                size_t length = min(rest.size(), STATUS_WIDTH);
+                if (length < rest.size()) {
+                    size_t space = rest.rfind(' ', length - 1);
+                    if (space != string_view::npos && space > 0) length = space + 1;
+                } else if (shown + length < passageLength) {
+                    return;   // the rest of the line has not arrived yet
+                }
+                cout << "\r" << string(statusWidth, ' ') << "\r" << rest.substr(0, length) << "\n";
+                statusWidth = 0;
+                shown += length;
+            }
+        };
+
+        cout << "\n=== Typing Test Started ===\n" << endl;
+        cout << "Type the following text";
+        if (passageLength > PASSAGE_AHEAD) cout << " (" << passageLength << " characters, shown as you go)";
+        cout << ":" << endl;
+        showPassage();
+        cout << "\nStart typing now; Enter finishes early, Ctrl-C gives up.\n" << endl;
+
+        // From here on keys and frames come from their own threads, so
+        // neither a redraw nor a slow network delays a key's timestamp
+        RawKeyboard keyboard([this](uint8_t key, steady_clock::time_point at, bool closed) {
+            onKey(key, at, closed);
+        });
+        if (!keyboard.start()) {
+            cerr << "The race needs a console to type in" << endl;
+            return;
+        }
+        socketThread = thread(&TypingClient::runSocket, this);
+
+        KeyLogWriter keyLog;
+        KeyLogScorer scorer(passageLength);
+        uint32_t finishedMs = 0;
+        bool finished = false;
+        bool finishSent = false;
+        auto nextReport = startReceived + PROGRESS_INTERVAL;
+        vector<ProgressEntry> progress;
+        vector<ResultEntry> results;
+        bool haveResults = false;
+
+        // Progress and the keystrokes since the last report, as one write.
+        // The same keystrokes are scored here as the server will score them.
+        auto report = [&](string& out) {
+            uint32_t now = (uint32_t)duration_cast<milliseconds>(steady_clock::now() - startReceived).count();
+            encodeProgress(out, (uint32_t)(base + typed.size()), errors, finished ? finishedMs : now);
+            string piece = keyLog.take();
+            scorer.setPassage(text, base);
+            scorer.feed(piece);
+            encodeKeyLog(out, piece);
+        };
+
+        while (!haveResults) {
+            vector<TimedKey> keys;
+            vector<InboundFrame> frames;
+            bool disconnected, inputEnded;
+            string error;
+            {
+                unique_lock<mutex> lock(inboxMutex);
+                inboxReady.wait_until(lock, nextReport, [this] {
+                    return !inboundKeys.empty() || !inboundFrames.empty() || serverClosed || inputClosed;
+                });
+                keys.swap(inboundKeys);
+                frames.swap(inboundFrames);
+                disconnected = serverClosed;
+                inputEnded = inputClosed;
+                error = socketError;
+            }
+
+            for (const TimedKey& key : keys) {
+                if (key.key == KEY_INTERRUPT) {
+                    cout << "\nGave up" << endl;
+                    return;
+                }
+                if (finished) continue;
+                uint32_t atMs = (uint32_t)duration_cast<milliseconds>(key.at - startReceived).count();
+                uint64_t position = base + typed.size();
+                if (key.key == KEY_ERASE) {
+                    // Never further back than the server still scores
+                    if (typed.empty() || position + KEYLOG_ERASE_LIMIT <= furthest) continue;
+                    errors -= wrong.back();
+                    wrong.pop_back();
+                    typed.pop_back();
+                    keyLog.add(atMs, KEY_BACKSPACE);
+                } else if (key.key >= 32 && key.key < 127) {
+                    bool miss = position >= base + text.size() || text[position - base] != (char)key.key;
+                    typed.push_back((char)key.key);
+                    wrong.push_back(miss);
+                    errors += miss;
+                    furthest = max(furthest, position + 1);
+                    keyLog.add(atMs, key.key);
+                } else if (key.key != KEY_ENTER) {
+                    continue;
+                }
+                if (key.key == KEY_ENTER || (base + typed.size() == passageLength && errors == 0)) {
+                    finished = true;
+                    finishedMs = atMs;
+                }
+            }
+
+            for (const InboundFrame& inbound : frames) {
+                uint32_t tick, offset;
+                string_view piece;
+                if (inbound.type == MSG_SNAPSHOT) {
+                    parseSnapshot(inbound.payload, tick, progress);
+                } else if (inbound.type == MSG_TEXT && parseText(inbound.payload, offset, piece)) {
+                    if (offset == base + text.size()) text.append(piece.data(), piece.size());
+                } else if (inbound.type == MSG_RESULTS && parseResults(inbound.payload, results)) {
+                    haveResults = true;
+                } else if (inbound.type == MSG_ERROR) {
+                    Frame frame{inbound.type, inbound.payload};
+                    cout << endl;
+                    reportError(frame);
+                    return;
+                }
+            }
+            if (haveResults) break;
+            if (disconnected) {
+                cout << endl;
+                cerr << error << endl;
+                return;
+            }
+
+            if (finished && !finishSent) {
+                // Send final progress, the rest of the keystroke log and
+                // FINISH. The server scores the log itself; our numbers are
+                // only for display.
+                string resultMsg;
+                report(resultMsg);
+                scorer.setPassage(text, base);
+                KeyLogScore score = scorer.finish(finishedMs);
+                encodeFinish(resultMsg, score.wpm, score.accuracy);
+                queueSend(resultMsg);
+
+                cout << "\n\n=== Your Results ===\n" << endl;
+                cout << "Time: " << finishedMs / 1000.0 << " seconds" << endl;
+                cout << "WPM: " << score.wpm << endl;
+                cout << "Accuracy: " << score.accuracy << "%" << endl;
+                if (base == 0 && text.size() == passageLength) {
+                    AccuracyReport accuracy = calculateAccuracy(text, typed);
+                    cout << "Errors: " << accuracy.distance << " in " << accuracy.wordsWithErrors << " words" << endl;
+                }
+                cout << "\nWaiting for other player to finish..." << endl;
+                finishSent = true;
+            }
+
+            auto now = steady_clock::now();
+            if (now >= nextReport) {
+                if (!finished) {
+                    string progressMsg;
+                    report(progressMsg);
+                    queueSend(progressMsg);
+                }
+                nextReport = now + PROGRESS_INTERVAL;
+            }
+
+            // Drop what neither a backspace nor the scorer can reach any more
+            uint64_t keep = min<uint64_t>(furthest > KEYLOG_ERASE_LIMIT ? furthest - KEYLOG_ERASE_LIMIT : 0,
+                                          scorer.settledPassage());
+            if (keep >= base + TEXT_CHUNK_SIZE && keep <= base + text.size() && keep <= shown) {
+                size_t drop = (size_t)(keep - base);
+                text.erase(0, drop);
+                typed.erase(0, drop);
+                wrong.erase(wrong.begin(), wrong.begin() + drop);
+                base = keep;
+            }
+
+            if (finished) {
+                showProgress(progress, start.playerId, passageLength);
+            } else {
+                showPassage();
+                uint32_t elapsedMs = (uint32_t)duration_cast<milliseconds>(now - startReceived).count();
+                showRace(passageLength, base + typed.size(), typed, progress, start.playerId, timeLimitMs, elapsedMs, statusWidth);
+            }
+            if (inputEnded && !finished) {
+                cout << "\nInput closed" << endl;
+                return;
+            }
+        }
+
+        if (!finished) cout << "\n\nTime is up";
+        cout << "\n\n=== Final Results ===\n" << endl;
+        for (const ResultEntry& result : results) {
+            cout << "Player " << result.playerId + 1 << ":" << endl;
+            cout << "  WPM: " << result.wpm << endl;
+            cout << "  Accuracy: " << result.accuracy << "%" << endl;
+            cout << endl;
+        }
+        cout << "Press Enter to quit..." << endl;
+        unique_lock<mutex> lock(inboxMutex);
+        inboxReady.wait(lock, [this] {
+            for (const TimedKey& key : inboundKeys) {
+                if (key.key == KEY_ENTER || key.key == KEY_INTERRUPT) return true;
+            }
+            inboundKeys.clear();
+            return inputClosed;
+        });
+    }
+    
+    // Watch a room without playing: the passage, everyone's live progress
+    // and the final results. Room 0 is the latest race to start.
+    void spectate(uint64_t roomId) {
+        string request;
+        encodeSpectate(request, roomId);
+        if (!sendAll(request)) {
+            cerr << "Server disconnected" << endl;
+            return;
+        }
+
+        Frame frame;
+        StartMessage start;
+        if (!readFrame(frame)) return;
+        if (frame.type != MSG_START || !parseStart(frame.payload, start)) {
+            reportError(frame);
+            return;
+        }
+        size_t textLength = start.passageLength;
+        cout << "\n=== Watching room " << start.roomId << " (" << start.playerCount << " players) ===\n" << endl;
+        size_t received = start.text.size();
+        cout << start.text;
+        if (received >= textLength) cout << "\n" << endl;
+
+        // The rest of the passage comes a piece at a time between snapshots;
+        // progress shows once it is all on screen
+        vector<ProgressEntry> progress;
+        uint32_t tick;
+        while (true) {
+            if (!readFrame(frame)) return;
+            if (frame.type == MSG_TEXT) {
+                uint32_t offset;
+                string_view piece;
+                if (parseText(frame.payload, offset, piece) && offset == received) {
+                    cout << piece;
+                    received += piece.size();
+                    if (received >= textLength) cout << "\n" << endl;
+                }
+                continue;
+            }
+            if (frame.type != MSG_SNAPSHOT) break;
+            if (parseSnapshot(frame.payload, tick, progress) && received >= textLength) {
+                showProgress(progress, SPECTATOR_ID, textLength);
+            }
+        }
+
+        vector<ResultEntry> results;
+        if (frame.type == MSG_RESULTS && parseResults(frame.payload, results)) {
+            cout << "\n\n=== Final Results ===\n" << endl;
+            for (const ResultEntry& result : results) {
+                cout << "Player " << result.playerId + 1 << ": ";
+                if (result.finished) {
+                    cout << result.wpm << " WPM, " << result.accuracy << "% accuracy" << endl;
+                } else {
+                    cout << "did not finish" << endl;
+                }
+            }
+        } else {
+            reportError(frame);
+        }
+    }
+
+    ~TypingClient() {
+        stopSocketThread();
+        if (clientSocket >= 0) closeSocket(clientSocket);
+        
+        #ifdef _WIN32
+            WSACleanup();
+        #endif
+    }
+};
+
+int main(int argc, char* argv[]) {
+    string serverIP;
+    int serverPort = 8080; // Default port
+
+    // Optional: --port N, --name NAME to be rated, and --spectate [ROOM] to
+    // watch instead of playing
+    string name;
+    bool spectating = false;
+    uint64_t roomId = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            serverPort = atoi(argv[++i]);
+        } else if (arg == "--name" && i + 1 < argc) {
+            name = argv[++i];
+            if (name.size() > MAX_PLAYER_NAME) {
+                cerr << "Names are at most " << MAX_PLAYER_NAME << " bytes" << endl;
+                return 1;
+            }
+        } else if (arg == "--spectate") {
+            spectating = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') roomId = strtoull(argv[++i], nullptr, 10);
+        }
+    }
+
+    #ifndef _WIN32
+        // A server gone mid-write is reported by send, not by a signal
+        signal(SIGPIPE, SIG_IGN);
+    #endif
+
+    cout << "Enter the server's address: ";
+    cin >> serverIP;
+
+    TypingClient client(serverIP, serverPort);
+    if (client.connectToServer()) {
+        if (spectating) {
+            client.spectate(roomId);
+        } else {
+            client.startGame(name);
+        }
+    }
+
+    return 0;
+}
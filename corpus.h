@@ -0,0 +1,469 @@
+#pragma once
+
+// Passage corpus: an indexed file of passages that the server maps into
+// memory instead of compiling texts into the binary.
+//
+// File layout (all integers little-endian):
+//
+//   header   64 bytes   "T2CORPUS", u32 version, u32 bucket count,
+//                       u64 passage count, u64 bucket table offset,
+//                       u64 index offset, u64 text offset, u64 text size,
+//                       u64 reserved
+//   buckets  24 bytes   u8 difficulty, u8 length class, u16 language,
+//                       u32 reserved, u64 first passage, u64 passage count
+//   index    16 bytes   u64 text offset, u32 length, u8 difficulty,
+//                       u8 length class, u16 language
+//   text                every passage's bytes, back to back
+//
+// Passages are sorted by (difficulty, length class, language), so each
+// bucket is one contiguous run of index entries and a random passage from a
+// bucket is a single index lookup. Passage text is handed out as views into
+// the mapping; whoever holds the shared_ptr<const Corpus> keeps it mapped,
+// so a reload never pulls text out from under a running race.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const char CORPUS_MAGIC[8] = {'T', '2', 'C', 'O', 'R', 'P', 'U', 'S'};
+const uint32_t CORPUS_VERSION = 1;
+const size_t CORPUS_HEADER_SIZE = 64;
+const size_t CORPUS_BUCKET_SIZE = 24;
+const size_t CORPUS_ENTRY_SIZE = 16;
+
+enum LengthClass : uint8_t {
+    LENGTH_SHORT = 0,    // under 100 characters
+    LENGTH_MEDIUM = 1,   // under 300 characters
+    LENGTH_LONG = 2,     // under 2000 characters
+    LENGTH_ENDURANCE = 3 // chapters and books, streamed to players as they type
+};
+
+inline uint8_t lengthClassFor(size_t length) {
+    if (length < 100) return LENGTH_SHORT;
+    if (length < 300) return LENGTH_MEDIUM;
+    if (length < 2000) return LENGTH_LONG;
+    return LENGTH_ENDURANCE;
+}
+
+inline const char* lengthClassName(uint8_t lengthClass) {
+    switch (lengthClass) {
+        case LENGTH_SHORT: return "short";
+        case LENGTH_MEDIUM: return "medium";
+        case LENGTH_LONG: return "long";
+        case LENGTH_ENDURANCE: return "endurance";
+        default: return "unknown";
+    }
+}
+
+// -1 for an unknown name
+inline int parseLengthClass(std::string_view name) {
+    if (name == "short") return LENGTH_SHORT;
+    if (name == "medium") return LENGTH_MEDIUM;
+    if (name == "long") return LENGTH_LONG;
+    if (name == "endurance") return LENGTH_ENDURANCE;
+    return -1;
+}
+
+// Two-letter language codes ("en", "de") packed into a u16; 0 for invalid
+inline uint16_t languageCode(std::string_view name) {
+    if (name.size() != 2) return 0;
+    return static_cast<uint16_t>((static_cast<uint8_t>(name[0]) << 8) | static_cast<uint8_t>(name[1]));
+}
+
+inline std::string languageName(uint16_t code) {
+    return std::string{static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+}
+
+// Rough 1-5 rating from word length and the share of punctuation, digits
+// and capitals, for passages that arrive without one
+inline uint8_t estimateDifficulty(std::string_view text) {
+    size_t letters = 0, words = 0, awkward = 0;
+    bool inWord = false;
+    for (char c : text) {
+        unsigned char u = static_cast<unsigned char>(c);
+        if (u == ' ') {
+            inWord = false;
+            continue;
+        }
+        if (!inWord) words++;
+        inWord = true;
+        letters++;
+        if ((u >= 'A' && u <= 'Z') || (u >= '0' && u <= '9') || (u < 0x80 && !(u >= 'a' && u <= 'z'))) {
+            awkward++;
+        }
+    }
+    if (words == 0) return 1;
+
+    double wordLength = static_cast<double>(letters) / words;
+    double awkwardShare = static_cast<double>(awkward) / letters;
+    double rating = 1.0 + (wordLength - 4.0) + awkwardShare * 20.0;
+    return static_cast<uint8_t>(std::clamp(rating, 1.0, 5.0));
+}
+
+namespace corpus_detail {
+
+inline uint16_t loadLE16(const char* p) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>(b[0] | (b[1] << 8));
+}
+
+inline uint32_t loadLE32(const char* p) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+           (static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+}
+
+inline uint64_t loadLE64(const char* p) {
+    return static_cast<uint64_t>(loadLE32(p)) | (static_cast<uint64_t>(loadLE32(p + 4)) << 32);
+}
+
+inline void storeLE16(std::string& out, uint16_t value) {
+    out.push_back(static_cast<char>(value & 0xFF));
+    out.push_back(static_cast<char>(value >> 8));
+}
+
+inline void storeLE32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+inline void storeLE64(std::string& out, uint64_t value) {
+    storeLE32(out, static_cast<uint32_t>(value));
+    storeLE32(out, static_cast<uint32_t>(value >> 32));
+}
+
+inline uint32_t bucketKey(uint8_t difficulty, uint8_t lengthClass, uint16_t language) {
+    return (static_cast<uint32_t>(difficulty) << 24) | (static_cast<uint32_t>(lengthClass) << 16) | language;
+}
+
+} // namespace corpus_detail
+
+struct Passage {
+    std::string_view text;
+    uint8_t difficulty;
+    uint8_t lengthClass;
+    uint16_t language;
+};
+
+struct CorpusBucket {
+    uint8_t difficulty;
+    uint8_t lengthClass;
+    uint16_t language;
+    uint64_t first;
+    uint64_t count;
+};
+
+class Corpus {
+public:
+    Corpus(const Corpus&) = delete;
+    Corpus& operator=(const Corpus&) = delete;
+
+    ~Corpus() {
+        if (mapped) munmap(const_cast<char*>(base), length);
+    }
+
+    // Map a corpus file. On failure returns null and describes why in error.
+    static std::shared_ptr<const Corpus> open(const std::string& path, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = path + ": " + strerror(errno);
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(CORPUS_HEADER_SIZE)) {
+            error = path + ": not a corpus file";
+            ::close(fd);
+            return nullptr;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            error = path + ": mmap failed: " + strerror(errno);
+            return nullptr;
+        }
+        // Picks land anywhere in the file, so readahead would be wasted
+        madvise(data, size, MADV_RANDOM);
+
+        std::shared_ptr<Corpus> corpus(new Corpus(static_cast<const char*>(data), size, true, path));
+        if (!corpus->validate(error)) {
+            error = path + ": " + error;
+            return nullptr;
+        }
+        return corpus;
+    }
+
+    // Wrap corpus bytes already in memory, such as a freshly built one
+    static std::shared_ptr<const Corpus> fromBytes(std::string bytes, const std::string& source, std::string& error) {
+        std::shared_ptr<Corpus> corpus(new Corpus(nullptr, 0, false, source));
+        corpus->owned = std::move(bytes);
+        corpus->base = corpus->owned.data();
+        corpus->length = corpus->owned.size();
+        if (corpus->length < CORPUS_HEADER_SIZE || !corpus->validate(error)) {
+            if (error.empty()) error = "not a corpus file";
+            error = source + ": " + error;
+            return nullptr;
+        }
+        return corpus;
+    }
+
+    size_t size() const { return passageCount; }
+    size_t bucketCount() const { return buckets; }
+    const std::string& source() const { return origin; }
+
+    Passage passage(size_t index) const {
+        const char* entry = base + indexOffset + index * CORPUS_ENTRY_SIZE;
+        Passage p;
+        p.text = std::string_view(base + textOffset + corpus_detail::loadLE64(entry),
+                                  corpus_detail::loadLE32(entry + 8));
+        p.difficulty = static_cast<uint8_t>(entry[12]);
+        p.lengthClass = static_cast<uint8_t>(entry[13]);
+        p.language = corpus_detail::loadLE16(entry + 14);
+        return p;
+    }
+
+    CorpusBucket bucket(size_t index) const {
+        const char* entry = base + bucketOffset + index * CORPUS_BUCKET_SIZE;
+        CorpusBucket b;
+        b.difficulty = static_cast<uint8_t>(entry[0]);
+        b.lengthClass = static_cast<uint8_t>(entry[1]);
+        b.language = corpus_detail::loadLE16(entry + 2);
+        b.first = corpus_detail::loadLE64(entry + 8);
+        b.count = corpus_detail::loadLE64(entry + 16);
+        return b;
+    }
+
+private:
+    const char* base;
+    size_t length;
+    bool mapped;
+    std::string owned;     // backing store when not mapped
+    std::string origin;
+    uint64_t passageCount;
+    uint32_t buckets;
+    uint64_t bucketOffset;
+    uint64_t indexOffset;
+    uint64_t textOffset;
+    uint64_t textSize;
+
+    Corpus(const char* base, size_t length, bool mapped, const std::string& origin)
+        : base(base), length(length), mapped(mapped), origin(origin),
+          passageCount(0), buckets(0), bucketOffset(0), indexOffset(0), textOffset(0), textSize(0) {}
+
+    // Check every offset once at load, so lookups never need to
+    bool validate(std::string& error) {
+        using namespace corpus_detail;
+
+        if (memcmp(base, CORPUS_MAGIC, sizeof(CORPUS_MAGIC)) != 0) {
+            error = "not a corpus file";
+            return false;
+        }
+        if (loadLE32(base + 8) != CORPUS_VERSION) {
+            error = "unsupported corpus version " + std::to_string(loadLE32(base + 8));
+            return false;
+        }
+        buckets = loadLE32(base + 12);
+        passageCount = loadLE64(base + 16);
+        bucketOffset = loadLE64(base + 24);
+        indexOffset = loadLE64(base + 32);
+        textOffset = loadLE64(base + 40);
+        textSize = loadLE64(base + 48);
+
+        auto fits = [this](uint64_t offset, uint64_t count, uint64_t itemSize) {
+            return offset <= length && count <= (length - offset) / itemSize;
+        };
+        if (!fits(bucketOffset, buckets, CORPUS_BUCKET_SIZE) ||
+            !fits(indexOffset, passageCount, CORPUS_ENTRY_SIZE) ||
+            !fits(textOffset, textSize, 1)) {
+            error = "truncated corpus";
+            return false;
+        }
+
+        uint64_t next = 0;
+        uint32_t lastKey = 0;
+        for (uint32_t i = 0; i < buckets; i++) {
+            CorpusBucket b = bucket(i);
+            uint32_t key = bucketKey(b.difficulty, b.lengthClass, b.language);
+            if (b.first != next || b.count == 0 || b.count > passageCount - next || (i > 0 && key <= lastKey)) {
+                error = "bad bucket table";
+                return false;
+            }
+            for (uint64_t j = b.first; j < b.first + b.count; j++) {
+                const char* entry = base + indexOffset + j * CORPUS_ENTRY_SIZE;
+                uint64_t offset = loadLE64(entry);
+                uint32_t len = loadLE32(entry + 8);
+                if (offset > textSize || len > textSize - offset || len == 0 ||
+                    bucketKey(entry[12], entry[13], loadLE16(entry + 14)) != key) {
+                    error = "bad passage index";
+                    return false;
+                }
+            }
+            next += b.count;
+            lastKey = key;
+        }
+        if (next != passageCount) {
+            error = "bad bucket table";
+            return false;
+        }
+        return true;
+    }
+};
+
+// Collects passages and writes them out in the corpus format
+class CorpusBuilder {
+public:
+    void add(std::string_view text, uint8_t difficulty, uint16_t language) {
+        Item item;
+        item.offset = pool.size();
+        item.length = static_cast<uint32_t>(text.size());
+        item.key = corpus_detail::bucketKey(difficulty, lengthClassFor(text.size()), language);
+        pool.append(text.data(), text.size());
+        items.push_back(item);
+    }
+
+    size_t size() const { return items.size(); }
+
+    std::string build() const {
+        using namespace corpus_detail;
+
+        std::vector<uint32_t> order(items.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = static_cast<uint32_t>(i);
+        std::stable_sort(order.begin(), order.end(),
+                         [this](uint32_t a, uint32_t b) { return items[a].key < items[b].key; });
+
+        // One bucket per run of equal keys
+        std::string bucketTable;
+        uint32_t bucketCount = 0;
+        for (size_t i = 0; i < order.size();) {
+            size_t j = i;
+            uint32_t key = items[order[i]].key;
+            while (j < order.size() && items[order[j]].key == key) j++;
+            bucketTable.push_back(static_cast<char>(key >> 24));
+            bucketTable.push_back(static_cast<char>((key >> 16) & 0xFF));
+            storeLE16(bucketTable, static_cast<uint16_t>(key & 0xFFFF));
+            storeLE32(bucketTable, 0);
+            storeLE64(bucketTable, i);
+            storeLE64(bucketTable, j - i);
+            bucketCount++;
+            i = j;
+        }
+
+        // Text is laid out in bucket order too, so a bucket's passages sit together
+        std::string index, text;
+        index.reserve(items.size() * CORPUS_ENTRY_SIZE);
+        text.reserve(pool.size());
+        for (uint32_t i : order) {
+            const Item& item = items[i];
+            storeLE64(index, text.size());
+            storeLE32(index, item.length);
+            index.push_back(static_cast<char>(item.key >> 24));
+            index.push_back(static_cast<char>((item.key >> 16) & 0xFF));
+            storeLE16(index, static_cast<uint16_t>(item.key & 0xFFFF));
+            text.append(pool, item.offset, item.length);
+        }
+
+        uint64_t bucketOffset = CORPUS_HEADER_SIZE;
+        uint64_t indexOffset = bucketOffset + bucketTable.size();
+        uint64_t textOffset = indexOffset + index.size();
+
+        std::string out(CORPUS_MAGIC, sizeof(CORPUS_MAGIC));
+        storeLE32(out, CORPUS_VERSION);
+        storeLE32(out, bucketCount);
+        storeLE64(out, items.size());
+        storeLE64(out, bucketOffset);
+        storeLE64(out, indexOffset);
+        storeLE64(out, textOffset);
+        storeLE64(out, text.size());
+        storeLE64(out, 0);
+        out += bucketTable;
+        out += index;
+        out += text;
+        return out;
+    }
+
+private:
+    struct Item {
+        size_t offset;
+        uint32_t length;
+        uint32_t key;
+    };
+    std::vector<Item> items;
+    std::string pool;
+};
+
+// Which passages a server hands out; -1 / 0 fields match anything
+struct PassageFilter {
+    int difficulty = -1;
+    int lengthClass = -1;
+    uint16_t language = 0;
+
+    bool matches(const CorpusBucket& b) const {
+        return (difficulty < 0 || b.difficulty == difficulty) &&
+               (lengthClass < 0 || b.lengthClass == lengthClass) &&
+               (language == 0 || b.language == language);
+    }
+};
+
+// Picks passages uniformly from the buckets a filter selects. Matching
+// buckets are resolved once per corpus; a pick is then one RNG draw and an
+// index lookup (plus a short binary search when the filter spans several
+// buckets).
+class PassagePicker {
+public:
+    PassagePicker(std::shared_ptr<const Corpus> corpus, const PassageFilter& filter)
+        : owner(std::move(corpus)), total(0) {
+        for (size_t i = 0; i < owner->bucketCount(); i++) {
+            CorpusBucket b = owner->bucket(i);
+            if (!filter.matches(b)) continue;
+            // Adjacent matching buckets are adjacent in the index too
+            if (!ranges.empty() && ranges.back().first + ranges.back().count == b.first) {
+                ranges.back().count += b.count;
+            } else {
+                ranges.push_back({b.first, b.count});
+            }
+            total += b.count;
+        }
+        uint64_t end = 0;
+        for (const Range& r : ranges) {
+            end += r.count;
+            ends.push_back(end);
+        }
+    }
+
+    bool empty() const { return total == 0; }
+    uint64_t size() const { return total; }
+    const std::shared_ptr<const Corpus>& corpus() const { return owner; }
+
+    // Safe to call from any thread; each thread draws from its own generator
+    size_t pick() const {
+        uint64_t n = std::uniform_int_distribution<uint64_t>(0, total - 1)(rng());
+        if (ranges.size() == 1) return static_cast<size_t>(ranges[0].first + n);
+        size_t r = std::upper_bound(ends.begin(), ends.end(), n) - ends.begin();
+        uint64_t before = r == 0 ? 0 : ends[r - 1];
+        return static_cast<size_t>(ranges[r].first + (n - before));
+    }
+
+private:
+    struct Range {
+        uint64_t first;
+        uint64_t count;
+    };
+    std::shared_ptr<const Corpus> owner;
+    std::vector<Range> ranges;
+    std::vector<uint64_t> ends;     // cumulative passage count per range
+    uint64_t total;
+
+    static std::mt19937_64& rng() {
+        thread_local std::mt19937_64 generator(std::random_device{}());
+        return generator;
+    }
+};
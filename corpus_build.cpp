@@ -0,0 +1,144 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include "corpus.h"
+
+using namespace std;
+
+// Builds a passage corpus for the server from a text file with one passage
+// per line. A line is either the bare passage, or
+//
+//     difficulty<TAB>language<TAB>passage
+//
+// with difficulty 1-5 and a two-letter language code. Bare passages get
+// the default language and an estimated difficulty.
+//
+// Each --book FILE adds a whole file as one passage, for endurance races:
+// its lines and paragraphs are joined with single spaces, as a race is
+// typed on one line. With books, the passage file is optional.
+
+// A file's words separated by single spaces
+static string joinLines(istream& input) {
+    string text, word;
+    while (input >> word) {
+        if (!text.empty()) text += ' ';
+        text += word;
+    }
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    string language = "en";
+    string inputPath, outputPath;
+    vector<string> books;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--language" && i + 1 < argc) {
+            language = argv[++i];
+        } else if (arg == "--book" && i + 1 < argc) {
+            books.push_back(argv[++i]);
+        } else if (inputPath.empty()) {
+            inputPath = arg;
+        } else if (outputPath.empty()) {
+            outputPath = arg;
+        } else {
+            inputPath.clear();
+            break;
+        }
+    }
+    // With books alone, the one path given is the output
+    if (!books.empty() && outputPath.empty()) swap(inputPath, outputPath);
+    if ((inputPath.empty() && books.empty()) || outputPath.empty() || languageCode(language) == 0) {
+        cerr << "Usage: " << argv[0] << " [--language xx] [--book FILE]... [passages.txt] output.corpus" << endl;
+        return 1;
+    }
+
+    CorpusBuilder builder;
+    uint16_t defaultLanguage = languageCode(language);
+    for (const string& path : books) {
+        ifstream book(path);
+        if (!book) {
+            cerr << "Cannot open " << path << endl;
+            return 1;
+        }
+        string text = joinLines(book);
+        if (text.size() > UINT32_MAX) {
+            cerr << path << ": too long for one passage" << endl;
+            return 1;
+        }
+        if (!text.empty()) builder.add(text, estimateDifficulty(text), defaultLanguage);
+    }
+
+    ifstream input;
+    if (!inputPath.empty()) {
+        input.open(inputPath);
+        if (!input) {
+            cerr << "Cannot open " << inputPath << endl;
+            return 1;
+        }
+    }
+    string line;
+    size_t lineNumber = 0, skipped = 0;
+    while (input.is_open() && getline(input, line)) {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        size_t firstTab = line.find('\t');
+        size_t secondTab = firstTab == string::npos ? string::npos : line.find('\t', firstTab + 1);
+        if (secondTab == string::npos) {
+            builder.add(line, estimateDifficulty(line), defaultLanguage);
+            continue;
+        }
+
+        int difficulty = atoi(line.substr(0, firstTab).c_str());
+        uint16_t code = languageCode(string_view(line).substr(firstTab + 1, secondTab - firstTab - 1));
+        string_view text = string_view(line).substr(secondTab + 1);
+        if (difficulty < 1 || difficulty > 5 || code == 0 || text.empty()) {
+            cerr << inputPath << ":" << lineNumber << ": skipping malformed line" << endl;
+            skipped++;
+            continue;
+        }
+        builder.add(text, static_cast<uint8_t>(difficulty), code);
+    }
+
+    // Write next to the target and rename over it, so a running server that
+    // has the old file mapped never sees a half-written one
+    string bytes = builder.build();
+    string tempPath = outputPath + ".tmp";
+    {
+        ofstream output(tempPath, ios::binary | ios::trunc);
+        output.write(bytes.data(), bytes.size());
+        if (!output.flush()) {
+            cerr << "Error writing " << tempPath << endl;
+            return 1;
+        }
+    }
+    if (rename(tempPath.c_str(), outputPath.c_str()) != 0) {
+        cerr << "Error renaming " << tempPath << " to " << outputPath << endl;
+        return 1;
+    }
+
+    string error;
+    shared_ptr<const Corpus> corpus = Corpus::open(outputPath, error);
+    if (!corpus) {
+        cerr << error << endl;
+        return 1;
+    }
+
+    cout << "Wrote " << corpus->size() << " passages in " << corpus->bucketCount() << " buckets to "
+         << outputPath << " (" << bytes.size() << " bytes";
+    if (skipped) cout << ", " << skipped << " lines skipped";
+    cout << ")" << endl;
+    for (size_t i = 0; i < corpus->bucketCount(); i++) {
+        CorpusBucket b = corpus->bucket(i);
+        cout << "  difficulty " << (int)b.difficulty << ", " << lengthClassName(b.lengthClass) << ", "
+             << languageName(b.language) << ": " << b.count << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+// Pooled, reference-counted buffers for outgoing frames.
+//
+// A frame is encoded once into a FrameRef and then shared by every
+// connection it goes to: each queued copy is a reference, not a copy of the
+// bytes. When the last reference goes the buffer returns to the releasing
+// thread's free list with its capacity intact, so once the lists are warm
+// encoding and broadcasting allocate nothing. The count is atomic because a
+// connection moving between loops takes its queued frames with it.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+// Buffers that grew past this are freed instead of pooled
+const size_t FRAME_POOL_MAX_CAPACITY = 64 * 1024;
+// Free buffers kept per thread
+const size_t FRAME_POOL_MAX_FREE = 4096;
+
+struct FrameBuffer {
+    std::atomic<uint32_t> refs;
+    std::string bytes;
+};
+
+namespace framepool_detail {
+
+struct FreeList {
+    std::vector<FrameBuffer*> buffers;
+
+    ~FreeList() {
+        for (FrameBuffer* buffer : buffers) delete buffer;
+    }
+};
+
+inline FreeList& local() {
+    thread_local FreeList list;
+    return list;
+}
+
+} // namespace framepool_detail
+
+class FrameRef {
+public:
+    FrameRef() : buffer(nullptr) {}
+
+    // An empty, unshared buffer from this thread's free list
+    static FrameRef acquire() {
+        std::vector<FrameBuffer*>& free = framepool_detail::local().buffers;
+        FrameBuffer* buffer;
+        if (free.empty()) {
+            buffer = new FrameBuffer();
+            countMetric(FRAME_BUFFERS_ALLOCATED);
+        } else {
+            buffer = free.back();
+            free.pop_back();
+        }
+        buffer->refs.store(1, std::memory_order_relaxed);
+        return FrameRef(buffer);
+    }
+
+    // Copy of bytes encoded elsewhere
+    static FrameRef copyOf(const char* data, size_t len) {
+        FrameRef frame = acquire();
+        frame.bytes().assign(data, len);
+        return frame;
+    }
+
+    FrameRef(const FrameRef& other) : buffer(other.buffer) {
+        if (buffer) buffer->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    FrameRef(FrameRef&& other) noexcept : buffer(other.buffer) {
+        other.buffer = nullptr;
+    }
+
+    FrameRef& operator=(FrameRef other) noexcept {
+        std::swap(buffer, other.buffer);
+        return *this;
+    }
+
+    ~FrameRef() {
+        reset();
+    }
+
+    void reset() {
+        if (!buffer) return;
+        if (buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            recycle(buffer);
+        }
+        buffer = nullptr;
+    }
+
+    // Fill the frame here before sending it anywhere; once queued it is
+    // shared and must not change
+    std::string& bytes() { return buffer->bytes; }
+
+    const char* data() const { return buffer->bytes.data(); }
+    size_t size() const { return buffer ? buffer->bytes.size() : 0; }
+    explicit operator bool() const { return buffer != nullptr; }
+
+private:
+    explicit FrameRef(FrameBuffer* buffer) : buffer(buffer) {}
+
+    static void recycle(FrameBuffer* buffer) {
+        std::vector<FrameBuffer*>& free = framepool_detail::local().buffers;
+        if (buffer->bytes.capacity() > FRAME_POOL_MAX_CAPACITY || free.size() >= FRAME_POOL_MAX_FREE) {
+            delete buffer;
+            return;
+        }
+        buffer->bytes.clear();
+        free.push_back(buffer);
+    }
+
+    FrameBuffer* buffer;
+};
@@ -0,0 +1,326 @@
+#pragma once
+
+// Compact keystroke timelines, shared by the client and the server.
+//
+// A log is a sequence of (delta, key) pairs: the milliseconds since the
+// previous keystroke as a LEB128 varint, then the key byte. Timestamps are
+// relative to the moment the client received START, so a typical keystroke
+// costs two bytes. KEY_BACKSPACE deletes the last typed character; any other
+// byte is appended to the typed text.
+//
+// The server replays the log itself and derives WPM and accuracy from it, so
+// the numbers a client claims in FINISH are never trusted. It does so as the
+// log arrives (KeyLogScorer), settling the passage a segment at a time, so a
+// book-length race costs the same memory as a sentence.
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "accuracy.h"
+
+const uint8_t KEY_BACKSPACE = 0x08;
+
+// Faster than any human: intervals below this are not believed
+const uint32_t MIN_KEY_INTERVAL_MS = 10;
+// Allowance for network delay and the typist's start when checking
+// timestamps against the server clock
+const uint32_t KEYLOG_CLOCK_GRACE_MS = 2000;
+// Backspace never reaches more than this many characters behind the furthest
+// a log has typed. The client holds typists to it; the scorer relies on it
+// to settle text further back for good.
+const size_t KEYLOG_ERASE_LIMIT = 512;
+// Passage the scorer settles at a time, once the typist is past it
+const size_t KEYLOG_SCORE_SEGMENT = 1024;
+
+class KeyLogWriter {
+public:
+    KeyLogWriter() : lastMs(0) {}
+
+    void add(uint32_t timeMs, uint8_t key) {
+        uint32_t delta = timeMs >= lastMs ? timeMs - lastMs : 0;
+        lastMs = std::max(lastMs, timeMs);
+        while (delta >= 0x80) {
+            data.push_back(static_cast<char>((delta & 0x7F) | 0x80));
+            delta >>= 7;
+        }
+        data.push_back(static_cast<char>(delta));
+        data.push_back(static_cast<char>(key));
+    }
+
+    const std::string& bytes() const { return data; }
+
+    // The bytes added since the last take, for a log sent as it grows
+    std::string take() {
+        std::string out;
+        out.swap(data);
+        return out;
+    }
+
+private:
+    std::string data;
+    uint32_t lastMs;
+};
+
+class KeyLogReader {
+public:
+    explicit KeyLogReader(std::string_view data) : data(data), pos(0), timeMs(0), bad(false) {}
+
+    // False at the end of the log or on a truncated entry (see failed())
+    bool next(uint32_t& time, uint8_t& key) {
+        if (pos >= data.size()) return false;
+
+        uint32_t delta = 0;
+        int shift = 0;
+        while (true) {
+            if (pos >= data.size() || shift > 28) {
+                bad = true;
+                return false;
+            }
+            uint8_t b = static_cast<uint8_t>(data[pos++]);
+            delta |= static_cast<uint32_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+            shift += 7;
+        }
+        if (pos >= data.size()) {
+            bad = true;
+            return false;
+        }
+        key = static_cast<uint8_t>(data[pos++]);
+        timeMs += delta;
+        time = timeMs;
+        return true;
+    }
+
+    bool failed() const { return bad; }
+
+private:
+    std::string_view data;
+    size_t pos;
+    uint32_t timeMs;
+    bool bad;
+};
+
+struct KeyLogScore {
+    bool valid;
+    double wpm;
+    double accuracy;
+    uint32_t keystrokes;
+    uint32_t typedLength;
+    uint32_t durationMs;   // first to last keystroke, after sanity limits
+};
+
+// Rebuild the typed text from a log
+inline bool replayKeyLog(std::string_view log, std::string& typed, uint32_t& firstMs,
+                         uint32_t& lastMs, uint32_t& keystrokes) {
+    typed.clear();
+    firstMs = lastMs = 0;
+    keystrokes = 0;
+
+    KeyLogReader reader(log);
+    uint32_t time;
+    uint8_t key;
+    while (reader.next(time, key)) {
+        if (keystrokes == 0) firstMs = time;
+        lastMs = time;
+        keystrokes++;
+        if (key == KEY_BACKSPACE) {
+            if (!typed.empty()) typed.pop_back();
+        } else {
+            typed.push_back(static_cast<char>(key));
+        }
+    }
+    return !reader.failed();
+}
+
+// Scores a log piece by piece as it arrives. Once the typed text runs a
+// segment and the erase limit past the end of the next passage segment, it is
+// lined up with the prefix of the typed text that matches it best, its edits
+// are added up and both are dropped. Only the unsettled tail of the typed
+// text and a partial log entry are kept, whatever the passage length.
+//
+// The passage may be the whole text, or, on a client that only holds a
+// window of it, whatever part of it setPassage last gave; a segment waits
+// until its text is there.
+class KeyLogScorer {
+public:
+    explicit KeyLogScorer(std::string_view passage)
+        : KeyLogScorer(passage.size()) { setPassage(passage, 0); }
+
+    explicit KeyLogScorer(uint64_t passageLength = 0)
+        : passageLength(passageLength), textBase(0), timeMs(0), firstMs(0), lastMs(0), keystrokes(0),
+          logBytes(0), bad(false), typedSettled(0), passageSettled(0), distance(0) {}
+
+    // The passage from offset base on; must reach back to settledPassage()
+    void setPassage(std::string_view text, uint64_t base) {
+        this->text = text;
+        textBase = base;
+    }
+
+    // Feed the next piece of the log. Pieces may split entries. Settles at
+    // most maxSegments passage segments; the rest wait for a later piece or
+    // finish(). False once the log is malformed.
+    bool feed(std::string_view piece, size_t maxSegments = SIZE_MAX) {
+        logBytes += piece.size();
+        if (bad) return false;
+        pending.append(piece.data(), piece.size());
+        size_t pos = 0;
+        while (pos < pending.size()) {
+            size_t p = pos;
+            uint32_t delta = 0;
+            int shift = 0;
+            bool whole = false;
+            while (p < pending.size()) {
+                if (shift > 28) {
+                    bad = true;
+                    return false;
+                }
+                uint8_t b = static_cast<uint8_t>(pending[p++]);
+                delta |= static_cast<uint32_t>(b & 0x7F) << shift;
+                if (!(b & 0x80)) {
+                    whole = true;
+                    break;
+                }
+                shift += 7;
+            }
+            if (!whole || p >= pending.size()) break;   // the rest comes in a later piece
+            timeMs += delta;
+            apply(static_cast<uint8_t>(pending[p++]));
+            pos = p;
+        }
+        pending.erase(0, pos);
+        settle(maxSegments);
+        return true;
+    }
+
+    // Score what was fed. maxElapsedMs is how long the scorer saw the race
+    // run for this player; the log's timestamps are only believed within
+    // KEYLOG_CLOCK_GRACE_MS of it, either way.
+    KeyLogScore finish(uint32_t maxElapsedMs) {
+        KeyLogScore score = KeyLogScore();
+        score.valid = !bad && pending.empty();
+        score.keystrokes = keystrokes;
+        if (!score.valid || keystrokes == 0) return score;
+        settle(SIZE_MAX);   // whatever capped feeds left behind
+
+        // The client cannot have typed after the scorer saw it finish, nor
+        // faster than a human can press keys, nor in much less time than the
+        // scorer saw pass: a log with squeezed timestamps is timed by the
+        // scorer's clock, less the grace for network delay
+        uint32_t limit = maxElapsedMs + KEYLOG_CLOCK_GRACE_MS;
+        if (limit < maxElapsedMs) limit = UINT32_MAX;
+        uint32_t last = std::min(lastMs, limit);
+        uint32_t first = std::min(firstMs, last);
+        uint64_t floorMs = static_cast<uint64_t>(keystrokes) * MIN_KEY_INTERVAL_MS;
+        uint64_t seenMs = maxElapsedMs > KEYLOG_CLOCK_GRACE_MS ? maxElapsedMs - KEYLOG_CLOCK_GRACE_MS : 0;
+        uint64_t duration = std::max({static_cast<uint64_t>(last - first), floorMs, seenMs});
+
+        uint64_t typedLength = typedSettled + typed.size();
+        score.typedLength = static_cast<uint32_t>(std::min<uint64_t>(typedLength, UINT32_MAX));
+        score.durationMs = static_cast<uint32_t>(std::min<uint64_t>(duration, UINT32_MAX));
+        // Standard: 5 characters = 1 word
+        score.wpm = (typedLength / 5.0) / (duration / 60000.0);
+
+        score.accuracy = accuracyFromDistance(passageLength, distance + remainingEdits());
+        return score;
+    }
+
+    // Edits per passage word, as scoreAccuracy() attributes them. Only for a
+    // log whose passage was scored in one piece, which is every passage short
+    // of endurance length; false for the rest.
+    bool wordErrors(std::vector<uint32_t>& out) const {
+        if (passageSettled != 0 || textBase != 0 || text.size() != passageLength) return false;
+        out = scoreAccuracy(text, typed).wordErrors;
+        return true;
+    }
+
+    uint64_t settledPassage() const { return passageSettled; }
+    uint64_t bytesFed() const { return logBytes; }
+
+private:
+    uint64_t passageLength;
+    std::string_view text;       // passage from textBase on
+    uint64_t textBase;
+    std::string pending;         // start of an entry split across pieces
+    uint32_t timeMs;
+    uint32_t firstMs;
+    uint32_t lastMs;
+    uint32_t keystrokes;
+    uint64_t logBytes;
+    bool bad;
+    std::string typed;           // typed text after typedSettled
+    uint64_t typedSettled;       // typed characters already scored
+    uint64_t passageSettled;     // passage characters already scored
+    uint64_t distance;           // their edits
+
+    void apply(uint8_t key) {
+        if (keystrokes == 0) firstMs = timeMs;
+        lastMs = timeMs;
+        keystrokes++;
+        if (key == KEY_BACKSPACE) {
+            if (!typed.empty()) typed.pop_back();
+        } else {
+            typed.push_back(static_cast<char>(key));
+        }
+    }
+
+    // The passage between two offsets, or as much of it as is here
+    std::string_view passage(uint64_t from, uint64_t to) const {
+        if (from < textBase || from >= textBase + text.size()) return std::string_view();
+        return text.substr(from - textBase, to - from);
+    }
+
+    // Settle segments the typist can no longer erase into. Each is matched
+    // against the typed prefix closest to its length among the best; twice
+    // its length is on hand, so a typist running ahead or behind still
+    // lines up.
+    void settle(size_t maxSegments) {
+        thread_local std::vector<uint32_t> row;
+        size_t settled = 0;
+        while (settled < maxSegments && typed.size() >= 2 * KEYLOG_SCORE_SEGMENT + KEYLOG_ERASE_LIMIT &&
+               passageLength - passageSettled > KEYLOG_SCORE_SEGMENT) {
+            std::string_view segment = passage(passageSettled, passageSettled + KEYLOG_SCORE_SEGMENT);
+            if (segment.size() < KEYLOG_SCORE_SEGMENT) return;   // not received yet
+            std::string_view settleable(typed.data(), typed.size() - KEYLOG_ERASE_LIMIT);
+            prefixDistances(segment, settleable, row);
+            size_t cut = 0;
+            for (size_t j = 1; j < row.size(); j++) {
+                size_t off = j > segment.size() ? j - segment.size() : segment.size() - j;
+                size_t bestOff = cut > segment.size() ? cut - segment.size() : segment.size() - cut;
+                if (row[j] < row[cut] || (row[j] == row[cut] && off < bestOff)) cut = j;
+            }
+            distance += row[cut];
+            passageSettled += segment.size();
+            typedSettled += cut;
+            typed.erase(0, cut);
+            settled++;
+        }
+    }
+
+    // Edits between the unsettled passage and typed text. Exact when the
+    // rest is about as long as what was typed; otherwise whatever passage
+    // lies well past the end of the typed text counts as never typed.
+    uint64_t remainingEdits() const {
+        uint64_t rest = passageLength - passageSettled;
+        std::string_view available = passage(passageSettled, passageLength);
+        if (rest <= typed.size() + 2 * KEYLOG_SCORE_SEGMENT && available.size() == rest) {
+            return editDistance(available, typed);
+        }
+        if (typed.empty()) return rest;
+        thread_local std::vector<uint32_t> row;
+        std::string_view reach = available.substr(0, typed.size() + 2 * KEYLOG_SCORE_SEGMENT);
+        prefixDistances(typed, reach, row);
+        uint64_t best = UINT64_MAX;
+        for (size_t i = 0; i < row.size(); i++) best = std::min<uint64_t>(best, row[i] + (rest - i));
+        return best;
+    }
+};
+
+// Score a whole log against its passage
+inline KeyLogScore scoreKeyLog(std::string_view passage, std::string_view log, uint32_t maxElapsedMs) {
+    KeyLogScorer scorer(passage);
+    scorer.feed(log);
+    return scorer.finish(maxElapsedMs);
+}
@@ -0,0 +1,665 @@
+#pragma once
+
+// Persistent leaderboard. Every scored result is appended to a log file,
+// and an in-memory index over it answers "top N" and "my rank" without
+// touching the file.
+//
+// Files in the leaderboard directory (all integers little-endian):
+//
+//   results.log       "T2RESULT", u32 version, u32 reserved, then records:
+//                     u32 payload length, u32 CRC-32C of the payload, payload
+//                     u64 finished (unix ms), u64 room id, u64 passage id,
+//                     u32 wpm and u32 accuracy in hundredths, u8 name length,
+//                     name (empty for unrated players, who are not ranked)
+//   leaderboard.snap  "T2LBSNAP", u32 version, u32 CRC-32C of the body,
+//                     u64 log offset it covers, u64 body length, body
+//                     (Leaderboard::save)
+//
+// One writer thread owns the log. Loop threads hand results over without
+// waiting for the disk; the writer takes everything queued, writes it with
+// one write() and makes it durable with one fdatasync(), so each sync is
+// shared by every result that arrived while the previous one ran. Only then
+// are the results applied to the index, so it never shows what a crash
+// could take back. A batch the disk refused is dropped, not retried: the
+// log is cut back to before it and the index never sees it, so the two
+// still agree and a failing disk cannot pile results up in memory.
+//
+// Every snapshotEvery results the writer saves the index, with the log
+// offset it covers, through a temporary file and a rename. Startup loads the
+// snapshot and replays only the log after it, so restart time follows the
+// number of players rather than the length of history. A record whose CRC
+// fails is where a crash tore the log; it and anything after it are cut off.
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "corpus.h"
+#include "metrics.h"
+#include "protocol.h"
+
+const char RESULT_LOG_MAGIC[8] = {'T', '2', 'R', 'E', 'S', 'U', 'L', 'T'};
+const char SNAPSHOT_MAGIC[8] = {'T', '2', 'L', 'B', 'S', 'N', 'A', 'P'};
+const uint32_t RESULT_LOG_VERSION = 1;
+const size_t RESULT_LOG_HEADER_SIZE = 16;
+const size_t SNAPSHOT_HEADER_SIZE = 32;
+// Entries kept per board, so the most any "top" query can return
+const size_t LEADERBOARD_TOP = 100;
+// Ranks count scores up to 500 WPM; anything faster ranks as 500
+const uint32_t LEADERBOARD_MAX_WPM = 50000;
+
+namespace leaderboard_detail {
+
+// CRC-32C (Castagnoli), bytewise from a table
+inline uint32_t crc32c(const char* data, size_t len) {
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Bounds-checked little-endian reads over a snapshot body or a log record
+struct Reader {
+    const char* p;
+    const char* end;
+
+    bool u8(uint8_t& v) {
+        if (end - p < 1) return false;
+        v = static_cast<uint8_t>(*p++);
+        return true;
+    }
+    bool u16(uint16_t& v) {
+        if (end - p < 2) return false;
+        v = corpus_detail::loadLE16(p);
+        p += 2;
+        return true;
+    }
+    bool u32(uint32_t& v) {
+        if (end - p < 4) return false;
+        v = corpus_detail::loadLE32(p);
+        p += 4;
+        return true;
+    }
+    bool u64(uint64_t& v) {
+        if (end - p < 8) return false;
+        v = corpus_detail::loadLE64(p);
+        p += 8;
+        return true;
+    }
+    bool name(std::string& v) {
+        uint8_t len;
+        if (!u8(len) || end - p < len) return false;
+        v.assign(p, len);
+        p += len;
+        return true;
+    }
+};
+
+inline void storeName(std::string& out, const std::string& name) {
+    out.push_back(static_cast<char>(name.size()));
+    out += name;
+}
+
+} // namespace leaderboard_detail
+
+// One scored result, as logged
+struct ResultRecord {
+    uint64_t finishedAtMs;
+    uint64_t roomId;
+    uint64_t passageId;    // replayTextId of the passage
+    uint32_t wpm;          // hundredths
+    uint32_t accuracy;     // hundredths
+    std::string name;
+};
+
+struct LeaderboardEntry {
+    std::string name;
+    uint32_t wpm;          // hundredths
+    uint32_t accuracy;     // hundredths
+    uint64_t achievedAtMs;
+    uint64_t passageId;
+};
+
+struct PlayerStanding {
+    LeaderboardEntry best;
+    uint32_t races;
+    uint64_t rank;         // 1 for the fastest; players with the same best share a rank
+    uint64_t players;      // ranked players in all
+};
+
+// The index. Boards rank each player once, by their best WPM, earliest
+// first on a tie: one board over all passages and one per passage, each
+// kept to its LEADERBOARD_TOP best, so a query reads a short sorted vector.
+// A player's rank among all players comes from a Fenwick tree counting
+// players per best score, a handful of additions however many there are.
+// Not thread-safe; ResultLog guards it.
+class Leaderboard {
+public:
+    Leaderboard() : ranks(LEADERBOARD_MAX_WPM + 2, 0) {}
+
+    // Fold in one result. Unnamed results are not ranked.
+    void apply(const ResultRecord& result) {
+        if (result.name.empty()) return;
+        LeaderboardEntry entry{result.name, result.wpm, result.accuracy, result.finishedAtMs, result.passageId};
+        offer(passages[result.passageId], entry);
+
+        // Later results only take over a best by being faster
+        Player& player = players[result.name];
+        bool first = player.races++ == 0;
+        if (!first && entry.wpm <= player.wpm) return;
+        if (!first) addRank(player.wpm, -1);
+        addRank(entry.wpm, 1);
+        player.wpm = entry.wpm;
+        player.accuracy = entry.accuracy;
+        player.achievedAtMs = entry.achievedAtMs;
+        player.passageId = entry.passageId;
+        offer(global, entry);
+    }
+
+    // The best entries, at most limit; passageId 0 for all passages
+    void top(uint64_t passageId, size_t limit, std::vector<LeaderboardEntry>& out) const {
+        out.clear();
+        const std::vector<LeaderboardEntry>* board = &global;
+        if (passageId != 0) {
+            auto it = passages.find(passageId);
+            if (it == passages.end()) return;
+            board = &it->second;
+        }
+        out.assign(board->begin(), board->begin() + std::min(limit, board->size()));
+    }
+
+    // False for a player with no ranked race
+    bool standing(const std::string& name, PlayerStanding& out) const {
+        auto it = players.find(name);
+        if (it == players.end()) return false;
+        out.best = entryFor(name, it->second);
+        out.races = it->second.races;
+        out.players = players.size();
+        out.rank = 1 + players.size() - countAtMost(it->second.wpm);
+        return true;
+    }
+
+    size_t playerCount() const { return players.size(); }
+    size_t passageCount() const { return passages.size(); }
+
+    // Body of a snapshot: u32 players, each u8 name length, name, u32 wpm,
+    // u32 accuracy, u64 achieved, u64 passage, u32 races; the global board
+    // as u16 entries, each u8 name length, name, u32 wpm, u32 accuracy, u64
+    // achieved, u64 passage; then u32 passages, each u64 id and its board
+    // in the same layout without the passage
+    void save(std::string& out) const {
+        using namespace corpus_detail;
+        using leaderboard_detail::storeName;
+
+        storeLE32(out, static_cast<uint32_t>(players.size()));
+        for (const auto& item : players) {
+            storeName(out, item.first);
+            storeLE32(out, item.second.wpm);
+            storeLE32(out, item.second.accuracy);
+            storeLE64(out, item.second.achievedAtMs);
+            storeLE64(out, item.second.passageId);
+            storeLE32(out, item.second.races);
+        }
+        storeLE16(out, static_cast<uint16_t>(global.size()));
+        for (const LeaderboardEntry& entry : global) {
+            storeName(out, entry.name);
+            storeLE32(out, entry.wpm);
+            storeLE32(out, entry.accuracy);
+            storeLE64(out, entry.achievedAtMs);
+            storeLE64(out, entry.passageId);
+        }
+        storeLE32(out, static_cast<uint32_t>(passages.size()));
+        for (const auto& item : passages) {
+            storeLE64(out, item.first);
+            storeLE16(out, static_cast<uint16_t>(item.second.size()));
+            for (const LeaderboardEntry& entry : item.second) {
+                storeName(out, entry.name);
+                storeLE32(out, entry.wpm);
+                storeLE32(out, entry.accuracy);
+                storeLE64(out, entry.achievedAtMs);
+            }
+        }
+    }
+
+    // Replace the index with a saved one. False, leaving it empty, if the
+    // body does not parse.
+    bool load(std::string_view body) {
+        *this = Leaderboard();
+        leaderboard_detail::Reader r{body.data(), body.data() + body.size()};
+        uint32_t playerCount, passageCount;
+        uint16_t entries;
+        std::string name;
+
+        if (!r.u32(playerCount)) return false;
+        players.reserve(playerCount);
+        for (uint32_t i = 0; i < playerCount; i++) {
+            Player player;
+            if (!r.name(name) || !r.u32(player.wpm) || !r.u32(player.accuracy) || !r.u64(player.achievedAtMs) ||
+                !r.u64(player.passageId) || !r.u32(player.races)) {
+                return fail();
+            }
+            addRank(player.wpm, 1);
+            players.emplace(name, player);
+        }
+        if (!r.u16(entries)) return fail();
+        for (uint16_t i = 0; i < entries; i++) {
+            LeaderboardEntry entry;
+            if (!r.name(entry.name) || !r.u32(entry.wpm) || !r.u32(entry.accuracy) || !r.u64(entry.achievedAtMs) ||
+                !r.u64(entry.passageId)) {
+                return fail();
+            }
+            global.push_back(std::move(entry));
+        }
+        if (!r.u32(passageCount)) return fail();
+        passages.reserve(passageCount);
+        for (uint32_t i = 0; i < passageCount; i++) {
+            uint64_t passageId;
+            if (!r.u64(passageId) || !r.u16(entries)) return fail();
+            std::vector<LeaderboardEntry>& board = passages[passageId];
+            for (uint16_t j = 0; j < entries; j++) {
+                LeaderboardEntry entry;
+                entry.passageId = passageId;
+                if (!r.name(entry.name) || !r.u32(entry.wpm) || !r.u32(entry.accuracy) ||
+                    !r.u64(entry.achievedAtMs)) {
+                    return fail();
+                }
+                board.push_back(std::move(entry));
+            }
+        }
+        return r.p == r.end || fail();
+    }
+
+private:
+    struct Player {
+        uint32_t wpm = 0;          // best, hundredths
+        uint32_t accuracy = 0;     // in the best race
+        uint64_t achievedAtMs = 0;
+        uint64_t passageId = 0;
+        uint32_t races = 0;        // ranked races in all
+    };
+
+    std::unordered_map<std::string, Player> players;
+    std::vector<LeaderboardEntry> global;    // best first
+    std::unordered_map<uint64_t, std::vector<LeaderboardEntry>> passages;
+    std::vector<uint32_t> ranks;             // Fenwick tree: players per best WPM, index WPM + 1
+
+    static LeaderboardEntry entryFor(const std::string& name, const Player& player) {
+        return LeaderboardEntry{name, player.wpm, player.accuracy, player.achievedAtMs, player.passageId};
+    }
+
+    static bool before(const LeaderboardEntry& a, const LeaderboardEntry& b) {
+        if (a.wpm != b.wpm) return a.wpm > b.wpm;
+        if (a.achievedAtMs != b.achievedAtMs) return a.achievedAtMs < b.achievedAtMs;
+        return a.name < b.name;
+    }
+
+    // A player holds one place per board, for their best there
+    static void offer(std::vector<LeaderboardEntry>& board, const LeaderboardEntry& entry) {
+        auto held = std::find_if(board.begin(), board.end(),
+                                 [&](const LeaderboardEntry& e) { return e.name == entry.name; });
+        if (held != board.end()) {
+            if (!before(entry, *held)) return;
+            board.erase(held);
+        } else if (board.size() == LEADERBOARD_TOP && !before(entry, board.back())) {
+            return;
+        }
+        board.insert(std::upper_bound(board.begin(), board.end(), entry, before), entry);
+        if (board.size() > LEADERBOARD_TOP) board.pop_back();
+    }
+
+    void addRank(uint32_t wpm, int delta) {
+        for (size_t i = std::min(wpm, LEADERBOARD_MAX_WPM) + 1; i < ranks.size(); i += i & (~i + 1)) {
+            ranks[i] += delta;
+        }
+    }
+
+    // Players whose best is wpm or slower
+    uint64_t countAtMost(uint32_t wpm) const {
+        uint64_t count = 0;
+        for (size_t i = std::min(wpm, LEADERBOARD_MAX_WPM) + 1; i > 0; i -= i & (~i + 1)) count += ranks[i];
+        return count;
+    }
+
+    bool fail() {
+        *this = Leaderboard();
+        return false;
+    }
+};
+
+// The log, its writer thread and the index it feeds. With an empty
+// directory nothing touches the disk and the leaderboard lasts as long as
+// the process.
+class ResultLog {
+public:
+    ResultLog(std::string directory, size_t snapshotEvery, size_t maxQueued)
+        : directory(std::move(directory)), snapshotEvery(snapshotEvery), maxQueued(maxQueued), stopping(false),
+          fd(-1), logSize(0), sinceSnapshot(0), fromSnapshot(0), fromLog(0) {}
+
+    ~ResultLog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        if (writer.joinable()) writer.join();
+        if (fd >= 0) {
+            // Spare the next start the replay
+            if (sinceSnapshot > 0) saveSnapshot();
+            ::close(fd);
+        }
+    }
+
+    // Recover the index from the snapshot and the log, then start the
+    // writer. On failure returns false and describes why in error.
+    bool start(std::string& error) {
+        if (!directory.empty() && !recover(error)) return false;
+        writer = std::thread(&ResultLog::run, this);
+        return true;
+    }
+
+    // Never blocks on the disk. On false the result was dropped.
+    bool trySubmit(ResultRecord&& result) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() >= maxQueued) {
+                countMetric(RESULTS_DROPPED);
+                return false;
+            }
+            queue.push_back(std::move(result));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    // Run fn on the index under a shared lock; any thread
+    template <typename F>
+    auto read(F fn) const {
+        std::shared_lock<std::shared_mutex> lock(indexMutex);
+        return fn(static_cast<const Leaderboard&>(board));
+    }
+
+    // What start() recovered: players from the snapshot, results from the
+    // log after it
+    size_t playersFromSnapshot() const { return fromSnapshot; }
+    size_t resultsFromLog() const { return fromLog; }
+
+private:
+    std::string directory;
+    size_t snapshotEvery;
+    size_t maxQueued;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<ResultRecord> queue;
+    bool stopping;
+    std::thread writer;
+
+    mutable std::shared_mutex indexMutex;
+    Leaderboard board;                  // written by the writer thread only
+
+    // Writer thread only, after start()
+    int fd;
+    uint64_t logSize;                   // bytes known to be whole records
+    size_t sinceSnapshot;               // results applied since the last snapshot
+    std::string pending;
+
+    size_t fromSnapshot;
+    size_t fromLog;
+
+    std::string logPath() const { return directory + "/results.log"; }
+    std::string snapshotPath() const { return directory + "/leaderboard.snap"; }
+
+    static bool writeAll(int out, const std::string& bytes) {
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t n = ::write(out, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static void encode(std::string& out, const ResultRecord& result) {
+        using namespace corpus_detail;
+        size_t start = out.size();
+        storeLE32(out, 0);
+        storeLE32(out, 0);
+        storeLE64(out, result.finishedAtMs);
+        storeLE64(out, result.roomId);
+        storeLE64(out, result.passageId);
+        storeLE32(out, result.wpm);
+        storeLE32(out, result.accuracy);
+        leaderboard_detail::storeName(out, result.name);
+
+        // Length and CRC go in front once the payload is there
+        size_t payload = out.size() - start - 8;
+        uint32_t crc = leaderboard_detail::crc32c(&out[start + 8], payload);
+        std::string front;
+        storeLE32(front, static_cast<uint32_t>(payload));
+        storeLE32(front, crc);
+        memcpy(&out[start], front.data(), front.size());
+    }
+
+    // One record at p, of at most available bytes. Returns its size, 0 if
+    // it needs more bytes than that, or -1 if it is damaged.
+    static long decode(const char* p, size_t available, ResultRecord& result) {
+        if (available < 8) return 0;
+        uint32_t payload = corpus_detail::loadLE32(p);
+        if (payload > 33 + MAX_PLAYER_NAME) return -1;
+        if (available - 8 < payload) return 0;
+        if (leaderboard_detail::crc32c(p + 8, payload) != corpus_detail::loadLE32(p + 4)) return -1;
+        leaderboard_detail::Reader r{p + 8, p + 8 + payload};
+        if (!r.u64(result.finishedAtMs) || !r.u64(result.roomId) || !r.u64(result.passageId) || !r.u32(result.wpm) ||
+            !r.u32(result.accuracy) || !r.name(result.name) || r.p != r.end) {
+            return -1;
+        }
+        return static_cast<long>(8 + payload);
+    }
+
+    // Load the snapshot if there is a usable one, and return the log offset
+    // it covers, 0 for none
+    uint64_t loadSnapshot() {
+        int in = ::open(snapshotPath().c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return 0;
+        std::string bytes;
+        char buffer[1 << 16];
+        ssize_t n;
+        while ((n = ::read(in, buffer, sizeof(buffer))) > 0) bytes.append(buffer, n);
+        ::close(in);
+
+        uint64_t covered = 0;
+        if (bytes.size() >= SNAPSHOT_HEADER_SIZE && memcmp(bytes.data(), SNAPSHOT_MAGIC, 8) == 0 &&
+            corpus_detail::loadLE32(&bytes[8]) == RESULT_LOG_VERSION &&
+            corpus_detail::loadLE64(&bytes[24]) == bytes.size() - SNAPSHOT_HEADER_SIZE) {
+            std::string_view body(bytes.data() + SNAPSHOT_HEADER_SIZE, bytes.size() - SNAPSHOT_HEADER_SIZE);
+            if (leaderboard_detail::crc32c(body.data(), body.size()) == corpus_detail::loadLE32(&bytes[12]) &&
+                board.load(body)) {
+                covered = corpus_detail::loadLE64(&bytes[16]);
+            }
+        }
+        if (covered == 0) std::cerr << snapshotPath() << ": damaged, rebuilding from the whole log" << std::endl;
+        return covered;
+    }
+
+    bool recover(std::string& error) {
+        using namespace corpus_detail;
+
+        mkdir(directory.c_str(), 0755);
+        uint64_t offset = loadSnapshot();
+        fromSnapshot = board.playerCount();
+
+        fd = ::open(logPath().c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            error = logPath() + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        uint64_t size = static_cast<uint64_t>(st.st_size);
+        if (size < RESULT_LOG_HEADER_SIZE) {
+            // New, or torn before its header was whole
+            std::string header(RESULT_LOG_MAGIC, sizeof(RESULT_LOG_MAGIC));
+            storeLE32(header, RESULT_LOG_VERSION);
+            storeLE32(header, 0);
+            if (ftruncate(fd, 0) < 0 || !writeAll(fd, header) || fdatasync(fd) < 0) {
+                error = logPath() + ": " + strerror(errno);
+                return false;
+            }
+            size = header.size();
+        } else {
+            char header[RESULT_LOG_HEADER_SIZE];
+            if (pread(fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+                memcmp(header, RESULT_LOG_MAGIC, 8) != 0 || loadLE32(header + 8) != RESULT_LOG_VERSION) {
+                error = logPath() + ": not a result log this version can read";
+                return false;
+            }
+        }
+        // A snapshot that claims more than the log holds belongs to another log
+        if (offset < RESULT_LOG_HEADER_SIZE || offset > size) {
+            if (offset > size) std::cerr << snapshotPath() << ": ahead of the log, rebuilding from the log" << std::endl;
+            board = Leaderboard();
+            fromSnapshot = 0;
+            offset = RESULT_LOG_HEADER_SIZE;
+        }
+
+        // Replay the tail a chunk at a time; a record split across chunks
+        // is carried into the next read
+        std::string chunk;
+        size_t used = 0;
+        uint64_t chunkAt = offset;
+        ResultRecord result;
+        while (true) {
+            long length = decode(chunk.data() + used, chunk.size() - used, result);
+            if (length > 0) {
+                board.apply(result);
+                fromLog++;
+                used += static_cast<size_t>(length);
+                continue;
+            }
+            if (length < 0 || chunkAt + chunk.size() >= size) break;
+            chunk.erase(0, used);
+            chunkAt += used;
+            used = 0;
+            size_t want = static_cast<size_t>(std::min<uint64_t>(1 << 20, size - chunkAt - chunk.size()));
+            size_t at = chunk.size();
+            chunk.resize(at + want);
+            ssize_t n = pread(fd, &chunk[at], want, static_cast<off_t>(chunkAt + at));
+            if (n <= 0) {
+                chunk.resize(at);
+                break;
+            }
+            chunk.resize(at + static_cast<size_t>(n));
+        }
+        logSize = chunkAt + used;
+        if (logSize < size) {
+            std::cerr << logPath() << ": cutting off " << size - logSize << " bytes of a torn or damaged record"
+                      << std::endl;
+            if (ftruncate(fd, static_cast<off_t>(logSize)) < 0) {
+                error = logPath() + ": " + strerror(errno);
+                return false;
+            }
+        }
+        sinceSnapshot = fromLog;
+        return true;
+    }
+
+    // Save the index through a temporary file, so a crash leaves either
+    // the old snapshot or the new one
+    void saveSnapshot() {
+        using namespace corpus_detail;
+
+        std::string body;
+        board.save(body);
+        std::string bytes(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        storeLE32(bytes, RESULT_LOG_VERSION);
+        storeLE32(bytes, leaderboard_detail::crc32c(body.data(), body.size()));
+        storeLE64(bytes, logSize);
+        storeLE64(bytes, body.size());
+        bytes += body;
+
+        std::string temporary = snapshotPath() + ".tmp";
+        int out = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = out >= 0 && writeAll(out, bytes) && fsync(out) == 0;
+        if (out >= 0) ::close(out);
+        if (ok && rename(temporary.c_str(), snapshotPath().c_str()) == 0) {
+            int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir >= 0) {
+                fsync(dir);
+                ::close(dir);
+            }
+            sinceSnapshot = 0;
+        } else {
+            std::cerr << "Error saving " << snapshotPath() << ": " << strerror(errno) << std::endl;
+        }
+    }
+
+    // Write a batch and sync it. On failure the log is cut back to its last
+    // whole record, so a torn write never hides later ones, and false says
+    // the batch is not in the log.
+    bool commit(const std::vector<ResultRecord>& batch) {
+        pending.clear();
+        for (const ResultRecord& result : batch) encode(pending, result);
+        auto started = std::chrono::steady_clock::now();
+        if (writeAll(fd, pending) && fdatasync(fd) == 0) {
+            logSize += pending.size();
+            countMetric(RESULT_LOG_COMMITS);
+            recordLatency(RESULT_COMMIT, std::chrono::steady_clock::now() - started);
+            return true;
+        }
+        std::cerr << "Error writing " << logPath() << ": " << strerror(errno) << "; dropping " << batch.size()
+                  << " results" << std::endl;
+        if (ftruncate(fd, static_cast<off_t>(logSize)) < 0) {
+            std::cerr << "Error repairing " << logPath() << ": " << strerror(errno) << std::endl;
+        }
+        return false;
+    }
+
+    void run() {
+        std::vector<ResultRecord> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;   // stopping, and everything is written
+                batch.swap(queue);
+            }
+
+            if (fd >= 0 && !commit(batch)) {
+                countMetric(RESULTS_DROPPED, batch.size());
+                batch.clear();
+                continue;
+            }
+            {
+                std::unique_lock<std::shared_mutex> lock(indexMutex);
+                for (const ResultRecord& result : batch) board.apply(result);
+            }
+            countMetric(RESULTS_RECORDED, batch.size());
+            sinceSnapshot += batch.size();
+            if (fd >= 0 && sinceSnapshot >= snapshotEvery) saveSnapshot();
+            batch.clear();
+        }
+    }
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+// Skill-based matchmaking queue for one worker loop.
+//
+// Waiting players sit in buckets of BUCKET_WIDTH rating points, with a bit
+// per bucket saying whether it has anyone in it. A bucket keeps two
+// intrusive lists in order of arrival: players who joined on this loop,
+// whose arrival order is how long they have waited, and players moved here
+// from another loop, who waited elsewhere first. Reads take the older of
+// the two heads and scans merge the lists, so adding and removing a player
+// are a hash lookup and a few pointer writes either way.
+//
+// A match starts from one waiting player, the anchor, and takes the
+// longest-waiting players from the buckets nearest its rating, outwards,
+// until the group is full; it never looks at more than the buckets the
+// anchor's band covers and a few players in each, however many are queued.
+//
+// The band, the rating distance an anchor accepts, starts at baseBand and
+// widens by widenPerSecond while it waits, so a player with no close match
+// trades closeness for waiting time instead of waiting forever.
+//
+// Not thread-safe: each loop owns its queue and only its thread touches it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct MatchTicket {
+    uint64_t connId;
+    double rating;
+    std::chrono::steady_clock::time_point since;   // joined the queue, on whichever loop first
+    std::string name;
+};
+
+class MatchQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static const int BUCKETS = 64;
+    static constexpr double BUCKET_WIDTH = 5.0;
+    // Players looked at per bucket before moving on to the next one
+    static const int SCAN_LIMIT = 32;
+
+    MatchQueue(int groupSize, double baseBand, double widenPerSecond)
+        : groupSize(groupSize), baseBand(std::max(baseBand, BUCKET_WIDTH)), widenPerSecond(widenPerSecond),
+          nonEmpty(0) {
+        for (int i = 0; i < BUCKETS; i++) {
+            for (int lane = 0; lane < LANES; lane++) first[i][lane] = last[i][lane] = nullptr;
+        }
+    }
+
+    MatchQueue(const MatchQueue&) = delete;
+    MatchQueue& operator=(const MatchQueue&) = delete;
+
+    size_t size() const { return entries.size(); }
+
+    // moved: the player comes from another loop's queue, keeping its wait
+    void add(MatchTicket ticket, bool moved = false) {
+        uint64_t connId = ticket.connId;
+        Entry& entry = entries[connId];
+        entry.ticket = std::move(ticket);
+        entry.bucket = bucketFor(entry.ticket.rating);
+        entry.lane = moved ? MOVED : JOINED;
+        link(entry);
+    }
+
+    // Take a player out of the queue, into out if given. False if not queued.
+    bool remove(uint64_t connId, MatchTicket* out = nullptr) {
+        auto it = entries.find(connId);
+        if (it == entries.end()) return false;
+        unlink(it->second);
+        if (out) *out = std::move(it->second.ticket);
+        entries.erase(it);
+        return true;
+    }
+
+    // Rating distance a player accepts after waiting until now
+    double band(const MatchTicket& ticket, Clock::time_point now) const {
+        double waited = std::chrono::duration<double>(now - ticket.since).count();
+        return baseBand + widenPerSecond * std::max(waited, 0.0);
+    }
+
+    // Try to make a group around one queued player. On success the group,
+    // anchor first, is moved out of the queue into group.
+    bool matchFor(uint64_t connId, Clock::time_point now, std::vector<MatchTicket>& group) {
+        auto it = entries.find(connId);
+        if (it == entries.end()) return false;
+        Entry* anchor = &it->second;
+        double rating = anchor->ticket.rating;
+        double reach = band(anchor->ticket, now);
+        int low = bucketFor(rating - reach);
+        int high = bucketFor(rating + reach);
+
+        picks.clear();
+        picks.push_back(anchor);
+        for (int distance = 0; static_cast<int>(picks.size()) < groupSize; distance++) {
+            int below = anchor->bucket - distance;
+            int above = anchor->bucket + distance;
+            if (below < low && above > high) break;
+            if (below >= low) collect(below, anchor, rating, reach);
+            if (distance > 0 && above <= high) collect(above, anchor, rating, reach);
+        }
+        if (static_cast<int>(picks.size()) < groupSize) return false;
+
+        group.clear();
+        for (Entry* entry : picks) {
+            unlink(*entry);
+            group.push_back(std::move(entry->ticket));
+        }
+        for (const MatchTicket& ticket : group) entries.erase(ticket.connId);
+        return true;
+    }
+
+    // One pass for bands that have widened since the players joined: the
+    // longest-waiting player of each bucket anchors a match, again while it
+    // finds one. Calls onGroup with each group made.
+    template <typename OnGroup>
+    void matchWaiting(Clock::time_point now, std::vector<MatchTicket>& group, OnGroup onGroup) {
+        uint64_t pending = nonEmpty;
+        while (pending) {
+            int bucket = __builtin_ctzll(pending);
+            pending &= pending - 1;
+            const Entry* head;
+            while ((head = longestWaiting(bucket)) && matchFor(head->ticket.connId, now, group)) {
+                onGroup(group);
+            }
+        }
+    }
+
+    // The longest-waiting player, or null when the queue is empty
+    const MatchTicket* oldest() const {
+        const Entry* found = nullptr;
+        uint64_t pending = nonEmpty;
+        while (pending) {
+            const Entry* head = longestWaiting(__builtin_ctzll(pending));
+            pending &= pending - 1;
+            if (!found || head->ticket.since < found->ticket.since) found = head;
+        }
+        return found ? &found->ticket : nullptr;
+    }
+
+private:
+    enum Lane { JOINED, MOVED, LANES };
+
+    struct Entry {
+        MatchTicket ticket;
+        int bucket;
+        int lane;
+        Entry* prev;
+        Entry* next;
+    };
+
+    int groupSize;
+    double baseBand;
+    double widenPerSecond;
+    std::unordered_map<uint64_t, Entry> entries;   // node-based, so entries never move
+    Entry* first[BUCKETS][LANES];                   // earliest arrival in each bucket's lists
+    Entry* last[BUCKETS][LANES];
+    uint64_t nonEmpty;                              // bit per bucket with anyone in it
+    std::vector<Entry*> picks;                      // reused by every match
+
+    static int bucketFor(double rating) {
+        if (rating <= 0) return 0;
+        return static_cast<int>(std::min(rating / BUCKET_WIDTH, static_cast<double>(BUCKETS - 1)));
+    }
+
+    // Whichever of two list entries has waited longer, null if neither is there
+    static Entry* older(Entry* a, Entry* b) {
+        if (!a) return b;
+        if (!b) return a;
+        return b->ticket.since < a->ticket.since ? b : a;
+    }
+
+    Entry* longestWaiting(int bucket) const {
+        return older(first[bucket][JOINED], first[bucket][MOVED]);
+    }
+
+    // Everyone goes at the back of their list, whatever their wait
+    void link(Entry& entry) {
+        int b = entry.bucket;
+        Entry*& tail = last[b][entry.lane];
+        entry.prev = tail;
+        entry.next = nullptr;
+        if (tail) {
+            tail->next = &entry;
+        } else {
+            first[b][entry.lane] = &entry;
+        }
+        tail = &entry;
+        nonEmpty |= 1ULL << b;
+    }
+
+    void unlink(Entry& entry) {
+        int b = entry.bucket;
+        if (entry.prev) {
+            entry.prev->next = entry.next;
+        } else {
+            first[b][entry.lane] = entry.next;
+        }
+        if (entry.next) {
+            entry.next->prev = entry.prev;
+        } else {
+            last[b][entry.lane] = entry.prev;
+        }
+        if (!first[b][JOINED] && !first[b][MOVED]) nonEmpty &= ~(1ULL << b);
+    }
+
+    // Add the longest-waiting players of a bucket that are within reach,
+    // walking both its lists at once
+    void collect(int bucket, const Entry* anchor, double rating, double reach) {
+        int scanned = 0;
+        Entry* joined = first[bucket][JOINED];
+        Entry* moved = first[bucket][MOVED];
+        for (Entry* entry; (entry = older(joined, moved)) && scanned < SCAN_LIMIT; scanned++) {
+            if (entry == joined) {
+                joined = joined->next;
+            } else {
+                moved = moved->next;
+            }
+            if (entry == anchor) continue;
+            double distance = entry->ticket.rating - rating;
+            if (distance < -reach || distance > reach) continue;
+            picks.push_back(entry);
+            if (static_cast<int>(picks.size()) == groupSize) return;
+        }
+    }
+};
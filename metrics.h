@@ -0,0 +1,309 @@
+#pragma once
+
+// Server metrics: per-thread counters and latency histograms, summed when
+// scraped and rendered in the Prometheus text format.
+//
+// Every thread records into its own ThreadMetrics block, so recording is a
+// thread_local lookup and a relaxed load and store on a value no other thread
+// writes: no lock, no locked instruction. The registry mutex is only taken
+// the first time a thread records and when a scrape walks the blocks. Blocks
+// are never freed, so totals keep what exited threads recorded.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+enum CounterId {
+    CONNECTIONS_OPENED,
+    CONNECTIONS_CLOSED,
+    ROOMS_OPENED,
+    ROOMS_CLOSED,
+    MESSAGES_IN,
+    MESSAGES_OUT,
+    BYTES_IN,
+    BYTES_OUT,
+    PARSE_ERRORS,
+    GAMES_FINISHED,
+    SCORES_COMPUTED,
+    FRAME_BUFFERS_ALLOCATED,
+    SPECTATORS_JOINED,
+    SPECTATORS_LEFT,
+    SPECTATOR_FRAMES_DROPPED,
+    CONNECTIONS_TIMED_OUT,
+    RACES_TIMED_OUT,
+    REPLAYS_RECORDED,
+    REPLAYS_DROPPED,
+    REPLAY_BYTES_WRITTEN,
+    PLAYERS_QUEUED,
+    PLAYERS_DEQUEUED,
+    RESULTS_RECORDED,
+    RESULTS_DROPPED,
+    RESULT_LOG_COMMITS,
+    TEXT_CHUNKS_SENT,
+    ANALYTICS_ROWS_WRITTEN,
+    ANALYTICS_ROWS_DROPPED,
+    ANALYTICS_BYTES_WRITTEN,
+    COUNTER_COUNT
+};
+
+enum HistogramId {
+    ROOM_FILL,          // a room's longest-waiting player joining the queue to the room being matched
+    RESULTS_FANOUT,     // last FINISH received to RESULTS queued for every player
+    SCORING,            // scoring what is left of one keystroke log at FINISH
+    RESULT_COMMIT,      // writing and syncing one batch of the result log
+    KEYLOG_SETTLING,    // settling passage segments of one KEYLOG frame on a network loop
+    HISTOGRAM_COUNT
+};
+
+// Log-linear buckets over microseconds, in the style of HDR histograms:
+// values below 16 get a bucket each, and every power of two above that is
+// split into 16 sub-buckets, so any recorded value is within 1/16 (about 6%)
+// of its bucket's bounds. 16 + 36 * 16 buckets reach past 19 hours.
+const int HISTOGRAM_SUB_BITS = 4;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const int HISTOGRAM_BUCKETS = HISTOGRAM_SUB_BUCKETS + 36 * HISTOGRAM_SUB_BUCKETS;
+
+inline int histogramBucket(uint64_t micros) {
+    if (micros < static_cast<uint64_t>(HISTOGRAM_SUB_BUCKETS)) return static_cast<int>(micros);
+    int exponent = 63 - __builtin_clzll(micros);
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    int bucket = HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS +
+                 static_cast<int>((micros >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Exclusive upper bound of a bucket, in microseconds
+inline uint64_t histogramBucketLimit(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return static_cast<uint64_t>(bucket) + 1;
+    int shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub + 1) << shift;
+}
+
+struct alignas(64) ThreadMetrics {
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    struct Histogram {
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sumMicros;
+    } histograms[HISTOGRAM_COUNT];
+
+    ThreadMetrics() {
+        for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+        for (auto& h : histograms) {
+            for (auto& b : h.buckets) b.store(0, std::memory_order_relaxed);
+            h.count.store(0, std::memory_order_relaxed);
+            h.sumMicros.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+namespace metrics_detail {
+
+// Only the owning thread writes, so a plain load and store is enough, and
+// a scrape reading concurrently sees either the old or the new value
+inline void bump(std::atomic<uint64_t>& value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+
+inline Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+inline ThreadMetrics& local() {
+    thread_local ThreadMetrics* mine = nullptr;
+    if (!mine) {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.threads.emplace_back(new ThreadMetrics());
+        mine = reg.threads.back().get();
+    }
+    return *mine;
+}
+
+} // namespace metrics_detail
+
+inline void countMetric(CounterId id, uint64_t n = 1) {
+    metrics_detail::bump(metrics_detail::local().counters[id], n);
+}
+
+inline void recordLatency(HistogramId id, std::chrono::steady_clock::duration elapsed) {
+    int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint64_t value = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+    ThreadMetrics::Histogram& h = metrics_detail::local().histograms[id];
+    metrics_detail::bump(h.buckets[histogramBucket(value)], 1);
+    metrics_detail::bump(h.count, 1);
+    metrics_detail::bump(h.sumMicros, value);
+}
+
+// Totals over every thread at the time of the call
+struct MetricsSnapshot {
+    uint64_t counters[COUNTER_COUNT] = {};
+    struct Histogram {
+        uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+        uint64_t count = 0;
+        uint64_t sumMicros = 0;
+
+        // Upper bound of the bucket holding quantile q, in microseconds
+        uint64_t quantile(double q) const {
+            if (count == 0) return 0;
+            uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+            uint64_t seen = 0;
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen >= rank) return histogramBucketLimit(i);
+            }
+            return histogramBucketLimit(HISTOGRAM_BUCKETS - 1);
+        }
+    } histograms[HISTOGRAM_COUNT];
+};
+
+inline MetricsSnapshot collectMetrics() {
+    MetricsSnapshot snap;
+    metrics_detail::Registry& reg = metrics_detail::registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (const auto& t : reg.threads) {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            snap.counters[i] += t->counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < HISTOGRAM_COUNT; i++) {
+            const ThreadMetrics::Histogram& from = t->histograms[i];
+            MetricsSnapshot::Histogram& to = snap.histograms[i];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                to.buckets[b] += from.buckets[b].load(std::memory_order_relaxed);
+            }
+            to.count += from.count.load(std::memory_order_relaxed);
+            to.sumMicros += from.sumMicros.load(std::memory_order_relaxed);
+        }
+    }
+    return snap;
+}
+
+namespace metrics_detail {
+
+inline void writeCounter(std::ostringstream& out, const char* name, const char* help, const char* type,
+                         uint64_t value) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n"
+        << name << " " << value << "\n";
+}
+
+// Prometheus wants a fixed set of cumulative buckets, so the fine buckets
+// are folded into powers of two from 16us to about a minute. The exact
+// quantiles go out alongside as a separate gauge.
+inline void writeHistogram(std::ostringstream& out, const char* name, const char* help,
+                           const MetricsSnapshot::Histogram& h) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int power = HISTOGRAM_SUB_BITS; power <= 26; power++) {
+        uint64_t limit = 1ULL << power;
+        while (bucket < HISTOGRAM_BUCKETS && histogramBucketLimit(bucket) <= limit) {
+            cumulative += h.buckets[bucket++];
+        }
+        out << name << "_bucket{le=\"" << limit / 1e6 << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+    out << name << "_sum " << h.sumMicros / 1e6 << "\n";
+    out << name << "_count " << h.count << "\n";
+
+    out << "# HELP " << name << "_quantile " << help << " (quantiles, 6% resolution)\n"
+        << "# TYPE " << name << "_quantile gauge\n";
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (double q : quantiles) {
+        out << name << "_quantile{quantile=\"" << q << "\"} " << h.quantile(q) / 1e6 << "\n";
+    }
+}
+
+} // namespace metrics_detail
+
+inline std::string renderMetrics() {
+    using metrics_detail::writeCounter;
+    using metrics_detail::writeHistogram;
+
+    MetricsSnapshot s = collectMetrics();
+    std::ostringstream out;
+    writeCounter(out, "type2c_connections_active", "Client connections currently open.", "gauge",
+                 s.counters[CONNECTIONS_OPENED] - s.counters[CONNECTIONS_CLOSED]);
+    writeCounter(out, "type2c_connections_total", "Client connections accepted.", "counter",
+                 s.counters[CONNECTIONS_OPENED]);
+    writeCounter(out, "type2c_rooms_active", "Rooms currently counting down or racing.", "gauge",
+                 s.counters[ROOMS_OPENED] - s.counters[ROOMS_CLOSED]);
+    writeCounter(out, "type2c_rooms_total", "Rooms opened.", "counter", s.counters[ROOMS_OPENED]);
+    writeCounter(out, "type2c_games_finished_total", "Rooms that sent their results.", "counter",
+                 s.counters[GAMES_FINISHED]);
+    writeCounter(out, "type2c_players_waiting", "Players queued for a match.", "gauge",
+                 s.counters[PLAYERS_QUEUED] - s.counters[PLAYERS_DEQUEUED]);
+    writeCounter(out, "type2c_spectators_active", "Spectators currently watching a room.", "gauge",
+                 s.counters[SPECTATORS_JOINED] - s.counters[SPECTATORS_LEFT]);
+    writeCounter(out, "type2c_spectators_total", "Spectators that joined a room.", "counter",
+                 s.counters[SPECTATORS_JOINED]);
+    writeCounter(out, "type2c_spectator_snapshots_dropped_total",
+                 "Snapshots a slow spectator skipped because a newer one replaced it.", "counter",
+                 s.counters[SPECTATOR_FRAMES_DROPPED]);
+    writeCounter(out, "type2c_connections_timed_out_total",
+                 "Connections closed for sending nothing within their idle or AFK timeout.", "counter",
+                 s.counters[CONNECTIONS_TIMED_OUT]);
+    writeCounter(out, "type2c_races_timed_out_total", "Races ended by the time limit.", "counter",
+                 s.counters[RACES_TIMED_OUT]);
+    writeCounter(out, "type2c_replays_recorded_total", "Races written to replay segments.", "counter",
+                 s.counters[REPLAYS_RECORDED]);
+    writeCounter(out, "type2c_replays_dropped_total",
+                 "Races not recorded because the replay writer was too far behind.", "counter",
+                 s.counters[REPLAYS_DROPPED]);
+    writeCounter(out, "type2c_replay_bytes_written_total", "Bytes written to replay segments.", "counter",
+                 s.counters[REPLAY_BYTES_WRITTEN]);
+    writeCounter(out, "type2c_results_recorded_total", "Results added to the leaderboard.", "counter",
+                 s.counters[RESULTS_RECORDED]);
+    writeCounter(out, "type2c_results_dropped_total",
+                 "Results left off the leaderboard because the result log was too far behind or could not be written.", "counter",
+                 s.counters[RESULTS_DROPPED]);
+    writeCounter(out, "type2c_result_log_commits_total", "Batches of results written and synced to the result log.",
+                 "counter", s.counters[RESULT_LOG_COMMITS]);
+    writeCounter(out, "type2c_text_chunks_sent_total",
+                 "Pieces of long passages streamed to players as they typed, and to spectators.", "counter",
+                 s.counters[TEXT_CHUNKS_SENT]);
+    writeCounter(out, "type2c_analytics_rows_written_total", "Player results written to analytics files.", "counter",
+                 s.counters[ANALYTICS_ROWS_WRITTEN]);
+    writeCounter(out, "type2c_analytics_rows_dropped_total",
+                 "Player results not exported because the analytics writer was too far behind.", "counter",
+                 s.counters[ANALYTICS_ROWS_DROPPED]);
+    writeCounter(out, "type2c_analytics_bytes_written_total", "Bytes written to analytics files.", "counter",
+                 s.counters[ANALYTICS_BYTES_WRITTEN]);
+    writeCounter(out, "type2c_messages_in_total", "Frames received from clients.", "counter",
+                 s.counters[MESSAGES_IN]);
+    writeCounter(out, "type2c_messages_out_total", "Messages queued to clients.", "counter",
+                 s.counters[MESSAGES_OUT]);
+    writeCounter(out, "type2c_bytes_in_total", "Bytes read from client sockets.", "counter",
+                 s.counters[BYTES_IN]);
+    writeCounter(out, "type2c_bytes_out_total", "Bytes written to client sockets.", "counter",
+                 s.counters[BYTES_OUT]);
+    writeCounter(out, "type2c_parse_errors_total", "Frames rejected as malformed.", "counter",
+                 s.counters[PARSE_ERRORS]);
+    writeCounter(out, "type2c_scores_total", "Keystroke logs scored.", "counter", s.counters[SCORES_COMPUTED]);
+    writeCounter(out, "type2c_frame_buffers_allocated_total",
+                 "Outgoing frame buffers allocated because the pool was empty.", "counter",
+                 s.counters[FRAME_BUFFERS_ALLOCATED]);
+    writeHistogram(out, "type2c_room_fill_seconds", "Time a room's longest-waiting player waited for the match.",
+                   s.histograms[ROOM_FILL]);
+    writeHistogram(out, "type2c_results_fanout_seconds",
+                   "Time from a room's last FINISH to its RESULTS being queued.", s.histograms[RESULTS_FANOUT]);
+    writeHistogram(out, "type2c_scoring_seconds", "Time to score what is left of one keystroke log at FINISH.",
+                   s.histograms[SCORING]);
+    writeHistogram(out, "type2c_result_commit_seconds", "Time to write and sync one batch of the result log.",
+                   s.histograms[RESULT_COMMIT]);
+    writeHistogram(out, "type2c_keylog_settling_seconds",
+                   "Time a network loop spent settling the passage segments of one KEYLOG frame.",
+                   s.histograms[KEYLOG_SETTLING]);
+    return out.str();
+}
@@ -0,0 +1,549 @@
+#pragma once
+
+// Wire protocol shared by the server and the client.
+//
+// Every message is a frame: an 8-byte header followed by a binary payload.
+//
+//   offset 0  'T' '2'       magic
+//   offset 2  u8            protocol version
+//   offset 3  u8            message type
+//   offset 4  u32           payload length
+//
+// All integers are big-endian. WPM and accuracy travel as u32 hundredths.
+//
+// A connection opens with HELLO to race, or SPECTATE to watch a room; the
+// server ignores it until then.
+//
+// Passages of any length are streamed: START carries the passage's length
+// and its first TEXT_WINDOW bytes, and TEXT frames carry the rest as a
+// player's PROGRESS reports show them closing in on the end of what they
+// have, so a player never holds more than a window ahead of the cursor.
+// Spectators follow every player at once, so they get the whole passage,
+// but still a piece at a time: the next TEXT goes out each time the last
+// one has left their socket.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const uint8_t PROTOCOL_VERSION = 5;
+const size_t FRAME_HEADER_SIZE = 8;
+
+// Largest payload the client accepts (a START carries a text window)
+const size_t CLIENT_MAX_PAYLOAD = 64 * 1024;
+// Passage a player may have been sent beyond its cursor
+const size_t TEXT_WINDOW = 16 * 1024;
+// Pieces the passage is sent in past the first window
+const size_t TEXT_CHUNK_SIZE = 4 * 1024;
+// Client-to-server frames are small; this bounds per-connection memory
+const size_t SERVER_INBOUND_BUFFER = 4 * 1024;
+// Keystroke logs are uploaded in pieces that fit the server's buffer
+const size_t KEYLOG_CHUNK_SIZE = 2048;
+// Longest name a player can go by; ratings are kept per name
+const size_t MAX_PLAYER_NAME = 32;
+
+enum MessageType : uint8_t {
+    MSG_START = 1,     // server -> client: u64 room, u16 player (SPECTATOR_ID to spectators), u16 players,
+                       //                   u32 passage length, the passage's first window
+    MSG_FINISH = 2,    // client -> server: u32 wpm, u32 accuracy as claimed; ends the key log
+    MSG_RESULTS = 3,   // server -> client: u16 count, count x result entry
+    MSG_ERROR = 4,     // server -> client: u16 code, message text
+    MSG_PROGRESS = 5,  // client -> server: u32 cursor, u32 errors, u32 ms since start
+    MSG_SNAPSHOT = 6,  // server -> client: u32 tick, u16 count, count x progress entry
+    MSG_KEYLOG = 7,    // client -> server: next piece of the keystroke log (keylog.h)
+    MSG_HELLO = 8,     // client -> server: first frame of a player, player name (may be empty)
+    MSG_SPECTATE = 9,  // client -> server: first frame of a spectator, u64 room (0 for the latest to start)
+    MSG_COUNTDOWN = 10,// server -> client: u32 ms until START, u32 race time limit in ms (0 for none)
+    MSG_TEXT = 11      // server -> client: u32 offset, the next piece of the passage
+};
+
+// Player id in the START a spectator receives
+const uint16_t SPECTATOR_ID = 0xFFFF;
+
+enum ErrorCode : uint16_t {
+    ERR_BAD_MAGIC = 1,
+    ERR_BAD_VERSION = 2,
+    ERR_FRAME_TOO_LARGE = 3,
+    ERR_MALFORMED = 4,
+    ERR_HANDSHAKE = 5,
+    ERR_NO_SUCH_ROOM = 6,
+    ERR_TIMEOUT = 7
+};
+
+// Big-endian field helpers
+
+inline void putU16(char* p, uint16_t v) {
+    p[0] = static_cast<char>(v >> 8);
+    p[1] = static_cast<char>(v);
+}
+
+inline void putU32(char* p, uint32_t v) {
+    putU16(p, static_cast<uint16_t>(v >> 16));
+    putU16(p + 2, static_cast<uint16_t>(v));
+}
+
+inline void putU64(char* p, uint64_t v) {
+    putU32(p, static_cast<uint32_t>(v >> 32));
+    putU32(p + 4, static_cast<uint32_t>(v));
+}
+
+inline uint16_t getU16(const char* p) {
+    return static_cast<uint16_t>((static_cast<uint8_t>(p[0]) << 8) | static_cast<uint8_t>(p[1]));
+}
+
+inline uint32_t getU32(const char* p) {
+    return (static_cast<uint32_t>(getU16(p)) << 16) | getU16(p + 2);
+}
+
+inline uint64_t getU64(const char* p) {
+    return (static_cast<uint64_t>(getU32(p)) << 32) | getU32(p + 4);
+}
+
+inline uint32_t toHundredths(double value) {
+    if (value <= 0) return 0;
+    if (value >= 42949672.0) return 0xFFFFFFFFu;
+    return static_cast<uint32_t>(value * 100.0 + 0.5);
+}
+
+inline double fromHundredths(uint32_t value) {
+    return value / 100.0;
+}
+
+// Bounds-checked sequential reader over a payload
+class WireReader {
+public:
+    explicit WireReader(std::string_view data) : data(data), pos(0) {}
+
+    bool u8(uint8_t& v) {
+        if (!has(1)) return false;
+        v = static_cast<uint8_t>(data[pos++]);
+        return true;
+    }
+    bool u16(uint16_t& v) { return fixed(v, 2, getU16); }
+    bool u32(uint32_t& v) { return fixed(v, 4, getU32); }
+    bool u64(uint64_t& v) { return fixed(v, 8, getU64); }
+
+    // Everything not read yet
+    std::string_view rest() {
+        std::string_view r = data.substr(pos);
+        pos = data.size();
+        return r;
+    }
+
+private:
+    std::string_view data;
+    size_t pos;
+
+    bool has(size_t n) const { return data.size() - pos >= n; }
+
+    template <typename T, typename F>
+    bool fixed(T& v, size_t n, F get) {
+        if (!has(n)) return false;
+        v = get(data.data() + pos);
+        pos += n;
+        return true;
+    }
+};
+
+// Fixed-capacity byte ring. Capacity is rounded up to a power of two and
+// allocated once; head and tail only grow and are masked on access.
+class RingBuffer {
+public:
+    struct Segment {
+        char* data;
+        size_t len;
+    };
+
+    explicit RingBuffer(size_t minCapacity) : head(0), tail(0) {
+        cap = 1;
+        while (cap < minCapacity) cap <<= 1;
+        mask = cap - 1;
+        buf.reset(new char[cap]);
+    }
+
+    size_t size() const { return tail - head; }
+    size_t space() const { return cap - size(); }
+    size_t capacity() const { return cap; }
+
+    // Free space as up to two contiguous segments, for recv/readv
+    int writableSegments(Segment out[2]) {
+        size_t free = space();
+        if (free == 0) return 0;
+        size_t start = tail & mask;
+        size_t first = std::min(free, cap - start);
+        out[0].data = buf.get() + start;
+        out[0].len = first;
+        if (first == free) return 1;
+        out[1].data = buf.get();
+        out[1].len = free - first;
+        return 2;
+    }
+
+    void commit(size_t n) { tail += n; }
+
+    void consume(size_t n) {
+        head += n;
+        // Rewinding when empty keeps most frames contiguous
+        if (head == tail) head = tail = 0;
+    }
+
+    // Copy bytes out without consuming them
+    void peek(size_t offset, char* out, size_t n) const {
+        size_t start = (head + offset) & mask;
+        size_t first = std::min(n, cap - start);
+        memcpy(out, buf.get() + start, first);
+        memcpy(out + first, buf.get(), n - first);
+    }
+
+    bool contiguous(size_t offset, size_t n) const {
+        return ((head + offset) & mask) + n <= cap;
+    }
+
+    const char* at(size_t offset) const {
+        return buf.get() + ((head + offset) & mask);
+    }
+
+    // Rotate the contents in place so they start at offset 0
+    void linearize() {
+        size_t n = size();
+        std::rotate(buf.get(), buf.get() + (head & mask), buf.get() + cap);
+        head = 0;
+        tail = n;
+    }
+
+private:
+    std::unique_ptr<char[]> buf;
+    size_t cap;
+    size_t mask;
+    size_t head;
+    size_t tail;
+};
+
+struct Frame {
+    uint8_t type;
+    std::string_view payload;   // valid until the next call to FrameDecoder::next
+};
+
+enum DecodeStatus {
+    DECODE_NEED_MORE,
+    DECODE_FRAME,
+    DECODE_ERROR
+};
+
+// Incremental frame decoder over a per-connection ring buffer. Bytes are
+// read straight into buffer(); next() then yields every complete frame as a
+// view into the ring. Partial and coalesced reads are both fine, and the
+// steady state allocates nothing: a frame that wraps around the end of the
+// ring is made contiguous by rotating the ring in place.
+class FrameDecoder {
+public:
+    FrameDecoder(size_t bufferSize, size_t maxPayload)
+        : ring(std::max(bufferSize, FRAME_HEADER_SIZE + maxPayload)),
+          maxPayload(maxPayload), pending(0), error(0) {}
+
+    RingBuffer& buffer() { return ring; }
+    uint16_t lastError() const { return error; }
+
+    DecodeStatus next(Frame& frame) {
+        ring.consume(pending);
+        pending = 0;
+
+        if (ring.size() < FRAME_HEADER_SIZE) return DECODE_NEED_MORE;
+
+        char header[FRAME_HEADER_SIZE];
+        ring.peek(0, header, FRAME_HEADER_SIZE);
+        if (header[0] != 'T' || header[1] != '2') {
+            error = ERR_BAD_MAGIC;
+            return DECODE_ERROR;
+        }
+        if (static_cast<uint8_t>(header[2]) != PROTOCOL_VERSION) {
+            error = ERR_BAD_VERSION;
+            return DECODE_ERROR;
+        }
+        uint32_t length = getU32(header + 4);
+        if (length > maxPayload) {
+            error = ERR_FRAME_TOO_LARGE;
+            return DECODE_ERROR;
+        }
+        if (ring.size() < FRAME_HEADER_SIZE + length) return DECODE_NEED_MORE;
+
+        if (!ring.contiguous(FRAME_HEADER_SIZE, length)) {
+            ring.linearize();
+        }
+        frame.type = static_cast<uint8_t>(header[3]);
+        frame.payload = std::string_view(ring.at(FRAME_HEADER_SIZE), length);
+        pending = FRAME_HEADER_SIZE + length;
+        return DECODE_FRAME;
+    }
+
+private:
+    RingBuffer ring;
+    size_t maxPayload;
+    size_t pending;    // bytes of the last returned frame, consumed on the next call
+    uint16_t error;
+};
+
+// Encoders append one complete frame to out
+
+inline void appendHeader(std::string& out, MessageType type, size_t payloadLen) {
+    size_t start = out.size();
+    out.resize(start + FRAME_HEADER_SIZE);
+    char* p = &out[start];
+    p[0] = 'T';
+    p[1] = '2';
+    p[2] = static_cast<char>(PROTOCOL_VERSION);
+    p[3] = static_cast<char>(type);
+    putU32(p + 4, static_cast<uint32_t>(payloadLen));
+}
+
+inline char* appendFrame(std::string& out, MessageType type, size_t payloadLen) {
+    appendHeader(out, type, payloadLen);
+    size_t start = out.size();
+    out.resize(start + payloadLen);
+    return &out[start];
+}
+
+// A START frame up to its first window of text, which the caller sends
+// right after it. Lets one copy of the text go to every player in the room.
+inline void encodeStartHeader(std::string& out, uint64_t roomId, uint16_t playerId,
+                              uint16_t playerCount, uint32_t passageLength, size_t windowLen) {
+    appendHeader(out, MSG_START, 16 + windowLen);
+    size_t start = out.size();
+    out.resize(start + 16);
+    char* p = &out[start];
+    putU64(p, roomId);
+    putU16(p + 8, playerId);
+    putU16(p + 10, playerCount);
+    putU32(p + 12, passageLength);
+}
+
+inline void encodeStart(std::string& out, uint64_t roomId, uint16_t playerId,
+                        uint16_t playerCount, std::string_view passage) {
+    std::string_view window = passage.substr(0, TEXT_WINDOW);
+    encodeStartHeader(out, roomId, playerId, playerCount, static_cast<uint32_t>(passage.size()), window.size());
+    out.append(window.data(), window.size());
+}
+
+// A TEXT frame up to its piece of the passage, sent right after it
+inline void encodeTextHeader(std::string& out, uint32_t offset, size_t pieceLen) {
+    appendHeader(out, MSG_TEXT, 4 + pieceLen);
+    size_t start = out.size();
+    out.resize(start + 4);
+    putU32(&out[start], offset);
+}
+
+inline void encodeText(std::string& out, uint32_t offset, std::string_view piece) {
+    encodeTextHeader(out, offset, piece.size());
+    out.append(piece.data(), piece.size());
+}
+
+inline void encodeHello(std::string& out, std::string_view name = std::string_view()) {
+    char* p = appendFrame(out, MSG_HELLO, name.size());
+    if (!name.empty()) memcpy(p, name.data(), name.size());
+}
+
+inline void encodeSpectate(std::string& out, uint64_t roomId) {
+    char* p = appendFrame(out, MSG_SPECTATE, 8);
+    putU64(p, roomId);
+}
+
+inline void encodeCountdown(std::string& out, uint32_t startsInMs, uint32_t timeLimitMs) {
+    char* p = appendFrame(out, MSG_COUNTDOWN, 8);
+    putU32(p, startsInMs);
+    putU32(p + 4, timeLimitMs);
+}
+
+inline void encodeFinish(std::string& out, double wpm, double accuracy) {
+    char* p = appendFrame(out, MSG_FINISH, 8);
+    putU32(p, toHundredths(wpm));
+    putU32(p + 4, toHundredths(accuracy));
+}
+
+// Split a keystroke log into as many KEYLOG frames as it needs
+inline void encodeKeyLog(std::string& out, std::string_view log) {
+    for (size_t pos = 0; pos < log.size(); pos += KEYLOG_CHUNK_SIZE) {
+        std::string_view chunk = log.substr(pos, KEYLOG_CHUNK_SIZE);
+        char* p = appendFrame(out, MSG_KEYLOG, chunk.size());
+        memcpy(p, chunk.data(), chunk.size());
+    }
+}
+
+struct ResultEntry {
+    uint16_t playerId;
+    bool finished;
+    double wpm;
+    double accuracy;
+};
+
+const size_t RESULT_ENTRY_SIZE = 11;
+
+inline void encodeResults(std::string& out, const ResultEntry* entries, size_t count) {
+    char* p = appendFrame(out, MSG_RESULTS, 2 + count * RESULT_ENTRY_SIZE);
+    putU16(p, static_cast<uint16_t>(count));
+    p += 2;
+    for (size_t i = 0; i < count; i++, p += RESULT_ENTRY_SIZE) {
+        putU16(p, entries[i].playerId);
+        p[2] = entries[i].finished ? 1 : 0;
+        putU32(p + 3, toHundredths(entries[i].wpm));
+        putU32(p + 7, toHundredths(entries[i].accuracy));
+    }
+}
+
+inline void encodeProgress(std::string& out, uint32_t cursor, uint32_t errors, uint32_t elapsedMs) {
+    char* p = appendFrame(out, MSG_PROGRESS, 12);
+    putU32(p, cursor);
+    putU32(p + 4, errors);
+    putU32(p + 8, elapsedMs);
+}
+
+enum ProgressFlags : uint8_t {
+    PROGRESS_FINISHED = 1,
+    PROGRESS_LEFT = 2
+};
+
+struct ProgressEntry {
+    uint16_t playerId;
+    uint8_t flags;
+    uint32_t cursor;
+    uint32_t errors;
+};
+
+const size_t PROGRESS_ENTRY_SIZE = 11;
+
+// Most players a room can hold: its SNAPSHOT and RESULTS, an entry per
+// player, must fit a client's largest payload (5957 players)
+const size_t MAX_ROOM_SIZE = (CLIENT_MAX_PAYLOAD - 6) / std::max(PROGRESS_ENTRY_SIZE, RESULT_ENTRY_SIZE);
+
+// One snapshot covers every player in the room, so a room costs one frame
+// per recipient per tick however fast anyone types
+inline void encodeSnapshot(std::string& out, uint32_t tick, const ProgressEntry* entries, size_t count) {
+    char* p = appendFrame(out, MSG_SNAPSHOT, 6 + count * PROGRESS_ENTRY_SIZE);
+    putU32(p, tick);
+    putU16(p + 4, static_cast<uint16_t>(count));
+    p += 6;
+    for (size_t i = 0; i < count; i++, p += PROGRESS_ENTRY_SIZE) {
+        putU16(p, entries[i].playerId);
+        p[2] = static_cast<char>(entries[i].flags);
+        putU32(p + 3, entries[i].cursor);
+        putU32(p + 7, entries[i].errors);
+    }
+}
+
+inline void encodeError(std::string& out, uint16_t code, std::string_view message) {
+    char* p = appendFrame(out, MSG_ERROR, 2 + message.size());
+    putU16(p, code);
+    memcpy(p + 2, message.data(), message.size());
+}
+
+// Decoders return false on a malformed payload
+
+struct StartMessage {
+    uint64_t roomId;
+    uint16_t playerId;
+    uint16_t playerCount;
+    uint32_t passageLength;
+    std::string_view text;      // the first window; all of it for most passages
+};
+
+inline bool parseStart(std::string_view payload, StartMessage& msg) {
+    WireReader r(payload);
+    if (!r.u64(msg.roomId) || !r.u16(msg.playerId) || !r.u16(msg.playerCount) || !r.u32(msg.passageLength)) {
+        return false;
+    }
+    msg.text = r.rest();
+    return msg.text.size() <= msg.passageLength;
+}
+
+inline bool parseText(std::string_view payload, uint32_t& offset, std::string_view& piece) {
+    WireReader r(payload);
+    if (!r.u32(offset)) return false;
+    piece = r.rest();
+    return true;
+}
+
+// An empty name plays unrated
+inline bool parseHello(std::string_view payload, std::string& name) {
+    if (payload.size() > MAX_PLAYER_NAME) return false;
+    name.assign(payload.data(), payload.size());
+    return true;
+}
+
+inline bool parseSpectate(std::string_view payload, uint64_t& roomId) {
+    WireReader r(payload);
+    return r.u64(roomId);
+}
+
+inline bool parseCountdown(std::string_view payload, uint32_t& startsInMs, uint32_t& timeLimitMs) {
+    WireReader r(payload);
+    return r.u32(startsInMs) && r.u32(timeLimitMs);
+}
+
+inline bool parseFinish(std::string_view payload, double& wpm, double& accuracy) {
+    WireReader r(payload);
+    uint32_t w, a;
+    if (!r.u32(w) || !r.u32(a)) return false;
+    wpm = fromHundredths(w);
+    accuracy = fromHundredths(a);
+    return true;
+}
+
+inline bool parseResults(std::string_view payload, std::vector<ResultEntry>& entries) {
+    WireReader r(payload);
+    uint16_t count;
+    if (!r.u16(count)) return false;
+    entries.clear();
+    for (uint16_t i = 0; i < count; i++) {
+        ResultEntry e;
+        uint8_t finished;
+        uint32_t w, a;
+        if (!r.u16(e.playerId) || !r.u8(finished) || !r.u32(w) || !r.u32(a)) return false;
+        e.finished = finished != 0;
+        e.wpm = fromHundredths(w);
+        e.accuracy = fromHundredths(a);
+        entries.push_back(e);
+    }
+    return true;
+}
+
+inline bool parseProgress(std::string_view payload, uint32_t& cursor, uint32_t& errors, uint32_t& elapsedMs) {
+    WireReader r(payload);
+    return r.u32(cursor) && r.u32(errors) && r.u32(elapsedMs);
+}
+
+inline bool parseSnapshot(std::string_view payload, uint32_t& tick, std::vector<ProgressEntry>& entries) {
+    WireReader r(payload);
+    uint16_t count;
+    if (!r.u32(tick) || !r.u16(count)) return false;
+    entries.clear();
+    for (uint16_t i = 0; i < count; i++) {
+        ProgressEntry e;
+        if (!r.u16(e.playerId) || !r.u8(e.flags) || !r.u32(e.cursor) || !r.u32(e.errors)) return false;
+        entries.push_back(e);
+    }
+    return true;
+}
+
+inline bool parseError(std::string_view payload, uint16_t& code, std::string_view& message) {
+    WireReader r(payload);
+    if (!r.u16(code)) return false;
+    message = r.rest();
+    return true;
+}
+
+inline const char* errorCodeName(uint16_t code) {
+    switch (code) {
+        case ERR_BAD_MAGIC: return "not a Type2C frame";
+        case ERR_BAD_VERSION: return "unsupported protocol version";
+        case ERR_FRAME_TOO_LARGE: return "frame too large";
+        case ERR_MALFORMED: return "malformed message";
+        case ERR_HANDSHAKE: return "expected HELLO or SPECTATE";
+        case ERR_NO_SUCH_ROOM: return "no such room, or it has finished";
+        case ERR_TIMEOUT: return "timed out";
+        default: return "unknown error";
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Player skill ratings, keyed by the name a player sends in HELLO.
+//
+// A rating is a moving average of the WPM a player's finished races scored,
+// discounted by accuracy, so it reads as "correct words per minute". New
+// players converge over their first few races; after that each race moves
+// the rating a fixed share of the way, so it follows a player who improves.
+//
+// The map is split into stripes, each with its own lock and picked by the
+// name's hash, so worker loops settling rooms at the same time almost never
+// wait for each other.
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// What a player without history is matched as
+const double DEFAULT_RATING = 40.0;
+// Share of the way each race moves an established rating
+const double RATING_SMOOTHING = 0.2;
+
+struct PlayerRating {
+    double rating = DEFAULT_RATING;
+    uint32_t races = 0;
+};
+
+class RatingStore {
+public:
+    // Safe from any thread. Players never seen get the default.
+    PlayerRating get(const std::string& name) const {
+        const Stripe& stripe = stripeFor(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.players.find(name);
+        return it == stripe.players.end() ? PlayerRating() : it->second;
+    }
+
+    // Safe from any thread. Fold one scored race into a player's rating.
+    void record(const std::string& name, double wpm, double accuracy) {
+        double performance = wpm * accuracy / 100.0;
+        Stripe& stripe = stripeFor(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        PlayerRating& player = stripe.players[name];
+        player.races++;
+        double weight = player.races < 1.0 / RATING_SMOOTHING ? 1.0 / player.races : RATING_SMOOTHING;
+        player.rating += weight * (performance - player.rating);
+    }
+
+private:
+    static const int STRIPES = 64;
+
+    struct alignas(64) Stripe {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, PlayerRating> players;
+    };
+    Stripe stripes[STRIPES];
+
+    Stripe& stripeFor(const std::string& name) {
+        return stripes[std::hash<std::string>()(name) % STRIPES];
+    }
+
+    const Stripe& stripeFor(const std::string& name) const {
+        return stripes[std::hash<std::string>()(name) % STRIPES];
+    }
+};
@@ -0,0 +1,636 @@
+#pragma once
+
+// Edge-triggered epoll reactor used by the server.
+//
+// Each EventLoop runs on its own thread and owns every socket handed to it.
+// Other threads never touch a loop's connections directly; they queue work
+// with post(), which wakes the loop through an eventfd. Deadlines go on the
+// loop's timer wheel, which also bounds how long epoll_wait may sleep.
+
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "framepool.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "timerwheel.h"
+
+// Put a socket into non-blocking mode
+inline bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+class EventLoop;
+
+// What a connection is for, once its first frame says so
+enum ConnectionRole : uint8_t {
+    ROLE_HANDSHAKE,
+    ROLE_PLAYER,
+    ROLE_SPECTATOR
+};
+
+// Per-socket state. Only the owning loop's thread may touch it.
+struct Connection {
+    Connection() : decoder(SERVER_INBOUND_BUFFER, SERVER_INBOUND_BUFFER - FRAME_HEADER_SIZE) {}
+
+    uint64_t id;          // creating loop's index in the top 16 bits, sequence below
+    int fd;
+    uint64_t roomId;
+    int playerId;         // slot within the room
+    ConnectionRole role;
+    EventLoop* loop;
+    FrameDecoder decoder; // inbound bytes are read straight into its ring
+    std::vector<FrameRef> outQueue;   // frames the kernel has not fully accepted yet
+    size_t outHead;       // first frame in outQueue still to send
+    size_t outOffset;     // bytes of that frame already sent
+    bool flushQueued;     // already on the loop's list of sockets to write
+    bool notifyDrained;   // call Handler::onDrained whenever the queue empties
+    bool closed;
+
+    // Reads just stamp lastActivity; the timer only checks the stamp when it
+    // fires, so busy sockets never reschedule it
+    Timer idleTimer;
+    std::chrono::steady_clock::time_point lastActivity;
+    std::chrono::milliseconds idleTimeout{0};
+
+    bool hasQueuedOutput() const { return outHead < outQueue.size(); }
+};
+
+class EventLoop {
+public:
+    // Callbacks run on the loop thread
+    class Handler {
+    public:
+        virtual void onFrame(Connection& conn, const Frame& frame) = 0;
+        virtual void onClose(Connection& conn) = 0;
+        // The kernel took everything queued, for connections that asked
+        virtual void onDrained(Connection&) {}
+        // Nothing was read for the connection's idle timeout
+        virtual void onIdle(Connection& conn) { conn.loop->close(conn); }
+        virtual ~Handler() {}
+    };
+
+    EventLoop(int index, Handler* handler)
+        : index(index), handler(handler), spareFd(-1), cpu(-1), running(false), nextSeq(1) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            std::cerr << "Error creating event loop" << std::endl;
+            exit(1);
+        }
+
+        // A null data pointer marks the wakeup descriptor
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    ~EventLoop() {
+        stop();
+        for (auto& entry : connections) {
+            ::close(entry.second->fd);
+        }
+        if (spareFd >= 0) ::close(spareFd);
+        ::close(wakeFd);
+        ::close(epollFd);
+    }
+
+    int getIndex() const { return index; }
+
+    // Pin the loop thread to one CPU. Call before start().
+    void pinToCpu(int cpuIndex) {
+        cpu = cpuIndex;
+    }
+
+    // Accept connections from a listening socket on this loop, handing each
+    // new (already non-blocking) socket and its peer address to the callback.
+    // A loop may watch several listeners, one per bind address. The loop does
+    // not own the socket. Call before start().
+    void addListener(int fd, std::function<void(int, const sockaddr_storage&)> callback) {
+        std::unique_ptr<Listener> listener(new Listener());
+        listener->fd = fd;
+        listener->callback = std::move(callback);
+        setNonBlocking(fd);
+
+        // Level-triggered, so a burst can be taken in slices
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = listener.get();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        listeners.push_back(std::move(listener));
+
+        // Held back so that running out of descriptors can still be survived
+        if (spareFd < 0) spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    void start() {
+        running = true;
+        thread = std::thread(&EventLoop::run, this);
+    }
+
+    void stop() {
+        if (!thread.joinable()) return;
+        running = false;
+        wake();
+        thread.join();
+    }
+
+    // Queue a task to run on the loop thread. Safe from any thread.
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            tasks.push_back(std::move(task));
+        }
+        wake();
+    }
+
+    // Reserve an id for a connection this loop will own. Safe from any thread.
+    uint64_t newConnectionId() {
+        return (static_cast<uint64_t>(index) << 48) | nextSeq.fetch_add(1);
+    }
+
+    // Start watching a connected socket under an id from newConnectionId().
+    // Loop thread only; returns nullptr (and closes the socket) on failure.
+    Connection* attach(int fd, uint64_t id) {
+        setNonBlocking(fd);
+
+        std::unique_ptr<Connection> conn(new Connection());
+        conn->id = id;
+        conn->fd = fd;
+        conn->roomId = 0;
+        conn->playerId = -1;
+        conn->role = ROLE_HANDSHAKE;
+        conn->loop = this;
+        conn->outHead = 0;
+        conn->outOffset = 0;
+        conn->flushQueued = false;
+        conn->notifyDrained = false;
+        conn->closed = false;
+
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn.get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            std::cerr << "Error registering client socket" << std::endl;
+            ::close(fd);
+            return nullptr;
+        }
+
+        Connection* raw = conn.get();
+        raw->lastActivity = loopNow;
+        raw->idleTimer.callback = [this, raw]() { checkIdle(*raw); };
+        connections[id] = std::move(conn);
+        countMetric(CONNECTIONS_OPENED);
+        return raw;
+    }
+
+    // Loop thread only. Stop watching a connection and give it up with its
+    // socket still open, for adopt() on another loop. Output the socket does
+    // not take right away travels with it.
+    std::unique_ptr<Connection> detach(Connection& conn) {
+        if (conn.flushQueued) {
+            flushList.erase(std::remove(flushList.begin(), flushList.end(), &conn), flushList.end());
+            conn.flushQueued = false;
+        }
+        handleWrite(conn);
+        if (conn.closed) return nullptr;
+
+        // Timers belong to this loop's wheel; adopt() arms it again there
+        conn.idleTimer.cancel();
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        auto it = connections.find(conn.id);
+        std::unique_ptr<Connection> owned = std::move(it->second);
+        connections.erase(it);
+        owned->loop = nullptr;
+        return owned;
+    }
+
+    // Loop thread only. Take over a connection detached from another loop.
+    // Returns nullptr (and closes the socket) on failure.
+    Connection* adopt(std::unique_ptr<Connection> conn) {
+        conn->loop = this;
+
+        // Adding checks readiness, so bytes that arrived in between are seen
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn.get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            std::cerr << "Error registering client socket" << std::endl;
+            ::close(conn->fd);
+            countMetric(CONNECTIONS_CLOSED);
+            return nullptr;
+        }
+
+        Connection* raw = conn.get();
+        if (raw->outHead < raw->outQueue.size()) {
+            raw->flushQueued = true;
+            flushList.push_back(raw);
+        }
+        raw->idleTimer.callback = [this, raw]() { checkIdle(*raw); };
+        if (raw->idleTimeout.count() > 0) setIdleTimeout(*raw, raw->idleTimeout);
+        connections[raw->id] = std::move(conn);
+        return raw;
+    }
+
+    // Loop thread only
+    Connection* find(uint64_t connId) {
+        auto it = connections.find(connId);
+        return it == connections.end() ? nullptr : it->second.get();
+    }
+
+    // Loop thread only. Output is queued and written once per loop iteration,
+    // so several frames to one socket go out in a single sendmsg; whatever the
+    // socket does not take is flushed when epoll reports it writable again.
+    // Queueing takes a reference, so one frame can go to many connections
+    // without copying it. Never closes the connection, so it is safe to call
+    // while iterating.
+    void send(Connection& conn, const FrameRef& frame) {
+        send(conn, &frame, 1);
+    }
+
+    // One message sent in parts, such as a per-player header followed by a
+    // body shared by the whole room
+    void send(Connection& conn, const FrameRef* parts, size_t count) {
+        if (conn.closed) return;
+
+        for (size_t i = 0; i < count; i++) {
+            if (parts[i].size() > 0) conn.outQueue.push_back(parts[i]);
+        }
+        countMetric(MESSAGES_OUT);
+        if (!conn.flushQueued) {
+            conn.flushQueued = true;
+            flushList.push_back(&conn);
+        }
+    }
+
+    // Run a callback on the loop thread every intervalMs. Call before start().
+    void setTick(int intervalMs, std::function<void()> callback) {
+        tickInterval = std::chrono::milliseconds(intervalMs);
+        tickCallback = std::move(callback);
+    }
+
+    // Run a callback on the loop thread after every wakeup, for owners that
+    // hand work over without post(). Call before start().
+    void setWakeHandler(std::function<void()> callback) {
+        wakeCallback = std::move(callback);
+    }
+
+    // Loop thread only. Call Handler::onIdle once nothing has been read from
+    // the connection for timeout, counted from now; zero turns it off.
+    void setIdleTimeout(Connection& conn, std::chrono::milliseconds timeout) {
+        conn.idleTimeout = timeout;
+        conn.lastActivity = loopNow;
+        if (timeout.count() > 0 && !conn.closed) {
+            wheel.schedule(conn.idleTimer, timeout);
+        } else {
+            conn.idleTimer.cancel();
+        }
+    }
+
+    // The loop's timers, for deadlines that are not about one socket's
+    // silence. Loop thread only.
+    TimerWheel& timers() { return wheel; }
+
+    // Wake the loop without queueing a task. Safe from any thread and
+    // lock-free: a single eventfd write.
+    void notify() {
+        wake();
+    }
+
+    // Loop thread only
+    void close(Connection& conn) {
+        if (conn.closed) return;
+        conn.closed = true;
+        conn.idleTimer.cancel();
+        countMetric(CONNECTIONS_CLOSED);
+        handler->onClose(conn);
+
+        // Best effort for anything still queued, such as an ERROR frame
+        if (conn.outHead < conn.outQueue.size()) {
+            ssize_t n = writeQueued(conn, MSG_DONTWAIT);
+            if (n > 0) countMetric(BYTES_OUT, n);
+        }
+        conn.outQueue.clear();
+        conn.outHead = 0;
+        conn.outOffset = 0;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        ::close(conn.fd);
+        closing.push_back(conn.id);
+    }
+
+private:
+    struct Listener {
+        int fd;
+        std::function<void(int, const sockaddr_storage&)> callback;
+    };
+
+    int index;
+    Handler* handler;
+    int epollFd;
+    int wakeFd;
+    int spareFd;                     // released to shed connections at EMFILE
+    int cpu;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> nextSeq;
+    std::thread thread;
+
+    std::mutex tasksMutex;
+    std::vector<std::function<void()>> tasks;
+
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+    std::vector<uint64_t> closing;   // freed once the current batch is done
+    std::vector<Connection*> flushList;
+    std::vector<std::unique_ptr<Listener>> listeners;   // their addresses mark listener events
+
+    std::chrono::milliseconds tickInterval{0};
+    std::function<void()> tickCallback;
+    std::function<void()> wakeCallback;
+
+    TimerWheel wheel;
+    std::chrono::steady_clock::time_point loopNow = std::chrono::steady_clock::now();   // as of the last wakeup
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void runTasks() {
+        uint64_t count;
+        while (::read(wakeFd, &count, sizeof(count)) > 0) {}
+
+        std::vector<std::function<void()>> batch;
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            batch.swap(tasks);
+        }
+        for (auto& task : batch) {
+            task();
+        }
+        if (wakeCallback) wakeCallback();
+    }
+
+    // Take up to a slice of pending connections; the level-triggered listener
+    // brings us back for the rest after the other sockets had their turn
+    void acceptPending(Listener& listener) {
+        for (int i = 0; i < 64; i++) {
+            sockaddr_storage addr;
+            socklen_t addrLen = sizeof(addr);
+            int fd = accept4(listener.fd, reinterpret_cast<sockaddr*>(&addr), &addrLen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0) {
+                listener.callback(fd, addr);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if ((errno == EMFILE || errno == ENFILE) && spareFd >= 0) {
+                // Out of descriptors: accept and drop one with the spare, or
+                // the listener would stay readable and spin the loop
+                std::cerr << "Out of file descriptors, dropping a connection" << std::endl;
+                ::close(spareFd);
+                int dropped = accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (dropped >= 0) ::close(dropped);
+                spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            return;
+        }
+    }
+
+    // A loop has a listener or two, so a scan beats a lookup table
+    Listener* findListener(void* ptr) {
+        for (auto& listener : listeners) {
+            if (listener.get() == ptr) return listener.get();
+        }
+        return nullptr;
+    }
+
+    // Edge-triggered: keep reading until the kernel buffer is empty, decoding
+    // every complete frame as it lands in the connection's ring
+    void handleRead(Connection& conn) {
+        RingBuffer& ring = conn.decoder.buffer();
+
+        while (!conn.closed) {
+            RingBuffer::Segment segments[2];
+            int count = ring.writableSegments(segments);
+            if (count == 0) {
+                // Cannot happen while the ring holds a whole max-size frame
+                close(conn);
+                return;
+            }
+            iovec iov[2];
+            for (int i = 0; i < count; i++) {
+                iov[i].iov_base = segments[i].data;
+                iov[i].iov_len = segments[i].len;
+            }
+
+            ssize_t n = ::readv(conn.fd, iov, count);
+            if (n > 0) {
+                countMetric(BYTES_IN, n);
+                conn.lastActivity = loopNow;
+                ring.commit(n);
+                dispatchFrames(conn);
+            } else if (n == 0) {
+                close(conn);
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                close(conn);
+            }
+        }
+    }
+
+    void dispatchFrames(Connection& conn) {
+        Frame frame;
+        while (!conn.closed) {
+            DecodeStatus status = conn.decoder.next(frame);
+            if (status == DECODE_NEED_MORE) return;
+            if (status == DECODE_ERROR) {
+                countMetric(PARSE_ERRORS);
+                uint16_t code = conn.decoder.lastError();
+                FrameRef reply = FrameRef::acquire();
+                encodeError(reply.bytes(), code, errorCodeName(code));
+                send(conn, reply);
+                close(conn);
+                return;
+            }
+            countMetric(MESSAGES_IN);
+            handler->onFrame(conn, frame);
+        }
+    }
+
+    // One sendmsg of as much of the queue as fits in an iovec array
+    ssize_t writeQueued(Connection& conn, int flags) {
+        iovec iov[64];
+        int count = 0;
+        for (size_t i = conn.outHead; i < conn.outQueue.size() && count < 64; i++, count++) {
+            size_t skip = i == conn.outHead ? conn.outOffset : 0;
+            iov[count].iov_base = const_cast<char*>(conn.outQueue[i].data()) + skip;
+            iov[count].iov_len = conn.outQueue[i].size() - skip;
+        }
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return ::sendmsg(conn.fd, &msg, MSG_NOSIGNAL | flags);
+    }
+
+    // Drop the frames a write covered; a frame it only partly covered stays
+    // at the head with the offset to resume from
+    void consumeQueued(Connection& conn, size_t written) {
+        while (written > 0) {
+            size_t left = conn.outQueue[conn.outHead].size() - conn.outOffset;
+            if (written < left) {
+                conn.outOffset += written;
+                return;
+            }
+            written -= left;
+            conn.outQueue[conn.outHead++].reset();
+            conn.outOffset = 0;
+        }
+    }
+
+    void handleWrite(Connection& conn) {
+        while (!conn.closed && conn.outHead < conn.outQueue.size()) {
+            ssize_t n = writeQueued(conn, 0);
+            if (n > 0) {
+                countMetric(BYTES_OUT, n);
+                consumeQueued(conn, n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // Slow reader: slide what is left to the front once most of
+                // the queue has gone, so it does not grow without bound
+                if (conn.outHead > 64 && conn.outHead * 2 > conn.outQueue.size()) {
+                    conn.outQueue.erase(conn.outQueue.begin(), conn.outQueue.begin() + conn.outHead);
+                    conn.outHead = 0;
+                }
+                return;
+            } else {
+                close(conn);
+                return;
+            }
+        }
+        if (conn.closed) return;
+        conn.outQueue.clear();
+        conn.outHead = 0;
+        conn.outOffset = 0;
+
+        // Give the memory back if a slow reader made the queue grow
+        if (conn.outQueue.capacity() > 1024) {
+            std::vector<FrameRef>().swap(conn.outQueue);
+        }
+        if (conn.notifyDrained) handler->onDrained(conn);
+    }
+
+    void checkIdle(Connection& conn) {
+        auto quiet = std::chrono::duration_cast<std::chrono::milliseconds>(loopNow - conn.lastActivity);
+        if (quiet < conn.idleTimeout) {
+            wheel.schedule(conn.idleTimer, conn.idleTimeout - quiet);
+            return;
+        }
+        handler->onIdle(conn);
+    }
+
+    void flushPending() {
+        // A failed write closes its connection, and the close handler may
+        // queue more output, so the list can grow while we walk it
+        for (size_t i = 0; i < flushList.size(); i++) {
+            Connection* conn = flushList[i];
+            conn->flushQueued = false;
+            if (!conn->closed) {
+                handleWrite(*conn);
+            }
+        }
+        flushList.clear();
+    }
+
+    void run() {
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        using Clock = std::chrono::steady_clock;
+        epoll_event events[256];
+        Clock::time_point nextTick = Clock::now() + tickInterval;
+
+        while (running) {
+            int timeout = wheel.msUntilNextTick(Clock::now());
+            if (tickCallback) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - Clock::now());
+                int tickWait = wait.count() > 0 ? static_cast<int>(wait.count()) : 0;
+                if (timeout < 0 || tickWait < timeout) timeout = tickWait;
+            }
+
+            int n = epoll_wait(epollFd, events, 256, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+                break;
+            }
+            loopNow = Clock::now();
+
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    runTasks();
+                    continue;
+                }
+                if (Listener* listener = findListener(events[i].data.ptr)) {
+                    acceptPending(*listener);
+                    continue;
+                }
+
+                Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+                uint32_t flags = events[i].events;
+                if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    handleRead(*conn);
+                }
+                if ((flags & EPOLLOUT) && !conn->closed) {
+                    handleWrite(*conn);
+                }
+            }
+
+            wheel.advance(loopNow);
+
+            if (tickCallback && Clock::now() >= nextTick) {
+                tickCallback();
+                // Skip ticks we were too busy to run rather than bursting
+                nextTick += tickInterval;
+                if (nextTick < Clock::now()) nextTick = Clock::now() + tickInterval;
+            }
+
+            flushPending();
+
+            for (uint64_t id : closing) {
+                connections.erase(id);
+            }
+            closing.clear();
+        }
+    }
+};
@@ -0,0 +1,311 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+using namespace std;
+
+// Reads the replay segments the server writes with --replay-dir:
+//
+//     replay list SEGMENT...                 one line per race
+//     replay show ROOM SEGMENT...            one race in detail, for disputes
+//     replay rescore [--threads N] SEGMENT...
+//                                            score every log again and report
+//                                            where today's scoring disagrees
+//     replay serve [--port N] [--speed X] SEGMENT...
+//                                            stream races to the normal client
+//                                            as a spectator ("client --port N
+//                                            --spectate ROOM"), at X times real
+//                                            speed
+//
+// Segments are mapped, not read, so even large archives open at once.
+
+struct Archive {
+    vector<unique_ptr<ReplaySegment>> segments;   // oldest first
+
+    bool open(const vector<string>& paths) {
+        for (const string& path : paths) {
+            string error;
+            unique_ptr<ReplaySegment> segment = ReplaySegment::open(path, error);
+            if (!segment) {
+                cerr << error << endl;
+                return false;
+            }
+            if (segment->tornBytes() > 0) {
+                cerr << path << ": ignoring " << segment->tornBytes() << " bytes of an unfinished record at the end"
+                     << endl;
+            }
+            segments.push_back(move(segment));
+        }
+        stable_sort(segments.begin(), segments.end(), [](const unique_ptr<ReplaySegment>& a,
+                                                          const unique_ptr<ReplaySegment>& b) {
+            return a->createdAtMs() < b->createdAtMs();
+        });
+        return true;
+    }
+
+    // A room's race, or the latest race for room 0
+    bool find(uint64_t roomId, RaceReplay& race) const {
+        for (size_t s = segments.size(); s-- > 0;) {
+            const ReplaySegment& segment = *segments[s];
+            if (segment.size() == 0) continue;
+            long index = roomId == 0 ? static_cast<long>(segment.size()) - 1 : segment.find(roomId);
+            if (index >= 0) return segment.race(index, race);
+        }
+        return false;
+    }
+};
+
+string formatTime(uint64_t unixMs) {
+    time_t seconds = static_cast<time_t>(unixMs / 1000);
+    tm local;
+    localtime_r(&seconds, &local);
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    return text;
+}
+
+int listRaces(const Archive& archive) {
+    RaceReplay race;
+    for (const auto& segment : archive.segments) {
+        for (size_t i = 0; i < segment->size(); i++) {
+            if (!segment->race(i, race)) {
+                cerr << segment->source() << ": race " << i << " is damaged" << endl;
+                continue;
+            }
+            cout << "room " << race.roomId << "  " << formatTime(race.startedAtMs) << "  " << race.players.size()
+                 << " players  " << race.text.size() << " chars ";
+            for (const ReplayPlayer& player : race.players) {
+                cout << " | " << fixed << setprecision(1) << player.wpm << " WPM";
+                if (player.flags & REPLAY_FORFEIT) cout << " (forfeit)";
+            }
+            cout << endl;
+        }
+    }
+    return 0;
+}
+
+int showRace(const Archive& archive, uint64_t roomId) {
+    RaceReplay race;
+    if (!archive.find(roomId, race)) {
+        cerr << "No race for room " << roomId << endl;
+        return 1;
+    }
+    cout << "Room " << race.roomId << ", started " << formatTime(race.startedAtMs) << endl;
+    cout << "Passage (" << race.text.size() << " chars): " << race.text << "\n" << endl;
+
+    for (const ReplayPlayer& player : race.players) {
+        string typed;
+        uint32_t firstMs, lastMs, keystrokes;
+        bool intact = replayKeyLog(player.keyLog, typed, firstMs, lastMs, keystrokes);
+        KeyLogScore score = scoreKeyLog(race.text, player.keyLog, player.endMs);
+
+        cout << "Player " << player.playerId + 1 << ": " << (player.flags & REPLAY_FORFEIT ? "forfeit" : "finished")
+             << " after " << player.endMs / 1000.0 << " s" << endl;
+        cout << "  recorded  " << player.wpm << " WPM, " << player.accuracy << "% accuracy" << endl;
+        cout << "  rescored  " << score.wpm << " WPM, " << score.accuracy << "% accuracy" << endl;
+        cout << "  " << keystrokes << " keystrokes from " << firstMs << " to " << lastMs << " ms"
+             << (intact ? "" : ", log cut short") << endl;
+        cout << "  typed: " << typed << "\n" << endl;
+    }
+    return 0;
+}
+
+// Scores every recorded log with the current scoring code and compares it
+// with what the server decided at the time. Forfeits are not scored. Races
+// are spread over the threads segment by segment.
+int rescoreRaces(const Archive& archive, int threads) {
+    atomic<size_t> nextSegment{0};
+    atomic<uint64_t> logs{0}, mismatches{0}, keystrokes{0};
+    mutex outputMutex;
+    auto started = chrono::steady_clock::now();
+
+    auto work = [&]() {
+        RaceReplay race;
+        size_t s;
+        while ((s = nextSegment.fetch_add(1)) < archive.segments.size()) {
+            const ReplaySegment& segment = *archive.segments[s];
+            for (size_t i = 0; i < segment.size(); i++) {
+                if (!segment.race(i, race)) continue;
+                for (const ReplayPlayer& player : race.players) {
+                    if (player.flags & REPLAY_FORFEIT) continue;
+                    KeyLogScore score = scoreKeyLog(race.text, player.keyLog, player.endMs);
+                    logs++;
+                    keystrokes += score.keystrokes;
+                    // The wire carries hundredths, so that is as close as they can agree
+                    if (fabs(score.wpm - player.wpm) < 0.011 && fabs(score.accuracy - player.accuracy) < 0.011) continue;
+                    mismatches++;
+                    lock_guard<mutex> lock(outputMutex);
+                    cout << "room " << race.roomId << " player " << player.playerId + 1 << ": recorded " << player.wpm
+                         << " WPM " << player.accuracy << "%, now " << score.wpm << " WPM " << score.accuracy << "%"
+                         << endl;
+                }
+            }
+        }
+    };
+    vector<thread> workers;
+    for (int i = 0; i < threads; i++) workers.emplace_back(work);
+    for (thread& worker : workers) worker.join();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "Rescored " << logs << " logs (" << keystrokes << " keystrokes) in " << seconds << " s, "
+         << mismatches << " differ" << endl;
+    return mismatches == 0 ? 0 : 2;
+}
+
+bool sendAll(int fd, const string& bytes) {
+    size_t sent = 0;
+    while (sent < bytes.size()) {
+        ssize_t n = send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Block until the first whole frame arrives
+bool readFrame(int fd, FrameDecoder& decoder, Frame& frame) {
+    while (true) {
+        DecodeStatus status = decoder.next(frame);
+        if (status == DECODE_FRAME) return true;
+        if (status == DECODE_ERROR) return false;
+        RingBuffer::Segment segments[2];
+        if (decoder.buffer().writableSegments(segments) == 0) return false;
+        ssize_t n = recv(fd, segments[0].data, segments[0].len, 0);
+        if (n <= 0) return false;
+        decoder.buffer().commit(static_cast<size_t>(n));
+    }
+}
+
+// One viewer: answer its SPECTATE with the race, paced by the recorded
+// timestamps divided by speed
+void streamRace(const Archive& archive, int fd, double speed) {
+    FrameDecoder decoder(SERVER_INBOUND_BUFFER, SERVER_INBOUND_BUFFER - FRAME_HEADER_SIZE);
+    Frame frame;
+    uint64_t roomId;
+    RaceReplay race;
+    string out;
+    if (!readFrame(fd, decoder, frame) || frame.type != MSG_SPECTATE || !parseSpectate(frame.payload, roomId)) {
+        encodeError(out, ERR_HANDSHAKE, "replays can only be watched; send SPECTATE");
+    } else if (!archive.find(roomId, race)) {
+        encodeError(out, ERR_NO_SUCH_ROOM, errorCodeName(ERR_NO_SUCH_ROOM));
+    }
+    if (!out.empty()) {
+        sendAll(fd, out);
+        close(fd);
+        return;
+    }
+
+    cout << "Streaming room " << race.roomId << " at " << speed << "x" << endl;
+    ReplayStream stream(race);
+    auto started = chrono::steady_clock::now();
+    uint32_t atMs;
+    while (stream.next(atMs, out)) {
+        this_thread::sleep_until(started + chrono::microseconds(static_cast<int64_t>(atMs * 1000.0 / speed)));
+        if (!sendAll(fd, out)) break;
+        out.clear();
+    }
+    close(fd);
+}
+
+int serveRaces(const Archive& archive, int port, double speed) {
+    // Dual-stack where the host has IPv6
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1, off = 0;
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            cerr << "Cannot listen on port " << port << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    listen(fd, 128);
+    cout << "Serving replays on port " << port << " at " << speed << "x; watch with: client --port " << port
+         << " --spectate ROOM" << endl;
+
+    while (true) {
+        int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        thread(streamRace, cref(archive), client, speed).detach();
+    }
+}
+
+int usage(const char* program) {
+    cerr << "Usage: " << program << " list SEGMENT...\n"
+         << "       " << program << " show ROOM SEGMENT...\n"
+         << "       " << program << " rescore [--threads N] SEGMENT...\n"
+         << "       " << program << " serve [--port N] [--speed X] SEGMENT..." << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) return usage(argv[0]);
+    string command = argv[1];
+    int port = 8080;
+    double speed = 1.0;
+    int threads = max(1u, thread::hardware_concurrency());
+    uint64_t roomId = 0;
+    vector<string> paths;
+
+    int i = 2;
+    if (command == "show") roomId = strtoull(argv[i++], nullptr, 10);
+    for (; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--speed" && i + 1 < argc) {
+            speed = max(0.01, atof(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) return usage(argv[0]);
+
+    Archive archive;
+    if (!archive.open(paths)) return 1;
+
+    if (command == "list") return listRaces(archive);
+    if (command == "show") return showRace(archive, roomId);
+    if (command == "rescore") return rescoreRaces(archive, threads);
+    if (command == "serve") return serveRaces(archive, port, speed);
+    return usage(argv[0]);
+}
@@ -0,0 +1,592 @@
+#pragma once
+
+// Race replays: every finished race's passage and each player's keystroke
+// log, appended to segment files for dispute review and for re-scoring old
+// races after the scoring code changes.
+//
+// Segment layout (all integers little-endian):
+//
+//   header   32 bytes   "T2REPLAY", u32 version, u32 reserved,
+//                       u64 created (unix ms), u64 reserved
+//   records             u32 payload length, u8 type, payload
+//
+//   TEXT     u64 text id, passage bytes
+//   RACE     u64 room id, u64 text id, u64 started (unix ms), u16 players,
+//            then per player: u8 flags, u32 wpm and u32 accuracy in
+//            hundredths, u32 ms from START to the end of the player's race,
+//            u32 log length, the keystroke log (keylog.h)
+//
+// A passage goes into a segment once, ahead of the first race that uses it,
+// and races refer to it by id (a hash of its text), so each segment can be
+// read on its own and a race costs little more than its keystroke logs,
+// which are already delta-encoded varints. Records are only ever appended;
+// a reader stops at a torn record at the end, as left by a crash.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "accuracy.h"
+#include "corpus.h"
+#include "keylog.h"
+#include "metrics.h"
+#include "protocol.h"
+
+const char REPLAY_MAGIC[8] = {'T', '2', 'R', 'E', 'P', 'L', 'A', 'Y'};
+const uint32_t REPLAY_VERSION = 1;
+const size_t REPLAY_HEADER_SIZE = 32;
+const size_t REPLAY_RECORD_HEADER_SIZE = 5;
+
+enum ReplayRecordType : uint8_t {
+    REPLAY_TEXT = 1,
+    REPLAY_RACE = 2
+};
+
+enum ReplayPlayerFlags : uint8_t {
+    REPLAY_FINISHED = 1,     // has a result
+    REPLAY_FORFEIT = 2       // the result is a forfeit, not a scored log
+};
+
+// FNV-1a over the passage text: the same passage gets the same id in every
+// segment and across corpus reloads
+inline uint64_t replayTextId(std::string_view text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : text) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline uint64_t unixMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct ReplayPlayer {
+    uint16_t playerId;
+    uint8_t flags;
+    double wpm;
+    double accuracy;
+    uint32_t endMs;             // START to FINISH, or to the forfeit
+    std::string_view keyLog;
+};
+
+// One race as read back from a segment. Views point into the mapping.
+struct RaceReplay {
+    uint64_t roomId;
+    uint64_t startedAtMs;       // unix ms
+    uint64_t textId;
+    std::string_view text;
+    std::vector<ReplayPlayer> players;
+};
+
+// One race as the server hands it to the recorder. The logs are moved in,
+// and the corpus pointer keeps the passage mapped until it is written.
+struct RaceRecord {
+    uint64_t roomId;
+    uint64_t startedAtMs;
+    std::shared_ptr<const Corpus> corpus;
+    std::string_view text;
+    struct Player {
+        uint8_t flags;
+        double wpm;
+        double accuracy;
+        uint32_t endMs;
+        std::string keyLog;
+    };
+    std::vector<Player> players;
+
+    size_t byteSize() const {
+        size_t size = 64 + text.size();
+        for (const Player& player : players) size += 17 + player.keyLog.size();
+        return size;
+    }
+};
+
+// Appends races to segment files on a thread of its own. Network threads
+// hand races over with trySubmit(), which never blocks: when more than
+// maxQueuedBytes are waiting for the disk the race is dropped and counted.
+// The writer takes everything queued at once and writes it with one
+// write() per segment, so a burst of finished rooms costs a single syscall.
+class ReplayRecorder {
+public:
+    ReplayRecorder(std::string directory, size_t segmentBytes, size_t maxQueuedBytes)
+        : directory(std::move(directory)), segmentBytes(segmentBytes), maxQueuedBytes(maxQueuedBytes),
+          queuedBytes(0), stopping(false), fd(-1), segmentSize(0) {}
+
+    ~ReplayRecorder() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        if (writer.joinable()) writer.join();
+        if (fd >= 0) ::close(fd);
+    }
+
+    // Open the first segment and start the writer. On failure returns false
+    // and describes why in error.
+    bool start(std::string& error) {
+        mkdir(directory.c_str(), 0755);
+        if (!openSegment(error)) return false;
+        writer = std::thread(&ReplayRecorder::run, this);
+        return true;
+    }
+
+    // Never blocks. On false the race was dropped.
+    bool trySubmit(RaceRecord&& race) {
+        size_t size = race.byteSize();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queuedBytes + size > maxQueuedBytes) {
+                countMetric(REPLAYS_DROPPED);
+                return false;
+            }
+            queuedBytes += size;
+            queue.push_back(std::move(race));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+private:
+    std::string directory;
+    size_t segmentBytes;
+    size_t maxQueuedBytes;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<RaceRecord> queue;
+    size_t queuedBytes;
+    bool stopping;
+    std::thread writer;
+
+    // Writer thread only, after start()
+    int fd;
+    size_t segmentSize;
+    std::string pending;                        // encoded but not yet written
+    std::unordered_set<uint64_t> segmentTexts;  // passages the current segment holds
+
+    bool openSegment(std::string& error) {
+        using namespace corpus_detail;
+
+        uint64_t created = unixMillis();
+        int next = -1;
+        std::string path;
+        // Names sort by creation time; a name already taken moves up a millisecond
+        for (int attempt = 0; attempt < 1000 && next < 0; attempt++) {
+            char name[64];
+            snprintf(name, sizeof(name), "/replay-%013llu.t2r", static_cast<unsigned long long>(created + attempt));
+            path = directory + name;
+            next = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+            if (next < 0 && errno != EEXIST) break;
+        }
+        if (next < 0) {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+
+        std::string header(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+        storeLE32(header, REPLAY_VERSION);
+        storeLE32(header, 0);
+        storeLE64(header, created);
+        storeLE64(header, 0);
+        if (!writeAll(next, header)) {
+            error = path + ": " + strerror(errno);
+            ::close(next);
+            return false;
+        }
+        if (fd >= 0) ::close(fd);
+        fd = next;
+        segmentSize = header.size();
+        segmentTexts.clear();
+        return true;
+    }
+
+    static bool writeAll(int out, const std::string& bytes) {
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t n = ::write(out, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static void appendRecordHeader(std::string& out, ReplayRecordType type, size_t payloadLen) {
+        corpus_detail::storeLE32(out, static_cast<uint32_t>(payloadLen));
+        out.push_back(static_cast<char>(type));
+    }
+
+    void encodeRace(const RaceRecord& race) {
+        using namespace corpus_detail;
+
+        uint64_t textId = replayTextId(race.text);
+        if (segmentTexts.insert(textId).second) {
+            appendRecordHeader(pending, REPLAY_TEXT, 8 + race.text.size());
+            storeLE64(pending, textId);
+            pending.append(race.text.data(), race.text.size());
+        }
+
+        size_t payload = 26;
+        for (const RaceRecord::Player& player : race.players) payload += 17 + player.keyLog.size();
+        appendRecordHeader(pending, REPLAY_RACE, payload);
+        storeLE64(pending, race.roomId);
+        storeLE64(pending, textId);
+        storeLE64(pending, race.startedAtMs);
+        storeLE16(pending, static_cast<uint16_t>(race.players.size()));
+        for (const RaceRecord::Player& player : race.players) {
+            pending.push_back(static_cast<char>(player.flags));
+            storeLE32(pending, toHundredths(player.wpm));
+            storeLE32(pending, toHundredths(player.accuracy));
+            storeLE32(pending, player.endMs);
+            storeLE32(pending, static_cast<uint32_t>(player.keyLog.size()));
+            pending += player.keyLog;
+        }
+    }
+
+    // Write what is encoded to the current segment
+    void flush() {
+        if (pending.empty()) return;
+        if (writeAll(fd, pending)) {
+            countMetric(REPLAY_BYTES_WRITTEN, pending.size());
+            segmentSize += pending.size();
+        } else {
+            // A partial write leaves a torn record, which readers stop at, so
+            // nothing more may follow it in this segment
+            std::cerr << "Error writing replays: " << strerror(errno) << std::endl;
+            segmentSize = segmentBytes;
+        }
+        pending.clear();
+    }
+
+    void run() {
+        std::vector<RaceRecord> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;   // stopping, and everything is written
+                batch.swap(queue);
+                queuedBytes = 0;
+            }
+
+            for (RaceRecord& race : batch) {
+                if (segmentSize + pending.size() >= segmentBytes) {
+                    flush();
+                    std::string error;
+                    if (!openSegment(error)) {
+                        // Keep to the old one for now rather than retry every race
+                        std::cerr << "Error starting a replay segment: " << error << std::endl;
+                        segmentSize = 0;
+                    }
+                }
+                encodeRace(race);
+                countMetric(REPLAYS_RECORDED);
+            }
+            flush();
+            batch.clear();
+        }
+    }
+};
+
+// A segment mapped for reading. Races are indexed once when it is opened,
+// by hopping from record to record; reading one is then a few loads and
+// views into the mapping.
+class ReplaySegment {
+public:
+    ReplaySegment(const ReplaySegment&) = delete;
+    ReplaySegment& operator=(const ReplaySegment&) = delete;
+
+    ~ReplaySegment() {
+        if (base) munmap(const_cast<char*>(base), length);
+    }
+
+    // Map a segment. On failure returns null and describes why in error.
+    static std::unique_ptr<ReplaySegment> open(const std::string& path, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = path + ": " + strerror(errno);
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(REPLAY_HEADER_SIZE)) {
+            error = path + ": not a replay segment";
+            ::close(fd);
+            return nullptr;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            error = path + ": mmap failed: " + strerror(errno);
+            return nullptr;
+        }
+        // Reading a segment is one pass from front to back
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        std::unique_ptr<ReplaySegment> segment(new ReplaySegment(static_cast<const char*>(data), size, path));
+        if (!segment->index(error)) {
+            error = path + ": " + error;
+            return nullptr;
+        }
+        return segment;
+    }
+
+    size_t size() const { return races.size(); }
+    const std::string& source() const { return origin; }
+    uint64_t createdAtMs() const { return corpus_detail::loadLE64(base + 16); }
+    // Bytes at the end that do not form a whole record
+    size_t tornBytes() const { return torn; }
+
+    // Race by position in the segment, oldest first. False if its passage is
+    // missing or its player entries are cut short.
+    bool race(size_t index, RaceReplay& out) const {
+        using namespace corpus_detail;
+
+        const char* p = base + races[index].offset;
+        const char* end = p + races[index].length;
+        if (end - p < 26) return false;
+        out.roomId = loadLE64(p);
+        out.textId = loadLE64(p + 8);
+        out.startedAtMs = loadLE64(p + 16);
+        uint16_t count = loadLE16(p + 24);
+        p += 26;
+
+        auto text = texts.find(out.textId);
+        if (text == texts.end()) return false;
+        out.text = text->second;
+
+        out.players.clear();
+        for (uint16_t i = 0; i < count; i++) {
+            if (end - p < 17) return false;
+            ReplayPlayer player;
+            player.playerId = i;
+            player.flags = static_cast<uint8_t>(p[0]);
+            player.wpm = fromHundredths(loadLE32(p + 1));
+            player.accuracy = fromHundredths(loadLE32(p + 5));
+            player.endMs = loadLE32(p + 9);
+            uint32_t logLength = loadLE32(p + 13);
+            p += 17;
+            if (static_cast<size_t>(end - p) < logLength) return false;
+            player.keyLog = std::string_view(p, logLength);
+            p += logLength;
+            out.players.push_back(player);
+        }
+        return true;
+    }
+
+    // Position of a room's race, or -1
+    long find(uint64_t roomId) const {
+        for (size_t i = 0; i < races.size(); i++) {
+            if (corpus_detail::loadLE64(base + races[i].offset) == roomId) return static_cast<long>(i);
+        }
+        return -1;
+    }
+
+private:
+    struct Span {
+        size_t offset;
+        uint32_t length;
+    };
+
+    const char* base;
+    size_t length;
+    std::string origin;
+    std::vector<Span> races;
+    std::unordered_map<uint64_t, std::string_view> texts;
+    size_t torn;
+
+    ReplaySegment(const char* base, size_t length, const std::string& origin)
+        : base(base), length(length), origin(origin), torn(0) {}
+
+    bool index(std::string& error) {
+        using namespace corpus_detail;
+
+        if (memcmp(base, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0) {
+            error = "not a replay segment";
+            return false;
+        }
+        if (loadLE32(base + 8) != REPLAY_VERSION) {
+            error = "unsupported replay version " + std::to_string(loadLE32(base + 8));
+            return false;
+        }
+
+        size_t pos = REPLAY_HEADER_SIZE;
+        while (length - pos >= REPLAY_RECORD_HEADER_SIZE) {
+            uint32_t payload = loadLE32(base + pos);
+            uint8_t type = static_cast<uint8_t>(base[pos + 4]);
+            size_t start = pos + REPLAY_RECORD_HEADER_SIZE;
+            if (length - start < payload) break;
+            if (type == REPLAY_TEXT && payload >= 8) {
+                texts[loadLE64(base + start)] = std::string_view(base + start + 8, payload - 8);
+            } else if (type == REPLAY_RACE) {
+                races.push_back({start, payload});
+            }
+            pos = start + payload;
+        }
+        torn = length - pos;
+        return true;
+    }
+};
+
+// What a spectator would have seen of a recorded race: START, the rest of
+// the passage a TEXT piece at a time, a snapshot whenever the replayed
+// cursors moved, and RESULTS, each with its time from START. Snapshots come
+// at most every tickMs, like the live server's.
+class ReplayStream {
+public:
+    explicit ReplayStream(const RaceReplay& race, uint32_t tickMs = 50)
+        : race(race), tickMs(std::max<uint32_t>(tickMs, 1)), nowMs(0), endMs(0), tick(0), textSent(0),
+          stage(STAGE_START) {
+        players.resize(race.players.size());
+        entries.resize(race.players.size());
+        for (size_t i = 0; i < race.players.size(); i++) {
+            Player& player = players[i];
+            player.reader.reset(new KeyLogReader(race.players[i].keyLog));
+            player.more = player.reader->next(player.nextMs, player.nextKey);
+            player.done = false;
+            endMs = std::max(endMs, race.players[i].endMs);
+
+            ProgressEntry& entry = entries[i];
+            entry.playerId = static_cast<uint16_t>(i);
+            entry.flags = 0;
+            entry.cursor = 0;
+            entry.errors = 0;
+        }
+    }
+
+    // Append the next frame to out and say when it was sent. False once
+    // RESULTS has gone.
+    bool next(uint32_t& atMs, std::string& out) {
+        if (stage == STAGE_START) {
+            encodeStart(out, race.roomId, SPECTATOR_ID, static_cast<uint16_t>(race.players.size()), race.text);
+            textSent = std::min(race.text.size(), TEXT_WINDOW);
+            atMs = 0;
+            stage = STAGE_RACE;
+            return true;
+        }
+        if (textSent < race.text.size()) {
+            std::string_view piece = race.text.substr(textSent, TEXT_CHUNK_SIZE);
+            encodeText(out, static_cast<uint32_t>(textSent), piece);
+            textSent += piece.size();
+            atMs = 0;
+            return true;
+        }
+        while (stage == STAGE_RACE) {
+            uint64_t next = nextEventMs();
+            if (next == UINT64_MAX) {
+                stage = STAGE_RESULTS;
+                break;
+            }
+            // Skip quiet stretches whole, staying on tick boundaries
+            if (next > nowMs) nowMs += (next - nowMs + tickMs - 1) / tickMs * tickMs;
+            if (!advanceTo(nowMs)) continue;
+            encodeSnapshot(out, ++tick, entries.data(), entries.size());
+            atMs = static_cast<uint32_t>(nowMs);
+            return true;
+        }
+        if (stage == STAGE_RESULTS) {
+            std::vector<ResultEntry> results;
+            for (const ReplayPlayer& player : race.players) {
+                ResultEntry entry;
+                entry.playerId = player.playerId;
+                entry.finished = (player.flags & REPLAY_FINISHED) != 0;
+                entry.wpm = player.wpm;
+                entry.accuracy = player.accuracy;
+                results.push_back(entry);
+            }
+            encodeResults(out, results.data(), results.size());
+            atMs = static_cast<uint32_t>(std::max<uint64_t>(nowMs, endMs));
+            stage = STAGE_DONE;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    enum Stage { STAGE_START, STAGE_RACE, STAGE_RESULTS, STAGE_DONE };
+
+    struct Player {
+        std::unique_ptr<KeyLogReader> reader;
+        std::string typed;
+        uint32_t nextMs;
+        uint8_t nextKey;
+        bool more;
+        bool done;
+    };
+
+    const RaceReplay& race;
+    uint32_t tickMs;
+    uint64_t nowMs;
+    uint32_t endMs;
+    uint32_t tick;
+    size_t textSent;
+    Stage stage;
+    std::vector<Player> players;
+    std::vector<ProgressEntry> entries;
+
+    // Time of the next keystroke or finish, or UINT64_MAX when all are done
+    uint64_t nextEventMs() const {
+        uint64_t next = UINT64_MAX;
+        for (size_t i = 0; i < players.size(); i++) {
+            const Player& player = players[i];
+            if (player.more) {
+                next = std::min<uint64_t>(next, player.nextMs);
+            } else if (!player.done) {
+                next = std::min<uint64_t>(next, race.players[i].endMs);
+            }
+        }
+        return next;
+    }
+
+    // Apply every keystroke and finish up to time; true if anything changed
+    bool advanceTo(uint64_t time) {
+        bool changed = false;
+        for (size_t i = 0; i < players.size(); i++) {
+            Player& player = players[i];
+            bool typed = false;
+            while (player.more && player.nextMs <= time) {
+                if (player.nextKey == KEY_BACKSPACE) {
+                    if (!player.typed.empty()) player.typed.pop_back();
+                } else {
+                    player.typed.push_back(static_cast<char>(player.nextKey));
+                }
+                typed = true;
+                player.more = player.reader->next(player.nextMs, player.nextKey);
+            }
+            ProgressEntry& entry = entries[i];
+            if (typed) {
+                size_t length = std::min(player.typed.size(), race.text.size());
+                entry.cursor = static_cast<uint32_t>(length);
+                entry.errors = static_cast<uint32_t>(editDistance(race.text.substr(0, length), player.typed));
+                changed = true;
+            }
+            const ReplayPlayer& recorded = race.players[i];
+            if (!player.done && recorded.endMs <= time && !player.more) {
+                player.done = true;
+                entry.flags |= (recorded.flags & REPLAY_FORFEIT) ? PROGRESS_LEFT : PROGRESS_FINISHED;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+// Bounded pool of scoring threads, kept apart from the network loops.
+//
+// Network threads score keystroke logs as they arrive, a few segments per
+// frame at most, and hand a player's scorer over at FINISH with
+// trySubmit(), which never blocks: when the queue is full it returns false
+// and the caller keeps the job and retries later. Workers score what is
+// left, the segments the network threads did not get to and the passage
+// after them, and pass the result to the completion callback.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "corpus.h"
+#include "keylog.h"
+#include "metrics.h"
+
+struct ScoreJob {
+    int shard;                                // loop that owns the room
+    uint64_t roomId;
+    void* room;                               // the owner's room, opaque to the pool
+    int playerId;
+    std::shared_ptr<const Corpus> corpus;     // keeps the scorer's passage mapped
+    KeyLogScorer scorer;                      // the log so far, mostly scored already
+    std::string keyLog;                       // the whole log, only when races are recorded
+    uint32_t elapsedMs;                       // START to FINISH on the server clock
+    bool breakdown = false;                   // also attribute the edits to passage words
+    KeyLogScore score;                        // filled in by the worker
+    std::vector<uint32_t> wordErrors;         // filled in by the worker when asked for and known
+};
+
+class ScoringPool {
+public:
+    ScoringPool(int threads, size_t capacity, std::function<void(ScoreJob&)> onScored)
+        : capacity(capacity), onScored(std::move(onScored)), stopping(false) {
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(&ScoringPool::run, this);
+        }
+    }
+
+    ~ScoringPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Never blocks. On false the job is left untouched.
+    bool trySubmit(ScoreJob& job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() >= capacity) return false;
+            queue.push_back(std::move(job));
+        }
+        ready.notify_one();
+        return true;
+    }
+
+private:
+    size_t capacity;
+    std::function<void(ScoreJob&)> onScored;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<ScoreJob> queue;
+    std::vector<std::thread> workers;
+    bool stopping;
+
+    void run() {
+        while (true) {
+            ScoreJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (stopping) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            auto started = std::chrono::steady_clock::now();
+            job.score = job.scorer.finish(job.elapsedMs);
+            if (job.breakdown && job.score.valid) job.scorer.wordErrors(job.wordErrors);
+            recordLatency(SCORING, std::chrono::steady_clock::now() - started);
+            countMetric(SCORES_COMPUTED);
+            onScored(job);
+        }
+    }
+};
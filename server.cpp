@@ -1,331 +1,1609 @@
-#include <iostream>
-#include <string>
-#include <vector>
-#include <thread>
-#include <mutex>
-#include <cstring>
-#include <ctime>
-
-#ifdef _WIN32
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #include <windows.h>
-    #pragma comment(lib, "ws2_32.lib")
-    typedef int socklen_t;
-#else
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <unistd.h>
-    #include <arpa/inet.h>
-#endif
-
-using namespace std;
-
-// Cross-platform socket close function
-void closeSocket(int socket) {
-    #ifdef _WIN32
-        closesocket(socket);
-    #else
-        close(socket);
-    #endif
-}
-
-// Function to get the local machine's IP address
-string getLocalIPAddress() {
-    string localIP = "127.0.0.1"; // Default to localhost in case of failure
-
-    // Create a temporary socket
-    int tempSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (tempSocket == -1) {
-        cerr << "Failed to create socket for IP detection." << endl;
-        return localIP;
-    }
-
-    struct sockaddr_in remoteAddr;
-    remoteAddr.sin_family = AF_INET;
-    remoteAddr.sin_port = htons(80); // Arbitrary port
-    inet_pton(AF_INET, "8.8.8.8", &remoteAddr.sin_addr); // Google's public DNS
-
-    // Connect to Google's DNS server
-    if (connect(tempSocket, (struct sockaddr*)&remoteAddr, sizeof(remoteAddr)) == -1) {
-        cerr << "Failed to connect for IP detection." << endl;
-        closeSocket(tempSocket);
-        return localIP;
-    }
-
-    // Get the local address used for the connection
-    struct sockaddr_in localAddr;
-    socklen_t addrLen = sizeof(localAddr);
-    if (getsockname(tempSocket, (struct sockaddr*)&localAddr, &addrLen) == -1) {
-        cerr << "Failed to get local IP address." << endl;
-        closeSocket(tempSocket);
-        return localIP;
-    }
-
-    char ipBuffer[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &localAddr.sin_addr, ipBuffer, sizeof(ipBuffer));
-    localIP = string(ipBuffer);
-
-    closeSocket(tempSocket);
-    return localIP;
-}
-
-// Game state
-struct PlayerResult {
-    int id;
-    double wpm;
-    double accuracy;
-    bool finished;
-};
-
-class TypingServer {
-private:
-    int serverSocket;
-    vector<int> clientSockets;
-    vector<PlayerResult> results;
-    string typingText;
-    mutex resultsMutex;
-    bool gameStarted;
-    int playersFinished;
-
-    // Sample texts
-    vector<string> sampleTexts = {
-        "The quick brown fox jumped over a sleepy dog lying in the golden sunlight.",
-        "She walked quietly through the forest, listening to birds chirping and leaves rustling overhead.",
-        "Time passed slowly as the storm raged outside the small wooden cabin in the hills.",
-        "He typed rapidly, his fingers dancing across the keyboard like a pianist in a concert.",
-        "They packed their bags and left for the mountains before the sun could rise.",
-        "The stars shimmered brightly in the night sky, illuminating the path through the trees.",
-        "A good book can transport you to magical places beyond your wildest imagination.",
-        "The coffee shop buzzed with life, full of laughter, conversation, and the smell of espresso.",
-        "She smiled at the child playing with a red balloon on the busy street corner.",
-        "Learning new skills requires patience, practice, and the willingness to make many small mistakes.",
-        "The train arrived late, screeching to a stop at the nearly empty platform.",
-        "His heart pounded as he stood in front of the crowd, preparing to speak.",
-        "The lighthouse stood tall, casting light across the choppy sea during the stormy night.",
-        "A rainbow stretched across the sky after the heavy afternoon rain had finally passed.",
-        "She tied her shoes tightly and began her morning run through the quiet neighborhood.",
-        "He watched the sunset paint the clouds orange, pink, and purple above the ocean.",
-        "The wind blew strongly, carrying the scent of rain and freshly cut grass.",
-        "The old clock ticked loudly in the room, counting the seconds in perfect rhythm.",
-        "She opened the envelope slowly, hands trembling with anticipation and a hint of fear.",
-        "Their footsteps echoed through the vast, empty hall of the ancient abandoned building.",
-        "The little girl clutched her teddy bear tightly as the thunder rolled outside.",
-        "He found peace in the silence of early mornings before the world woke up.",
-        "A paper airplane soared across the room and landed perfectly on the teacher's desk.",
-        "The streetlamp flickered, casting shadows that danced across the pavement and nearby brick walls.",
-        "Her voice trembled slightly as she read the poem aloud to her classmates.",
-        "The fire crackled gently in the fireplace, warming the cold room with golden light.",
-        "He scribbled down ideas on a napkin while waiting for his coffee to brew.",
-        "The car sped down the highway, headlights cutting through the thick evening fog.",
-        "She carefully folded the letter and placed it back inside the dusty old box.",
-        "The cat stared intently at the moving shadow beneath the couch, ready to pounce.",
-        "He laughed loudly, wiping tears from his eyes after hearing the joke again.",
-        "A leaf drifted slowly to the ground, carried by the gentle autumn breeze.",
-        "They ran through the rain, shoes soaked and clothes clinging to their skin.",
-        "The museum was filled with relics from forgotten times and distant civilizations.",
-        "She listened closely to the whisper of the wind through the open window.",
-        "He opened the book and began reading as the train rolled steadily forward.",
-        "The storm passed, leaving behind puddles, broken branches, and a deep sense of calm.",
-        "The bakery smelled of fresh bread, warm butter, and sweet cinnamon rolls.",
-        "They watched the stars together, lying on the grass and talking about dreams.",
-        "He picked up the guitar and strummed a tune that filled the quiet room.",
-        "The computer screen glowed softly, displaying lines of code scrolling endlessly.",
-        "She held his hand tightly, afraid to let go in the unfamiliar crowd.",
-        "The city lights flickered in the distance as the plane descended through the clouds.",
-        "A dog barked in the distance, breaking the silence of the peaceful evening.",
-        "The boat rocked gently in the harbor, tied securely to the wooden dock.",
-        "The classroom buzzed with excitement as the final bell rang for summer vacation.",
-        "The movie ended, but the characters stayed in her mind long after the credits.",
-        "He took a deep breath and dove into the clear, cold water of the lake.",
-        "She looked up from her book and smiled at the sound of laughter nearby.",
-        "The candle burned slowly, its flame swaying with every breath of air inside the room."
-    };
-
-public:
-    TypingServer(int port) : gameStarted(false), playersFinished(0) {
-        #ifdef _WIN32
-            WSADATA wsaData;
-            if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-                cerr << "WSAStartup failed" << endl;
-                exit(1);
-            }
-        #endif
-
-        // Get the local IP address
-        string localIP = getLocalIPAddress();
-        cout << "Server will bind to IP: " << localIP << endl;
-
-        // Create socket
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket < 0) {
-            cerr << "Error creating socket" << endl;
-            exit(1);
-        }
-
-        // Set socket options
-        int opt = 1;
-        #ifdef _WIN32
-            setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
-        #else
-            setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        #endif
-
-        // Bind to the retrieved IP and port
-        struct sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        inet_pton(AF_INET, localIP.c_str(), &serverAddr.sin_addr);
-        serverAddr.sin_port = htons(port);
-
-        if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-            cerr << "Error binding socket" << endl;
-            exit(1);
-        }
-
-        // Listen for connections
-        if (listen(serverSocket, 5) < 0) {
-            cerr << "Error listening" << endl;
-            exit(1);
-        }
-
-        cout << "Server started on " << localIP << ":" << port << endl;
-        
-        // Select a random text for this game
-        typingText = sampleTexts[rand() % sampleTexts.size()];
-    }
-
-    void acceptConnections() {
-        while (clientSockets.size() < 2) {
-            struct sockaddr_in clientAddr;
-            socklen_t addrLen = sizeof(clientAddr);
-            
-            int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &addrLen);
-            if (clientSocket < 0) {
-                cerr << "Error accepting connection" << endl;
-                continue;
-            }
-
-            char clientIP[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
-            cout << "Client connected from: " << clientIP << endl;
-            
-            clientSockets.push_back(clientSocket);
-            
-            // Initialize player result
-            PlayerResult newPlayer;
-            newPlayer.id = clientSockets.size() - 1;
-            newPlayer.wpm = 0;
-            newPlayer.accuracy = 0;
-            newPlayer.finished = false;
-            
-            resultsMutex.lock();
-            results.push_back(newPlayer);
-            resultsMutex.unlock();
-            
-            // Start a thread to handle this client
-            thread clientThread(&TypingServer::handleClient, this, clientSocket, clientSockets.size() - 1);
-            clientThread.detach();
-        }
-        
-        // Once we have 2 players, start the game
-        startGame();
-    }
-
-    void startGame() {
-        gameStarted = true;
-        cout << "Starting game with 2 players" << endl;
-        
-        // Send the typing text to all clients
-        string startMsg = "START|" + typingText;
-        for (int socket : clientSockets) {
-            send(socket, startMsg.c_str(), startMsg.length(), 0);
-        }
-    }
-
-    void handleClient(int clientSocket, int playerId) {
-        char buffer[1024] = {0};
-        
-        while (true) {
-            memset(buffer, 0, sizeof(buffer));
-            int bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-            
-            if (bytesRead <= 0) {
-                cout << "Client " << playerId << " disconnected" << endl;
-                break;
-            }
-            
-            string message(buffer);
-            
-            // Parse message
-            if (message.substr(0, 7) == "FINISH|") {
-                // Format: FINISH|WPM|ACCURACY
-                size_t pos = message.find("|", 7);
-                double wpm = stod(message.substr(7, pos - 7));
-                double accuracy = stod(message.substr(pos + 1));
-                
-                // Update player results
-                resultsMutex.lock();
-                results[playerId].wpm = wpm;
-                results[playerId].accuracy = accuracy;
-                results[playerId].finished = true;
-                playersFinished++;
-                resultsMutex.unlock();
-                
-                cout << "Player " << playerId << " finished with WPM: " << wpm << ", Accuracy: " << accuracy << "%" << endl;
-                
-                // If all players finished, send results to everyone
-                if (playersFinished == 2) {
-                    sendResults();
-                }
-            }
-        }
-        
-        closeSocket(clientSocket);
-    }
-
-    void sendResults() {
-        string resultsMsg = "RESULTS|";
-        
-        for (const auto& result : results) {
-            resultsMsg += to_string(result.id) + "," + 
-                         to_string(result.wpm) + "," + 
-                         to_string(result.accuracy) + "|";
-        }
-        
-        // Send results to all clients
-        for (int socket : clientSockets) {
-            send(socket, resultsMsg.c_str(), resultsMsg.length(), 0);
-        }
-        
-        cout << "Game finished, results sent to all players" << endl;
-    }
-
-    ~TypingServer() {
-        for (int socket : clientSockets) {
-            closeSocket(socket);
-        }
-        closeSocket(serverSocket);
-        
-        #ifdef _WIN32
-            WSACleanup();
-        #endif
-    }
-};
-
-int main() {
-    srand(static_cast<unsigned int>(time(nullptr)));
-    TypingServer server(8080);
-    server.acceptConnections();
-    
-    cout << "\nPress Ctrl+C to stop the server." << endl;
-    
-    while (true) {
-        #ifdef _WIN32
-            Sleep(10000); // Sleep for 10 seconds (Windows)
-        #else
-            sleep(10); // Sleep for 10 seconds (Unix)
-        #endif
-    }
-    
-    return 0;
-}
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "admin.h"
+#include "analytics.h"
+#include "corpus.h"
+#include "leaderboard.h"
+#include "matchmaking.h"
+#include "metrics.h"
+#include "ratings.h"
+#include "reactor.h"
+#include "replay.h"
+#include "scoring.h"
+
+using namespace std;
+
+// Socket close function
+void closeSocket(int socket) {
+    close(socket);
+}
+
+// One address the server listens on: "::" or "0.0.0.0" for every
+// interface, a literal IPv4 or IPv6 address, optionally with ":port"
+// ("[v6]:port" for IPv6). Literals only, so startup never waits on DNS.
+struct BindAddress {
+    string spec;
+    sockaddr_storage addr;
+    socklen_t addrLen;
+};
+
+bool parseBindAddress(const string& spec, int defaultPort, BindAddress& out) {
+    string host = spec;
+    int port = defaultPort;
+
+    size_t colon = spec.rfind(':');
+    if (!spec.empty() && spec[0] == '[') {
+        size_t close = spec.find(']');
+        if (close == string::npos) return false;
+        host = spec.substr(1, close - 1);
+        if (close + 1 < spec.size()) {
+            if (spec[close + 1] != ':') return false;
+            port = atoi(spec.c_str() + close + 2);
+        }
+    } else if (colon != string::npos && spec.find(':') == colon) {
+        // A single colon separates an IPv4 address from its port; more than
+        // one means a bare IPv6 address
+        host = spec.substr(0, colon);
+        port = atoi(spec.c_str() + colon + 1);
+    }
+    if (port <= 0 || port > 65535) return false;
+
+    out.spec = spec;
+    memset(&out.addr, 0, sizeof(out.addr));
+    sockaddr_in* v4 = reinterpret_cast<sockaddr_in*>(&out.addr);
+    sockaddr_in6* v6 = reinterpret_cast<sockaddr_in6*>(&out.addr);
+    if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        out.addrLen = sizeof(sockaddr_in);
+        return true;
+    }
+    if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        out.addrLen = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+// "1.2.3.4", or "2001:db8::1"; IPv4 clients of a dual-stack listener show
+// as plain IPv4 rather than ::ffff:1.2.3.4
+string formatAddress(const sockaddr_storage& addr) {
+    char text[INET6_ADDRSTRLEN] = "?";
+    if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in&>(addr).sin_addr, text, sizeof(text));
+    } else if (addr.ss_family == AF_INET6) {
+        const in6_addr& v6 = reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&v6)) {
+            inet_ntop(AF_INET, v6.s6_addr + 12, text, sizeof(text));
+        } else {
+            inet_ntop(AF_INET6, &v6, text, sizeof(text));
+        }
+    }
+    return text;
+}
+
+string formatEndpoint(const sockaddr_storage& addr) {
+    int port = addr.ss_family == AF_INET6 ? ntohs(reinterpret_cast<const sockaddr_in6&>(addr).sin6_port)
+                                          : ntohs(reinterpret_cast<const sockaddr_in&>(addr).sin_port);
+    string host = formatAddress(addr);
+    return (addr.ss_family == AF_INET6 && host.find(':') != string::npos ? "[" + host + "]" : host) + ":" +
+           to_string(port);
+}
+
+// Addresses of the interfaces that are up, for telling players where to
+// connect when listening on a wildcard. Read from the kernel, no traffic.
+vector<string> localInterfaceAddresses() {
+    vector<string> found;
+    ifaddrs* list = nullptr;
+    if (getifaddrs(&list) != 0) return found;
+    for (ifaddrs* entry = list; entry; entry = entry->ifa_next) {
+        if (!entry->ifa_addr || !(entry->ifa_flags & IFF_UP) || (entry->ifa_flags & IFF_LOOPBACK)) continue;
+        int family = entry->ifa_addr->sa_family;
+        if (family != AF_INET && family != AF_INET6) continue;
+        sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, entry->ifa_addr, family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+        if (family == AF_INET6 && IN6_IS_ADDR_LINKLOCAL(&reinterpret_cast<sockaddr_in6&>(addr).sin6_addr)) continue;
+        found.push_back(formatAddress(addr));
+    }
+    freeifaddrs(list);
+    return found;
+}
+
+// Kernel send buffer for a spectator's socket. Kept small so a slow
+// spectator falls behind in our queue, where old snapshots are dropped,
+// rather than in the kernel, where every one of them waits its turn.
+const int SPECTATOR_SEND_BUFFER = 32 * 1024;
+
+// TCP keepalive on client sockets: probe after a minute of silence, every
+// ten seconds, and give up after six unanswered probes. Catches peers that
+// vanished without a FIN while their connection has no deadline of its own,
+// such as a player waiting for a room to fill.
+const int KEEPALIVE_IDLE_SECONDS = 60;
+const int KEEPALIVE_INTERVAL_SECONDS = 10;
+const int KEEPALIVE_PROBES = 6;
+
+// Passage segments one KEYLOG frame may settle on its network loop. A frame
+// fits the inbound buffer and a keystroke takes at least two bytes, so this
+// keeps up with any log; what a frame leaves over is settled by the scoring
+// pool at FINISH, and no frame holds the loop for more than a few segments.
+const size_t KEYLOG_SEGMENTS_PER_FRAME = SERVER_INBOUND_BUFFER / 2 / KEYLOG_SCORE_SEGMENT;
+
+// Served when no corpus file is given
+const char* const builtinPassages[] = {
+    "The quick brown fox jumped over a sleepy dog lying in the golden sunlight.",
+    "She walked quietly through the forest, listening to birds chirping and leaves rustling overhead.",
+    "Time passed slowly as the storm raged outside the small wooden cabin in the hills.",
+    "He typed rapidly, his fingers dancing across the keyboard like a pianist in a concert.",
+    "They packed their bags and left for the mountains before the sun could rise.",
+    "The stars shimmered brightly in the night sky, illuminating the path through the trees.",
+    "A good book can transport you to magical places beyond your wildest imagination.",
+    "The coffee shop buzzed with life, full of laughter, conversation, and the smell of espresso.",
+    "She smiled at the child playing with a red balloon on the busy street corner.",
+    "Learning new skills requires patience, practice, and the willingness to make many small mistakes.",
+    "The train arrived late, screeching to a stop at the nearly empty platform.",
+    "His heart pounded as he stood in front of the crowd, preparing to speak.",
+    "The lighthouse stood tall, casting light across the choppy sea during the stormy night.",
+    "A rainbow stretched across the sky after the heavy afternoon rain had finally passed.",
+    "She tied her shoes tightly and began her morning run through the quiet neighborhood.",
+    "He watched the sunset paint the clouds orange, pink, and purple above the ocean.",
+    "The wind blew strongly, carrying the scent of rain and freshly cut grass.",
+    "The old clock ticked loudly in the room, counting the seconds in perfect rhythm.",
+    "She opened the envelope slowly, hands trembling with anticipation and a hint of fear.",
+    "Their footsteps echoed through the vast, empty hall of the ancient abandoned building.",
+    "The little girl clutched her teddy bear tightly as the thunder rolled outside.",
+    "He found peace in the silence of early mornings before the world woke up.",
+    "A paper airplane soared across the room and landed perfectly on the teacher's desk.",
+    "The streetlamp flickered, casting shadows that danced across the pavement and nearby brick walls.",
+    "Her voice trembled slightly as she read the poem aloud to her classmates.",
+    "The fire crackled gently in the fireplace, warming the cold room with golden light.",
+    "He scribbled down ideas on a napkin while waiting for his coffee to brew.",
+    "The car sped down the highway, headlights cutting through the thick evening fog.",
+    "She carefully folded the letter and placed it back inside the dusty old box.",
+    "The cat stared intently at the moving shadow beneath the couch, ready to pounce.",
+    "He laughed loudly, wiping tears from his eyes after hearing the joke again.",
+    "A leaf drifted slowly to the ground, carried by the gentle autumn breeze.",
+    "They ran through the rain, shoes soaked and clothes clinging to their skin.",
+    "The museum was filled with relics from forgotten times and distant civilizations.",
+    "She listened closely to the whisper of the wind through the open window.",
+    "He opened the book and began reading as the train rolled steadily forward.",
+    "The storm passed, leaving behind puddles, broken branches, and a deep sense of calm.",
+    "The bakery smelled of fresh bread, warm butter, and sweet cinnamon rolls.",
+    "They watched the stars together, lying on the grass and talking about dreams.",
+    "He picked up the guitar and strummed a tune that filled the quiet room.",
+    "The computer screen glowed softly, displaying lines of code scrolling endlessly.",
+    "She held his hand tightly, afraid to let go in the unfamiliar crowd.",
+    "The city lights flickered in the distance as the plane descended through the clouds.",
+    "A dog barked in the distance, breaking the silence of the peaceful evening.",
+    "The boat rocked gently in the harbor, tied securely to the wooden dock.",
+    "The classroom buzzed with excitement as the final bell rang for summer vacation.",
+    "The movie ended, but the characters stayed in her mind long after the credits.",
+    "He took a deep breath and dove into the clear, cold water of the lake.",
+    "She looked up from her book and smiled at the sound of laughter nearby.",
+    "The candle burned slowly, its flame swaying with every breath of air inside the room."
+};
+
+// Game state
+enum ResultState : uint8_t {
+    RESULT_EMPTY,
+    RESULT_WRITING,
+    RESULT_SET
+};
+
+// One player's final result. Written exactly once, by whichever thread
+// claims it first: the room's loop for a forfeit, or a scoring worker for a
+// scored keystroke log. The log and timing are only kept when races are
+// recorded.
+struct ResultCell {
+    atomic<uint8_t> state{RESULT_EMPTY};
+    double wpm = 0;
+    double accuracy = 0;
+    bool forfeit = false;
+    uint32_t endMs = 0;              // START to FINISH or forfeit
+    uint32_t keystrokes = 0;
+    string keyLog;
+    vector<uint32_t> wordErrors;     // for the analytics export, when known
+};
+
+// One independent race. A room lives on a single worker loop together with
+// its players' sockets, so only that loop's thread touches it, except for
+// the result cells and the unsettled countdown, which scoring workers settle
+// directly (see settleResult).
+struct Room {
+    uint64_t id;
+    shared_ptr<const Corpus> corpus;  // keeps typingText mapped, also for scoring jobs
+    string_view typingText;
+    uint64_t passageId;              // replayTextId of the text, for the leaderboard
+    vector<uint64_t> players;        // connection id per player slot, 0 once gone
+    vector<string> names;            // per slot, empty for unrated players
+    unique_ptr<ResultCell[]> results;  // one per slot
+    atomic<int> unsettled;           // slots still without a result
+    Room* nextCompleted;             // link in the shard's completed list
+    vector<ProgressEntry> progress;  // latest report per player, merged each tick
+    vector<uint32_t> lastReportMs;   // drops reports that arrive out of order
+    vector<KeyLogScorer> scorers;    // score each player's log as it arrives
+    vector<string> keyLogs;          // uploaded keystroke logs, kept only when races are recorded
+    vector<uint32_t> textSent;       // passage bytes each player has been sent
+    vector<bool> scoring;            // log handed to the scoring pool
+    chrono::steady_clock::time_point openedAt;
+    chrono::steady_clock::time_point startedAt;
+    uint64_t startedAtUnixMs;        // wall clock, for the replay
+    chrono::steady_clock::time_point lastFinishAt;   // latest FINISH frame, for the fan-out histogram
+    uint32_t snapshotTick;
+    bool progressDirty;
+    int playersJoined;
+    bool gameStarted;
+    Timer countdownTimer;            // fires START once the room is full
+    Timer raceTimer;                 // forfeits whoever has not finished in time
+    vector<int> watchers;            // loops with spectators of this room
+    FrameRef spectatorStart;         // START as spectators see it, once the game is on
+};
+
+// Room news a loop passes to the spectators it hosts
+enum SpectatorEventType : uint8_t {
+    SPECTATE_START,      // the race began; sent to every spectator
+    SPECTATE_SNAPSHOT,   // progress; a spectator behind on writes skips to the newest
+    SPECTATE_RESULTS,    // the race is over
+    SPECTATE_GONE        // the room closed or never existed
+};
+
+struct SpectatorEvent {
+    uint64_t roomId;
+    SpectatorEventType type;
+    FrameRef frame;
+    shared_ptr<const Corpus> corpus;   // with START: keeps text mapped
+    string_view text;                  // with START: the passage
+};
+
+// One spectator of a room
+struct Spectator {
+    FrameRef waiting;                // the newest snapshot, while its socket is busy
+    uint32_t textSent = 0;           // passage bytes sent, 0 until START
+};
+
+// One loop's spectators of one room. Every frame reaches them as a shared
+// reference; a spectator whose socket is still busy keeps only the newest
+// snapshot until it drains, so a slow reader costs a bounded queue. Past
+// START's window the passage follows a piece at a time, each time a
+// spectator's socket drains, so none ever has more than a piece queued.
+struct SpectatorGroup {
+    unordered_map<uint64_t, Spectator> spectators;   // by connection id
+    FrameRef start;                  // for spectators who join mid-race
+    FrameRef latest;
+    shared_ptr<const Corpus> corpus;
+    string_view text;                // the passage, once START came
+};
+
+// A worker loop and the rooms it hosts
+struct Shard {
+    unique_ptr<EventLoop> loop;
+    unordered_map<uint64_t, unique_ptr<Room>> rooms;
+    vector<uint64_t> dirtyRooms;     // rooms with progress to broadcast next tick
+    vector<ResultEntry> resultEntries;   // reused for every RESULTS this shard encodes
+    deque<ScoreJob> pendingScores;   // jobs the scoring queue had no room for yet
+    atomic<Room*> completed{nullptr};  // rooms settled by a scoring worker, pushed lock-free
+    vector<int> listenFds;           // this loop's SO_REUSEPORT listener for each bind address
+    unique_ptr<MatchQueue> queue;    // players on this loop waiting for a room
+    vector<MatchTicket> matched;     // reused for every group the queue makes
+    uint64_t nextRoomSeq = 0;        // room ids are seq * shard count + shard index + 1
+
+    unordered_map<uint64_t, SpectatorGroup> watching;   // room id -> this loop's spectators of it
+    mutex spectatorMutex;
+    vector<SpectatorEvent> spectatorInbox;   // from the loops hosting the watched rooms
+    vector<SpectatorEvent> spectatorBatch;   // inbox being delivered, swapped to keep both allocations
+};
+
+// Everything the command line or a config file can set
+struct ServerConfig {
+    vector<string> bindAddresses;   // empty for "::", every interface over IPv4 and IPv6
+    int port = 8080;                // for bind addresses without their own
+    int workers = 1;
+    int scorers = 0;                // 0 for one per two workers
+    int roomSize = 2;
+    int tickMs = 50;
+    int backlog = 1024;       // per listener; the kernel caps it at net.core.somaxconn
+    int gatherMs = 250;       // how long a player waits for a match on its shard before moving to shard 0
+    double matchBand = 10;    // rating points a new player's opponents may differ by
+    double matchWiden = 10;   // rating points the band widens by per second of waiting
+    bool pinCpus = true;
+    int adminPort = 9090;
+    string corpusPath;
+    PassageFilter filter;
+    string replayDir;         // record every race there, empty for no recording
+    int replaySegmentMb = 64;   // start a new segment file past this size
+    string analyticsDir;      // export every result there for the stats tool, empty for none
+    int analyticsFileMb = 256;   // start a new analytics file past this size
+    string leaderboardDir;    // keep the result log and snapshots there, empty for memory only
+    int snapshotEvery = 100000;   // results between leaderboard snapshots
+    int countdownMs = 3000;   // from a room filling up to START
+    int raceSeconds = 300;    // time limit per race, 0 for none
+    int afkSeconds = 120;     // a racer silent this long forfeits, 0 for never
+    int idleSeconds = 30;     // to send HELLO or SPECTATE, and to leave after RESULTS; 0 for no limit
+};
+
+class TypingServer : public EventLoop::Handler {
+private:
+    int roomSize;
+    int tickMs;
+    int gatherMs;
+    int countdownMs;
+    chrono::milliseconds raceLimit;
+    chrono::milliseconds afkTimeout;
+    chrono::milliseconds idleTimeout;
+    atomic<uint64_t> latestStartedRoom{0};   // what SPECTATE 0 watches
+    vector<unique_ptr<Shard>> shards;   // one worker per core, each owns its sockets and rooms
+    unique_ptr<ScoringPool> scoring;    // replays keystroke logs off the network threads
+    unique_ptr<ReplayRecorder> recorder;   // null unless races are recorded
+    unique_ptr<AnalyticsWriter> analytics;   // null unless results are exported
+    RatingStore ratings;                // per player name, shared by all loops
+    unique_ptr<ResultLog> results;      // every scored result, and the leaderboard over them
+    string corpusPath;                  // empty when serving the built-in passages
+    PassageFilter filter;
+    shared_ptr<const PassagePicker> picker;   // swapped whole on reload
+    int signalFd;                       // signalfd for SIGHUP, SIGINT and SIGTERM
+    unique_ptr<AdminServer> admin;      // metrics over HTTP, on loopback
+
+public:
+    explicit TypingServer(const ServerConfig& config)
+        : roomSize(config.roomSize), tickMs(config.tickMs), gatherMs(config.gatherMs),
+          countdownMs(config.countdownMs), raceLimit(chrono::seconds(config.raceSeconds)),
+          afkTimeout(chrono::seconds(config.afkSeconds)), idleTimeout(chrono::seconds(config.idleSeconds)),
+          corpusPath(config.corpusPath), filter(config.filter) {
+        int workers = config.workers;
+        int scorers = config.scorers > 0 ? config.scorers : max(1, workers / 2);
+        int backlog = config.backlog;
+        int adminPort = config.adminPort;
+
+        // SIGHUP reloads the corpus; SIGINT and SIGTERM stop the server. They
+        // are blocked here, before the replay, analytics and result log
+        // writers or any loop start and inherit the mask, so they only ever
+        // arrive through the main thread's signalfd.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGHUP);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signalFd < 0) {
+            cerr << "Error creating signalfd" << endl;
+            exit(1);
+        }
+
+        vector<BindAddress> binds = resolveBindAddresses(config);
+
+        string error;
+        picker = loadPassages(error);
+        if (!picker) {
+            cerr << error << endl;
+            exit(1);
+        }
+
+        // Up to a minute or so of races may wait for the disk before any
+        // are dropped
+        if (!config.replayDir.empty()) {
+            recorder.reset(new ReplayRecorder(config.replayDir, static_cast<size_t>(config.replaySegmentMb) << 20,
+                                              64u << 20));
+            if (!recorder->start(error)) {
+                cerr << "Cannot record replays: " << error << endl;
+                exit(1);
+            }
+            cout << "Recording replays to " << config.replayDir << endl;
+        }
+        if (!config.analyticsDir.empty()) {
+            analytics.reset(new AnalyticsWriter(config.analyticsDir, static_cast<size_t>(config.analyticsFileMb) << 20,
+                                                1u << 20));
+            if (!analytics->start(error)) {
+                cerr << "Cannot export analytics: " << error << endl;
+                exit(1);
+            }
+            cout << "Exporting results to " << config.analyticsDir << endl;
+        }
+        // The leaderboard holds its last snapshot plus the log after it
+        auto recovering = chrono::steady_clock::now();
+        results.reset(new ResultLog(config.leaderboardDir, config.snapshotEvery, 1u << 20));
+        if (!results->start(error)) {
+            cerr << "Cannot keep the leaderboard: " << error << endl;
+            exit(1);
+        }
+        if (!config.leaderboardDir.empty()) {
+            cout << "Leaderboard in " << config.leaderboardDir << ": " << results->playersFromSnapshot()
+                 << " players from the snapshot and " << results->resultsFromLog() << " results from the log in "
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - recovering).count() << " ms"
+                 << endl;
+        }
+        cout << "Serving " << picker->size() << " of " << picker->corpus()->size() << " passages from "
+             << picker->corpus()->source() << endl;
+
+
+        // Start the worker loops that own all client sockets. Each has its own
+        // SO_REUSEPORT listener per bind address, so the kernel spreads new
+        // connections over the loops and every loop accepts, seats and serves
+        // its own players.
+        bool anyIPv4 = false;
+        for (const BindAddress& bind : binds) anyIPv4 |= bind.addr.ss_family == AF_INET;
+        int cpus = max(1u, thread::hardware_concurrency());
+        for (int i = 0; i < workers; i++) {
+            shards.emplace_back(new Shard());
+            Shard* shard = shards.back().get();
+            shard->loop.reset(new EventLoop(i, this));
+            shard->queue.reset(new MatchQueue(roomSize, config.matchBand, config.matchWiden));
+            for (const BindAddress& bind : binds) {
+                int fd = openListener(bind, backlog, anyIPv4);
+                shard->listenFds.push_back(fd);
+                shard->loop->addListener(fd, [this, shard](int fd, const sockaddr_storage& addr) {
+                    acceptClient(*shard, fd, addr);
+                });
+            }
+            shard->loop->setTick(tickMs, [this, shard]() { onTick(*shard); });
+            shard->loop->setWakeHandler([this, shard]() {
+                drainCompleted(*shard);
+                deliverSpectatorEvents(*shard);
+            });
+            if (config.pinCpus) shard->loop->pinToCpu(i % cpus);
+        }
+
+        // Workers write scores straight into the room's result cells; only the
+        // one that settles a room's last slot hands the room back to its loop
+        scoring.reset(new ScoringPool(scorers, 4096, [this](ScoreJob& job) {
+            Room* room = static_cast<Room*>(job.room);
+            // A log that does not decode scores nothing; it forfeits like a
+            // disconnect, so it reaches neither the ratings nor the leaderboard
+            bool forfeit = !job.score.valid;
+            if (forfeit) {
+                cout << "Room " << job.roomId << ": player " << job.playerId
+                     << " sent a corrupt keystroke log and forfeits" << endl;
+            } else {
+                cout << "Room " << job.roomId << ": player " << job.playerId << " finished with WPM: " << job.score.wpm
+                     << ", Accuracy: " << job.score.accuracy << "%" << endl;
+            }
+            if (settleResult(*room, job.playerId, forfeit ? 0 : job.score.wpm, forfeit ? 0 : job.score.accuracy,
+                             forfeit, job.elapsedMs, job.score.keystrokes, recorder ? &job.keyLog : nullptr,
+                             &job.wordErrors)) {
+                publishCompleted(*shards[job.shard], room);
+            }
+        }));
+
+        for (auto& shard : shards) {
+            shard->loop->start();
+        }
+
+        if (adminPort > 0) {
+            admin.reset(new AdminServer("127.0.0.1", adminPort));
+            admin->route("/metrics", "text/plain; version=0.0.4", renderMetrics);
+            admin->route("/leaderboard", "text/plain", [this](const string& query) { return renderTop(query); });
+            admin->route("/rank", "text/plain", [this](const string& query) { return renderRank(query); });
+            admin->start();
+            cout << "Metrics at http://127.0.0.1:" << adminPort << "/metrics" << endl;
+        }
+
+        cout << "Server started on";
+        for (const BindAddress& bind : binds) cout << " " << formatEndpoint(bind.addr);
+        cout << " with " << workers << " worker threads (one listener each per address, backlog " << backlog
+             << "), " << scorers << " scoring threads, " << roomSize << " players per room" << endl;
+
+        bool wildcard = false;
+        for (const BindAddress& bind : binds) {
+            const sockaddr_in6& v6 = reinterpret_cast<const sockaddr_in6&>(bind.addr);
+            const sockaddr_in& v4 = reinterpret_cast<const sockaddr_in&>(bind.addr);
+            wildcard |= bind.addr.ss_family == AF_INET6 ? IN6_IS_ADDR_UNSPECIFIED(&v6.sin6_addr)
+                                                        : v4.sin_addr.s_addr == htonl(INADDR_ANY);
+        }
+        if (wildcard) {
+            vector<string> local = localInterfaceAddresses();
+            if (!local.empty()) {
+                cout << "Players can connect to:";
+                for (const string& address : local) cout << " " << address;
+                cout << endl;
+            }
+        }
+    }
+
+    // The configured bind addresses, or "::" (falling back to "0.0.0.0" on
+    // hosts without IPv6) when none are given
+    static vector<BindAddress> resolveBindAddresses(const ServerConfig& config) {
+        vector<string> specs = config.bindAddresses;
+        if (specs.empty()) {
+            int probe = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            specs.push_back(probe >= 0 ? "::" : "0.0.0.0");
+            if (probe >= 0) closeSocket(probe);
+        }
+
+        vector<BindAddress> binds;
+        for (const string& spec : specs) {
+            BindAddress bind;
+            if (!parseBindAddress(spec, config.port, bind)) {
+                cerr << "Invalid bind address: " << spec << endl;
+                exit(1);
+            }
+            binds.push_back(bind);
+        }
+        return binds;
+    }
+
+    // The corpus file, or the built-in passages without one, with the
+    // server's filter applied
+    shared_ptr<const PassagePicker> loadPassages(string& error) {
+        shared_ptr<const Corpus> corpus;
+        if (corpusPath.empty()) {
+            CorpusBuilder builder;
+            for (const char* text : builtinPassages) {
+                builder.add(text, estimateDifficulty(text), languageCode("en"));
+            }
+            corpus = Corpus::fromBytes(builder.build(), "built-in passages", error);
+        } else {
+            corpus = Corpus::open(corpusPath, error);
+        }
+        if (!corpus) return nullptr;
+
+        auto next = make_shared<const PassagePicker>(corpus, filter);
+        if (next->empty()) {
+            error = corpus->source() + ": no passages match the difficulty, length and language filter";
+            return nullptr;
+        }
+        return next;
+    }
+
+    // Swap in a freshly mapped corpus. Rooms already running keep the old
+    // one alive until they finish.
+    void reloadCorpus() {
+        string error;
+        shared_ptr<const PassagePicker> next = loadPassages(error);
+        if (!next) {
+            cerr << "Corpus reload failed, keeping the current one: " << error << endl;
+            return;
+        }
+        atomic_store(&picker, next);
+        cout << "Reloaded " << next->size() << " of " << next->corpus()->size() << " passages from "
+             << next->corpus()->source() << endl;
+    }
+
+    // One of the SO_REUSEPORT sockets that share a bind address. The IPv6
+    // wildcard also takes IPv4 unless an IPv4 address is bound separately.
+    int openListener(const BindAddress& bind, int backlog, bool separateIPv4) {
+        int family = bind.addr.ss_family;
+        int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            cerr << "Error creating socket for " << bind.spec << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+
+        // Set socket options
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            cerr << "Error enabling SO_REUSEPORT" << endl;
+            exit(1);
+        }
+        if (family == AF_INET6) {
+            const in6_addr& address = reinterpret_cast<const sockaddr_in6&>(bind.addr).sin6_addr;
+            int v6Only = IN6_IS_ADDR_UNSPECIFIED(&address) && !separateIPv4 ? 0 : 1;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+        }
+
+        if (::bind(fd, reinterpret_cast<const sockaddr*>(&bind.addr), bind.addrLen) < 0) {
+            cerr << "Error binding " << formatEndpoint(bind.addr) << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+
+        // Listen for connections
+        if (listen(fd, backlog) < 0) {
+            cerr << "Error listening on " << formatEndpoint(bind.addr) << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+        return fd;
+    }
+
+    // Main thread: the loops do all the accepting, so this only waits for
+    // SIGHUP to reload the corpus. Returns on SIGINT or SIGTERM, leaving the
+    // destructor to stop the loops and drain the writers.
+    void run() {
+        struct pollfd fd = {signalFd, POLLIN, 0};
+        while (true) {
+            if (poll(&fd, 1, -1) <= 0) continue;
+            struct signalfd_siginfo info;
+            bool reload = false;
+            while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+                    cout << "Shutting down" << endl;
+                    return;
+                }
+                reload = true;
+            }
+            if (reload) reloadCorpus();
+        }
+    }
+
+    // Loop thread: a new connection on this loop's listener. It is seated
+    // or starts watching once its first frame says which, and has the idle
+    // timeout to send it.
+    void acceptClient(Shard& shard, int fd, const sockaddr_storage& addr) {
+        cout << "Client connected from: " << formatAddress(addr) << endl;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &KEEPALIVE_IDLE_SECONDS, sizeof(KEEPALIVE_IDLE_SECONDS));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &KEEPALIVE_INTERVAL_SECONDS, sizeof(KEEPALIVE_INTERVAL_SECONDS));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &KEEPALIVE_PROBES, sizeof(KEEPALIVE_PROBES));
+
+        Connection* conn = shard.loop->attach(fd, shard.loop->newConnectionId());
+        if (conn) shard.loop->setIdleTimeout(*conn, idleTimeout);
+    }
+
+    // Loop thread: the first frame on a connection
+    void handshake(Shard& shard, Connection& conn, const Frame& frame) {
+        uint64_t roomId;
+        string name;
+        if (frame.type == MSG_HELLO && parseHello(frame.payload, name)) {
+            // Waiting for a match is not idling; keepalive covers it
+            conn.role = ROLE_PLAYER;
+            shard.loop->setIdleTimeout(conn, chrono::milliseconds(0));
+            double rating = name.empty() ? DEFAULT_RATING : ratings.get(name).rating;
+            enqueuePlayer(shard, MatchTicket{conn.id, rating, chrono::steady_clock::now(), move(name)});
+        } else if (frame.type == MSG_SPECTATE && parseSpectate(frame.payload, roomId)) {
+            watchRoom(shard, conn, roomId);
+        } else {
+            rejectFrame(conn, ERR_HANDSHAKE);
+        }
+    }
+
+    // Loop thread: queue a player for a match and seat a room right away if
+    // enough players of similar rating are waiting on this loop. moved: the
+    // player waited on another loop first.
+    void enqueuePlayer(Shard& shard, MatchTicket ticket, bool moved = false) {
+        uint64_t connId = ticket.connId;
+        shard.queue->add(move(ticket), moved);
+        countMetric(PLAYERS_QUEUED);
+        if (shard.queue->matchFor(connId, chrono::steady_clock::now(), shard.matched)) {
+            seatGroup(shard, shard.matched);
+        }
+    }
+
+    // Loop thread: open a room with a random text for a group the queue
+    // made. The group fills it at once, so it goes straight to the countdown.
+    void seatGroup(Shard& shard, const vector<MatchTicket>& group) {
+        shared_ptr<const PassagePicker> current = atomic_load(&picker);
+        uint64_t roomId = shard.nextRoomSeq++ * shards.size() + shard.loop->getIndex() + 1;
+        Room* room = openRoom(shard, roomId, current->corpus(), current->pick());
+        for (const MatchTicket& ticket : group) room->openedAt = min(room->openedAt, ticket.since);
+        countMetric(PLAYERS_DEQUEUED, group.size());
+
+        for (int playerId = 0; playerId < static_cast<int>(group.size()); playerId++) {
+            const MatchTicket& ticket = group[playerId];
+            Connection* conn = shard.loop->find(ticket.connId);
+            if (conn) {
+                conn->roomId = room->id;
+                conn->playerId = playerId;
+            }
+            room->names[playerId] = ticket.name;
+            // A player gone before the start forfeits then
+            joinRoom(shard, *room, playerId, conn ? ticket.connId : 0);
+        }
+    }
+
+    // Tick: bands have widened since the last tick, so try again for
+    // everyone still waiting. On every shard but the first, players who found
+    // no match in time then move to shard 0, so players spread over
+    // different listeners still meet.
+    void matchWaiting(Shard& shard) {
+        MatchQueue& queue = *shard.queue;
+        if (queue.size() == 0) return;
+        auto now = chrono::steady_clock::now();
+        queue.matchWaiting(now, shard.matched, [&](const vector<MatchTicket>& group) { seatGroup(shard, group); });
+
+        Shard* target = shards[0].get();
+        if (&shard == target) return;
+        const MatchTicket* oldest;
+        while ((oldest = queue.oldest()) && now - oldest->since >= chrono::milliseconds(gatherMs)) {
+            MatchTicket ticket;
+            queue.remove(oldest->connId, &ticket);
+            countMetric(PLAYERS_DEQUEUED);
+            Connection* conn = shard.loop->find(ticket.connId);
+            unique_ptr<Connection> detached = conn ? shard.loop->detach(*conn) : nullptr;
+            if (!detached) continue;
+
+            // The raw pointer is owned by the task until adopt() takes it back
+            Connection* moving = detached.release();
+            target->loop->post([this, target, moving, ticket]() mutable {
+                Connection* adopted = target->loop->adopt(unique_ptr<Connection>(moving));
+                if (adopted) enqueuePlayer(*target, move(ticket), true);
+            });
+        }
+    }
+
+    // Loop thread: create an empty room
+    Room* openRoom(Shard& shard, uint64_t roomId, const shared_ptr<const Corpus>& corpus, size_t textIndex) {
+        unique_ptr<Room>& slot = shard.rooms[roomId];
+        slot.reset(new Room());
+        slot->id = roomId;
+        slot->corpus = corpus;
+        slot->typingText = corpus->passage(textIndex).text;
+        slot->passageId = replayTextId(slot->typingText);
+        slot->players.assign(roomSize, 0);
+        slot->names.assign(roomSize, string());
+        slot->results.reset(new ResultCell[roomSize]);
+        slot->unsettled.store(roomSize, memory_order_relaxed);
+        slot->nextCompleted = nullptr;
+        slot->progress.resize(roomSize);
+        slot->lastReportMs.assign(roomSize, 0);
+        slot->scorers.assign(roomSize, KeyLogScorer(slot->typingText));
+        slot->keyLogs.resize(roomSize);
+        slot->textSent.assign(roomSize, 0);
+        slot->scoring.assign(roomSize, false);
+        slot->snapshotTick = 0;
+        slot->progressDirty = false;
+        slot->playersJoined = 0;
+        slot->gameStarted = false;
+        Room* room = slot.get();
+        slot->countdownTimer.callback = [this, room]() { startGame(roomShard(room->id), *room); };
+        slot->raceTimer.callback = [this, room]() { endRace(roomShard(room->id), *room); };
+        slot->openedAt = chrono::steady_clock::now();
+        countMetric(ROOMS_OPENED);
+        return slot.get();
+    }
+
+    // Loop thread: add a player to a room
+    void joinRoom(Shard& shard, Room& room, int playerId, uint64_t connId) {
+        room.players[playerId] = connId;
+
+        ProgressEntry& progress = room.progress[playerId];
+        progress.playerId = playerId;
+        progress.flags = 0;
+        progress.cursor = 0;
+        progress.errors = 0;
+
+        // Once the room is full, count down to the start
+        if (++room.playersJoined == roomSize) {
+            beginCountdown(shard, room);
+        }
+    }
+
+    Room* findRoom(Shard& shard, uint64_t roomId) {
+        auto it = shard.rooms.find(roomId);
+        return it == shard.rooms.end() ? nullptr : it->second.get();
+    }
+
+    // The shard hosting a room, from the shard index in its id
+    Shard& roomShard(uint64_t roomId) {
+        return *shards[(roomId - 1) % shards.size()];
+    }
+
+    // Send a message to every player still connected to the room. Each
+    // player's queue takes a reference to the one encoded frame.
+    void broadcast(Shard& shard, const Room& room, const FrameRef& message) {
+        for (uint64_t connId : room.players) {
+            Connection* conn = connId ? shard.loop->find(connId) : nullptr;
+            if (conn) {
+                shard.loop->send(*conn, message);
+            }
+        }
+    }
+
+    // Loop thread: tell a full room's players when the race starts and
+    // start it then, on the loop's timer wheel
+    void beginCountdown(Shard& shard, Room& room) {
+        recordLatency(ROOM_FILL, chrono::steady_clock::now() - room.openedAt);
+        if (countdownMs <= 0) {
+            startGame(shard, room);
+            return;
+        }
+        FrameRef countdown = FrameRef::acquire();
+        encodeCountdown(countdown.bytes(), countdownMs, chrono::duration_cast<chrono::milliseconds>(raceLimit).count());
+        broadcast(shard, room, countdown);
+        shard.loop->timers().schedule(room.countdownTimer, chrono::milliseconds(countdownMs));
+    }
+
+    void startGame(Shard& shard, Room& room) {
+        room.gameStarted = true;
+        room.startedAt = chrono::steady_clock::now();
+        room.startedAtUnixMs = unixMillis();
+        cout << "Room " << room.id << ": starting game with " << roomSize << " players" << endl;
+        latestStartedRoom.store(room.id, memory_order_relaxed);
+        
+        // Send the first window of the text to all clients. Only the player
+        // id differs, so each gets its own short header followed by the
+        // room's one copy of the window; the rest follows as they type.
+        string_view window = room.typingText.substr(0, TEXT_WINDOW);
+        FrameRef parts[2];
+        parts[1] = FrameRef::copyOf(window.data(), window.size());
+        for (int i = 0; i < roomSize; i++) {
+            Connection* conn = room.players[i] ? shard.loop->find(room.players[i]) : nullptr;
+            if (conn) {
+                parts[0] = FrameRef::acquire();
+                encodeStartHeader(parts[0].bytes(), room.id, i, roomSize, room.typingText.size(), window.size());
+                room.textSent[i] = window.size();
+                shard.loop->send(*conn, parts, 2);
+                shard.loop->setIdleTimeout(*conn, afkTimeout);
+            }
+        }
+        if (!room.watchers.empty()) {
+            publishToWatchers(room, SPECTATE_START, spectatorStart(room));
+        }
+        if (raceLimit.count() > 0) shard.loop->timers().schedule(room.raceTimer, raceLimit);
+
+        // Anyone who left while the room was filling forfeits
+        for (int i = 0; i < roomSize; i++) {
+            if (room.players[i] == 0 && finishPlayer(shard, room, i, 0, 0)) {
+                return;
+            }
+        }
+    }
+
+    // Any thread. Writes a slot's result unless it already has one, taking
+    // the keystroke log for the replay and the per-word errors for the
+    // analytics export if they are given. Returns true for
+    // exactly one caller per room, the one that settled its last slot; that
+    // caller owns publishing the results.
+    static bool settleResult(Room& room, int playerId, double wpm, double accuracy, bool forfeit,
+                             uint32_t endMs, uint32_t keystrokes, string* keyLog, vector<uint32_t>* wordErrors) {
+        ResultCell& cell = room.results[playerId];
+        uint8_t expected = RESULT_EMPTY;
+        if (!cell.state.compare_exchange_strong(expected, RESULT_WRITING, memory_order_relaxed)) return false;
+        cell.wpm = wpm;
+        cell.accuracy = accuracy;
+        cell.forfeit = forfeit;
+        cell.endMs = endMs;
+        cell.keystrokes = keystrokes;
+        if (keyLog) cell.keyLog = move(*keyLog);
+        if (wordErrors) cell.wordErrors = move(*wordErrors);
+        cell.state.store(RESULT_SET, memory_order_release);
+
+        // acq_rel chains every slot's writes through to the last decrement
+        return room.unsettled.fetch_sub(1, memory_order_acq_rel) == 1;
+    }
+
+    // Scoring worker: hand a settled room back to its loop without a lock
+    void publishCompleted(Shard& shard, Room* room) {
+        Room* head = shard.completed.load(memory_order_relaxed);
+        do {
+            room->nextCompleted = head;
+        } while (!shard.completed.compare_exchange_weak(head, room, memory_order_release, memory_order_relaxed));
+        shard.loop->notify();
+    }
+
+    // Loop thread, on every wakeup: finish the rooms workers settled
+    void drainCompleted(Shard& shard) {
+        Room* room = shard.completed.exchange(nullptr, memory_order_acquire);
+        while (room) {
+            Room* next = room->nextCompleted;
+            completeRoom(shard, *room);
+            room = next;
+        }
+    }
+
+    // Loop thread: every slot has a result, so send them, fold them into
+    // the players' ratings and free the room
+    void completeRoom(Shard& shard, Room& room) {
+        sendResults(shard, room);
+        uint64_t finishedAtMs = unixMillis();
+        for (int i = 0; i < roomSize; i++) {
+            const ResultCell& result = room.results[i];
+            if (result.forfeit) continue;
+            if (!room.names[i].empty()) ratings.record(room.names[i], result.wpm, result.accuracy);
+            results->trySubmit(ResultRecord{finishedAtMs, room.id, room.passageId, toHundredths(result.wpm),
+                                            toHundredths(result.accuracy), room.names[i]});
+        }
+        if (analytics) exportRace(room, finishedAtMs);
+        if (recorder) recordRace(room);
+        shard.rooms.erase(room.id);
+        countMetric(ROOMS_CLOSED);
+    }
+
+    // Loop thread: settle a player without scoring, as a forfeit. Returns true
+    // if that completed the room, in which case the room has been torn down
+    // and must not be used again.
+    bool finishPlayer(Shard& shard, Room& room, int playerId, double wpm, double accuracy) {
+        // What a forfeiting player typed so far goes into the replay
+        string keyLog = move(room.keyLogs[playerId]);
+        room.keyLogs[playerId] = string();
+        room.progress[playerId].flags |= PROGRESS_FINISHED;
+        markProgress(shard, room);
+
+        uint32_t endMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - room.startedAt).count();
+        if (!settleResult(room, playerId, wpm, accuracy, true, endMs, 0, recorder ? &keyLog : nullptr, nullptr)) {
+            return false;
+        }
+        completeRoom(shard, room);
+        return true;
+    }
+
+    // Loop thread: the race's time limit is up, so everyone still typing
+    // forfeits. Logs already handed to the scoring pool keep their scores.
+    void endRace(Shard& shard, Room& room) {
+        cout << "Room " << room.id << ": time limit reached" << endl;
+        countMetric(RACES_TIMED_OUT);
+        for (int i = 0; i < roomSize; i++) {
+            if (room.scoring[i] || room.results[i].state.load(memory_order_relaxed) != RESULT_EMPTY) continue;
+            if (finishPlayer(shard, room, i, 0, 0)) return;
+        }
+    }
+
+    // Loop thread: nothing arrived within the connection's idle timeout.
+    // A racer who went quiet is AFK and forfeits as the socket closes.
+    void onIdle(Connection& conn) override {
+        countMetric(CONNECTIONS_TIMED_OUT);
+        if (conn.role == ROLE_PLAYER) {
+            cout << "Client " << conn.playerId << " of room " << conn.roomId << " timed out" << endl;
+        }
+        FrameRef reply = FrameRef::acquire();
+        encodeError(reply.bytes(), ERR_TIMEOUT, errorCodeName(ERR_TIMEOUT));
+        conn.loop->send(conn, reply);
+        conn.loop->close(conn);
+    }
+
+    // Runs on the worker loop that owns the client's socket
+    void onFrame(Connection& conn, const Frame& frame) override {
+        Shard& shard = *shards[conn.loop->getIndex()];
+        if (conn.role == ROLE_HANDSHAKE) {
+            handshake(shard, conn, frame);
+            return;
+        }
+        if (conn.role == ROLE_SPECTATOR) return;   // spectators only listen
+
+        Room* room = findRoom(shard, conn.roomId);
+        if (!room || !room->gameStarted) return;
+
+        int playerId = conn.playerId;
+        
+        // Parse message
+        if (frame.type == MSG_KEYLOG) {
+            // After FINISH the scorer belongs to the scoring job; nothing
+            // more counts, nor goes into the replay
+            if (room->scoring[playerId] || room->results[playerId].state.load(memory_order_relaxed) != RESULT_EMPTY) {
+                return;
+            }
+            // Logs are a few bytes per keystroke; refuse anything absurd
+            KeyLogScorer& scorer = room->scorers[playerId];
+            if (scorer.bytesFed() + frame.payload.size() > 16 * room->typingText.size() + 4096) {
+                rejectFrame(conn);
+                return;
+            }
+            // Scored as it comes, so FINISH only has the last stretch left
+            auto started = chrono::steady_clock::now();
+            uint64_t settledBefore = scorer.settledPassage();
+            scorer.feed(frame.payload, KEYLOG_SEGMENTS_PER_FRAME);
+            if (scorer.settledPassage() != settledBefore) {
+                recordLatency(KEYLOG_SETTLING, chrono::steady_clock::now() - started);
+            }
+            if (recorder) room->keyLogs[playerId].append(frame.payload.data(), frame.payload.size());
+        } else if (frame.type == MSG_FINISH) {
+            double claimedWpm, claimedAccuracy;
+            if (!parseFinish(frame.payload, claimedWpm, claimedAccuracy)) {
+                rejectFrame(conn);
+                return;
+            }
+            if (room->scoring[playerId] || room->results[playerId].state.load(memory_order_relaxed) != RESULT_EMPTY) {
+                return;
+            }
+            // Done typing; waiting on the others is not being AFK
+            shard.loop->setIdleTimeout(conn, chrono::milliseconds(0));
+            room->lastFinishAt = chrono::steady_clock::now();
+            room->progress[playerId].flags |= PROGRESS_FINISHED;
+            markProgress(shard, *room);
+
+            // The claimed numbers are ignored; the server replays the log
+            ScoreJob job;
+            job.shard = conn.loop->getIndex();
+            job.roomId = room->id;
+            job.room = room;
+            job.playerId = playerId;
+            job.corpus = room->corpus;
+            job.scorer = move(room->scorers[playerId]);
+            job.keyLog = move(room->keyLogs[playerId]);
+            job.elapsedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - room->startedAt).count();
+            job.breakdown = analytics != nullptr;
+            room->scoring[playerId] = true;
+            if (!scoring->trySubmit(job)) {
+                shard.pendingScores.push_back(move(job));
+            }
+        } else if (frame.type == MSG_PROGRESS) {
+            uint32_t cursor, errors, elapsedMs;
+            if (!parseProgress(frame.payload, cursor, errors, elapsedMs)) {
+                rejectFrame(conn);
+                return;
+            }
+            if (elapsedMs < room->lastReportMs[playerId]) return;
+            room->lastReportMs[playerId] = elapsedMs;
+
+            // Only the latest report survives until the next tick
+            ProgressEntry& progress = room->progress[playerId];
+            progress.cursor = min<uint32_t>(cursor, room->typingText.size());
+            progress.errors = errors;
+            markProgress(shard, *room);
+            streamText(shard, conn, *room, playerId);
+        }
+    }
+
+    // Loop thread: send a player the next pieces of the passage once its
+    // cursor is closing in on the end of what it has. It never has more than
+    // TEXT_WINDOW ahead of its cursor, so its queue stays short and its
+    // memory bounded however long the passage.
+    void streamText(Shard& shard, Connection& conn, Room& room, int playerId) {
+        uint32_t& sent = room.textSent[playerId];
+        uint32_t cursor = room.progress[playerId].cursor;
+        while (sent < room.typingText.size()) {
+            string_view piece = room.typingText.substr(sent, TEXT_CHUNK_SIZE);
+            if (sent + piece.size() > cursor + TEXT_WINDOW) return;
+            FrameRef chunk = FrameRef::acquire();
+            encodeText(chunk.bytes(), sent, piece);
+            shard.loop->send(conn, chunk);
+            sent += piece.size();
+            countMetric(TEXT_CHUNKS_SENT);
+        }
+    }
+
+    void onTick(Shard& shard) {
+        matchWaiting(shard);
+
+        // Retry scoring jobs the queue was too full to take
+        while (!shard.pendingScores.empty() && scoring->trySubmit(shard.pendingScores.front())) {
+            shard.pendingScores.pop_front();
+        }
+        broadcastProgress(shard);
+    }
+
+    void markProgress(Shard& shard, Room& room) {
+        if (!room.progressDirty) {
+            room.progressDirty = true;
+            shard.dirtyRooms.push_back(room.id);
+        }
+    }
+
+    // Tick: one snapshot per changed room, encoded once and sent to every
+    // player in it. Bandwidth per room is bounded by the tick rate.
+    void broadcastProgress(Shard& shard) {
+        for (uint64_t roomId : shard.dirtyRooms) {
+            Room* room = findRoom(shard, roomId);
+            if (!room) continue;   // finished since it was marked
+            room->progressDirty = false;
+
+            FrameRef snapshot = FrameRef::acquire();
+            encodeSnapshot(snapshot.bytes(), ++room->snapshotTick, room->progress.data(), room->progress.size());
+            broadcast(shard, *room, snapshot);
+            publishToWatchers(*room, SPECTATE_SNAPSHOT, snapshot);
+        }
+        shard.dirtyRooms.clear();
+    }
+
+    // Tell the client what was wrong with its frame and drop it
+    void rejectFrame(Connection& conn, ErrorCode code = ERR_MALFORMED) {
+        countMetric(PARSE_ERRORS);
+        FrameRef reply = FrameRef::acquire();
+        encodeError(reply.bytes(), code, errorCodeName(code));
+        conn.loop->send(conn, reply);
+        conn.loop->close(conn);
+    }
+
+    void onClose(Connection& conn) override {
+        Shard& shard = *shards[conn.loop->getIndex()];
+        if (conn.role == ROLE_SPECTATOR) {
+            stopWatching(shard, conn);
+            return;
+        }
+        if (conn.role != ROLE_PLAYER) return;
+        if (conn.roomId == 0) {
+            // Still waiting for a match
+            if (shard.queue->remove(conn.id)) countMetric(PLAYERS_DEQUEUED);
+            return;
+        }
+        cout << "Client " << conn.playerId << " of room " << conn.roomId << " disconnected" << endl;
+
+        Room* room = findRoom(shard, conn.roomId);
+        if (!room) return;
+
+        // A player who leaves mid-race forfeits; one who leaves during the
+        // countdown forfeits when it starts. A finished log that is still
+        // being scored keeps its score.
+        room->players[conn.playerId] = 0;
+        room->progress[conn.playerId].flags |= PROGRESS_LEFT;
+        markProgress(shard, *room);
+        if (room->gameStarted && !room->scoring[conn.playerId]) {
+            finishPlayer(shard, *room, conn.playerId, 0, 0);
+        }
+    }
+
+    // Spectators. Each loop keeps a group per watched room for the
+    // spectators it accepted, and the room's loop hands every frame to those
+    // groups with one inbox push per watching loop, so a room costs its own
+    // loop the same however many people watch it. Each group then fans out
+    // on its own loop, after that loop's own work.
+
+    // Loop thread: a SPECTATE arrived on this loop
+    void watchRoom(Shard& shard, Connection& conn, uint64_t roomId) {
+        if (roomId == 0) roomId = latestStartedRoom.load(memory_order_relaxed);
+        if (roomId == 0) {
+            rejectFrame(conn, ERR_NO_SUCH_ROOM);
+            return;
+        }
+        // Watching a long race is not idling; RESULTS sets the limit again
+        conn.role = ROLE_SPECTATOR;
+        conn.roomId = roomId;
+        conn.notifyDrained = true;
+        shard.loop->setIdleTimeout(conn, chrono::milliseconds(0));
+        setsockopt(conn.fd, SOL_SOCKET, SO_SNDBUF, &SPECTATOR_SEND_BUFFER, sizeof(SPECTATOR_SEND_BUFFER));
+        countMetric(SPECTATORS_JOINED);
+
+        auto inserted = shard.watching.emplace(roomId, SpectatorGroup());
+        SpectatorGroup& group = inserted.first->second;
+        Spectator& spectator = group.spectators[conn.id];
+        if (inserted.second) {
+            // First spectator of this room here: subscribe with its loop
+            int watcher = shard.loop->getIndex();
+            Shard& host = roomShard(roomId);
+            host.loop->post([this, &host, roomId, watcher]() { addWatcher(host, roomId, watcher); });
+            return;
+        }
+        if (group.start) {
+            shard.loop->send(conn, group.start);
+            spectator.textSent = min<size_t>(group.text.size(), TEXT_WINDOW);
+        }
+        if (group.latest) shard.loop->send(conn, group.latest);
+    }
+
+    // Loop thread: the last spectator of a room on this loop left
+    void stopWatching(Shard& shard, Connection& conn) {
+        countMetric(SPECTATORS_LEFT);
+        auto it = shard.watching.find(conn.roomId);
+        if (it == shard.watching.end()) return;
+        it->second.spectators.erase(conn.id);
+        if (!it->second.spectators.empty()) return;
+
+        shard.watching.erase(it);
+        uint64_t roomId = conn.roomId;
+        int watcher = shard.loop->getIndex();
+        Shard& host = roomShard(roomId);
+        host.loop->post([this, &host, roomId, watcher]() {
+            Room* room = findRoom(host, roomId);
+            if (room) room->watchers.erase(remove(room->watchers.begin(), room->watchers.end(), watcher), room->watchers.end());
+        });
+    }
+
+    // Room's loop: start feeding a loop's spectators, catching them up if
+    // the race is already on
+    void addWatcher(Shard& shard, uint64_t roomId, int watcher) {
+        Shard& target = *shards[watcher];
+        Room* room = findRoom(shard, roomId);
+        if (!room) {
+            pushSpectatorEvent(target, roomId, SPECTATE_GONE, FrameRef());
+            return;
+        }
+        if (find(room->watchers.begin(), room->watchers.end(), watcher) == room->watchers.end()) {
+            room->watchers.push_back(watcher);
+        }
+        if (!room->gameStarted) return;
+
+        FrameRef snapshot = FrameRef::acquire();
+        encodeSnapshot(snapshot.bytes(), room->snapshotTick, room->progress.data(), room->progress.size());
+        pushSpectatorEvent(target, roomId, SPECTATE_START, spectatorStart(*room), room);
+        pushSpectatorEvent(target, roomId, SPECTATE_SNAPSHOT, snapshot);
+    }
+
+    FrameRef spectatorStart(Room& room) {
+        if (!room.spectatorStart) {
+            room.spectatorStart = FrameRef::acquire();
+            encodeStart(room.spectatorStart.bytes(), room.id, SPECTATOR_ID, roomSize, room.typingText);
+        }
+        return room.spectatorStart;
+    }
+
+    void publishToWatchers(const Room& room, SpectatorEventType type, const FrameRef& frame) {
+        for (int watcher : room.watchers) {
+            pushSpectatorEvent(*shards[watcher], room.id, type, frame, &room);
+        }
+    }
+
+    // Any loop thread. START also carries the room's passage, which the
+    // spectators' loop streams on from there.
+    void pushSpectatorEvent(Shard& target, uint64_t roomId, SpectatorEventType type, const FrameRef& frame,
+                            const Room* room = nullptr) {
+        SpectatorEvent event{roomId, type, frame, nullptr, string_view()};
+        if (type == SPECTATE_START && room) {
+            event.corpus = room->corpus;
+            event.text = room->typingText;
+        }
+        {
+            lock_guard<mutex> lock(target.spectatorMutex);
+            target.spectatorInbox.push_back(move(event));
+        }
+        target.loop->notify();
+    }
+
+    // Loop thread, on every wakeup: fan room news out to this loop's spectators
+    void deliverSpectatorEvents(Shard& shard) {
+        {
+            lock_guard<mutex> lock(shard.spectatorMutex);
+            if (shard.spectatorInbox.empty()) return;
+            shard.spectatorBatch.swap(shard.spectatorInbox);
+        }
+        for (SpectatorEvent& event : shard.spectatorBatch) {
+            auto it = shard.watching.find(event.roomId);
+            if (it == shard.watching.end()) continue;   // everyone left already
+            SpectatorGroup& group = it->second;
+
+            if (event.type == SPECTATE_GONE) {
+                // Closing removes each spectator from the group, so collect first
+                vector<Connection*> leaving;
+                for (auto& entry : group.spectators) {
+                    Connection* conn = shard.loop->find(entry.first);
+                    if (conn) leaving.push_back(conn);
+                }
+                FrameRef reply = FrameRef::acquire();
+                encodeError(reply.bytes(), ERR_NO_SUCH_ROOM, errorCodeName(ERR_NO_SUCH_ROOM));
+                for (Connection* conn : leaving) {
+                    shard.loop->send(*conn, reply);
+                    shard.loop->close(*conn);
+                }
+                continue;
+            }
+
+            if (event.type == SPECTATE_START) {
+                group.start = event.frame;
+                group.corpus = move(event.corpus);
+                group.text = event.text;
+            }
+            if (event.type == SPECTATE_SNAPSHOT) group.latest = event.frame;
+            for (auto& entry : group.spectators) {
+                Connection* conn = shard.loop->find(entry.first);
+                if (!conn) continue;
+                if (event.type == SPECTATE_START) entry.second.textSent = min<size_t>(group.text.size(), TEXT_WINDOW);
+                FrameRef& waiting = entry.second.waiting;
+                if (event.type == SPECTATE_SNAPSHOT && conn->hasQueuedOutput()) {
+                    // Still writing an older frame: only the newest waits
+                    if (waiting) countMetric(SPECTATOR_FRAMES_DROPPED);
+                    waiting = event.frame;
+                    continue;
+                }
+                if (waiting) {
+                    shard.loop->send(*conn, waiting);
+                    waiting.reset();
+                }
+                shard.loop->send(*conn, event.frame);
+                if (event.type == SPECTATE_RESULTS) shard.loop->setIdleTimeout(*conn, idleTimeout);
+            }
+            if (event.type == SPECTATE_RESULTS) shard.watching.erase(it);
+        }
+        shard.spectatorBatch.clear();
+    }
+
+    // Loop thread: a spectator's socket took everything, so its waiting
+    // snapshot can go, and the next piece of the passage
+    void onDrained(Connection& conn) override {
+        Shard& shard = *shards[conn.loop->getIndex()];
+        auto it = shard.watching.find(conn.roomId);
+        if (it == shard.watching.end()) return;
+        SpectatorGroup& group = it->second;
+        auto found = group.spectators.find(conn.id);
+        if (found == group.spectators.end()) return;
+        Spectator& spectator = found->second;
+        if (spectator.waiting) {
+            shard.loop->send(conn, spectator.waiting);
+            spectator.waiting.reset();
+        }
+        if (spectator.textSent > 0 && spectator.textSent < group.text.size()) {
+            string_view piece = group.text.substr(spectator.textSent, TEXT_CHUNK_SIZE);
+            FrameRef chunk = FrameRef::acquire();
+            encodeText(chunk.bytes(), spectator.textSent, piece);
+            shard.loop->send(conn, chunk);
+            spectator.textSent += piece.size();
+            countMetric(TEXT_CHUNKS_SENT);
+        }
+    }
+
+    // Loop thread: hand a settled room's race to the replay writer. The logs
+    // move out of the result cells, so nothing is copied here.
+    void recordRace(Room& room) {
+        RaceRecord race;
+        race.roomId = room.id;
+        race.startedAtMs = room.startedAtUnixMs;
+        race.corpus = room.corpus;
+        race.text = room.typingText;
+        race.players.resize(roomSize);
+        for (int i = 0; i < roomSize; i++) {
+            ResultCell& result = room.results[i];
+            RaceRecord::Player& player = race.players[i];
+            player.flags = REPLAY_FINISHED | (result.forfeit ? REPLAY_FORFEIT : 0);
+            player.wpm = result.wpm;
+            player.accuracy = result.accuracy;
+            player.endMs = result.endMs;
+            player.keyLog = move(result.keyLog);
+        }
+        recorder->trySubmit(move(race));
+    }
+
+    // Loop thread: hand a settled room's results, forfeits included, to the
+    // analytics writer
+    void exportRace(Room& room, uint64_t finishedAtMs) {
+        vector<AnalyticsRow> rows(roomSize);
+        for (int i = 0; i < roomSize; i++) {
+            ResultCell& result = room.results[i];
+            AnalyticsRow& row = rows[i];
+            row.finishedAtMs = finishedAtMs;
+            row.startedAtMs = room.startedAtUnixMs;
+            row.roomId = room.id;
+            row.passageId = room.passageId;
+            row.passageLength = static_cast<uint32_t>(room.typingText.size());
+            row.name = room.names[i];
+            row.flags = result.forfeit ? ANALYTICS_FORFEIT : 0;
+            row.wpm = toHundredths(result.wpm);
+            row.accuracy = static_cast<uint16_t>(min<uint32_t>(toHundredths(result.accuracy), 10000));
+            row.endMs = result.endMs;
+            row.keystrokes = result.keystrokes;
+            row.wordErrors = move(result.wordErrors);
+        }
+        analytics->trySubmit(move(rows));
+    }
+
+    // Admin thread: /leaderboard?passage=ID&limit=N, the fastest players
+    // over all passages or on one (its id in hex, as /rank shows it)
+    string renderTop(const string& query) {
+        uint64_t passageId = strtoull(AdminServer::queryParam(query, "passage").c_str(), nullptr, 16);
+        string limitParam = AdminServer::queryParam(query, "limit");
+        size_t limit = limitParam.empty() ? LEADERBOARD_TOP : strtoull(limitParam.c_str(), nullptr, 10);
+
+        vector<LeaderboardEntry> top;
+        size_t players = results->read([&](const Leaderboard& board) {
+            board.top(passageId, limit, top);
+            return board.playerCount();
+        });
+        string out = passageId ? "# passage " + formatPassageId(passageId) : string("# all passages");
+        out += ", " + to_string(players) + " ranked players\n";
+        char line[160];
+        for (size_t i = 0; i < top.size(); i++) {
+            const LeaderboardEntry& entry = top[i];
+            snprintf(line, sizeof(line), "%zu %s %.2f WPM %.2f%% passage %s at %llu\n", i + 1, entry.name.c_str(),
+                     fromHundredths(entry.wpm), fromHundredths(entry.accuracy),
+                     formatPassageId(entry.passageId).c_str(), static_cast<unsigned long long>(entry.achievedAtMs));
+            out += line;
+        }
+        return out;
+    }
+
+    // Admin thread: /rank?name=NAME, one player's best and where it ranks
+    string renderRank(const string& query) {
+        string name = AdminServer::queryParam(query, "name");
+        PlayerStanding standing;
+        bool ranked = results->read([&](const Leaderboard& board) { return board.standing(name, standing); });
+        if (!ranked) return name + ": no ranked races\n";
+        char line[160];
+        snprintf(line, sizeof(line), ": rank %llu of %llu, best %.2f WPM %.2f%% passage %s at %llu, %u races\n",
+                 static_cast<unsigned long long>(standing.rank), static_cast<unsigned long long>(standing.players),
+                 fromHundredths(standing.best.wpm), fromHundredths(standing.best.accuracy),
+                 formatPassageId(standing.best.passageId).c_str(),
+                 static_cast<unsigned long long>(standing.best.achievedAtMs), standing.races);
+        return name + line;
+    }
+
+    static string formatPassageId(uint64_t passageId) {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(passageId));
+        return hex;
+    }
+
+    void sendResults(Shard& shard, const Room& room) {
+        vector<ResultEntry>& entries = shard.resultEntries;
+        entries.clear();
+        for (int i = 0; i < roomSize; i++) {
+            const ResultCell& result = room.results[i];
+            ResultEntry entry;
+            entry.playerId = i;
+            entry.finished = result.state.load(memory_order_acquire) == RESULT_SET;
+            entry.wpm = result.wpm;
+            entry.accuracy = result.accuracy;
+            entries.push_back(entry);
+        }
+
+        FrameRef resultsMsg = FrameRef::acquire();
+        encodeResults(resultsMsg.bytes(), entries.data(), entries.size());
+        
+        // Send results to all clients, who then have the idle timeout to leave
+        broadcast(shard, room, resultsMsg);
+        for (uint64_t connId : room.players) {
+            Connection* conn = connId ? shard.loop->find(connId) : nullptr;
+            if (conn) shard.loop->setIdleTimeout(*conn, idleTimeout);
+        }
+        publishToWatchers(room, SPECTATE_RESULTS, resultsMsg);
+        countMetric(GAMES_FINISHED);
+        if (room.lastFinishAt != chrono::steady_clock::time_point()) {
+            recordLatency(RESULTS_FANOUT, chrono::steady_clock::now() - room.lastFinishAt);
+        }
+        
+        cout << "Room " << room.id << ": game finished, results sent to all players" << endl;
+    }
+
+    ~TypingServer() {
+        admin.reset();
+
+        // Stopping the loops joins their threads; the client sockets they own
+        // stay open until the loops are destroyed below. The loops hand jobs
+        // to the scoring pool and races to the recorder, so they stop first;
+        // races still running are abandoned.
+        for (auto& shard : shards) {
+            shard->loop->stop();
+        }
+        // Scoring workers only wake the stopped loops now, which still exist
+        scoring.reset();
+        // Then whatever races and results are still queued reach the disk
+        recorder.reset();
+        analytics.reset();
+
+        for (auto& shard : shards) {
+            for (int fd : shard->listenFds) closeSocket(fd);
+        }
+        // Destroying the loops closes every client socket
+        shards.clear();
+        // Last, once nothing can add results: the rest are synced and snapshotted
+        results.reset();
+        close(signalFd);
+    }
+};
+
+// Apply one option, named as on the command line without the dashes.
+// Returns false with a message for a bad name or value.
+bool applyOption(ServerConfig& config, const string& name, const string& value, string& error) {
+    if (name == "bind") {
+        config.bindAddresses.push_back(value);
+    } else if (name == "port") {
+        config.port = atoi(value.c_str());
+        if (config.port <= 0 || config.port > 65535) {
+            error = "Invalid port: " + value;
+            return false;
+        }
+    } else if (name == "workers") {
+        config.workers = max(1, atoi(value.c_str()));
+    } else if (name == "scorers") {
+        config.scorers = max(1, atoi(value.c_str()));
+    } else if (name == "room-size") {
+        config.roomSize = min(max(1, atoi(value.c_str())), static_cast<int>(MAX_ROOM_SIZE));
+    } else if (name == "tick-ms") {
+        config.tickMs = max(1, atoi(value.c_str()));
+    } else if (name == "backlog") {
+        config.backlog = max(1, atoi(value.c_str()));
+    } else if (name == "gather-ms") {
+        config.gatherMs = max(0, atoi(value.c_str()));
+    } else if (name == "match-band") {
+        config.matchBand = max(0.0, atof(value.c_str()));
+    } else if (name == "match-widen") {
+        config.matchWiden = max(0.0, atof(value.c_str()));
+    } else if (name == "pin-cpus") {
+        config.pinCpus = atoi(value.c_str()) != 0;
+    } else if (name == "admin-port") {
+        config.adminPort = max(0, atoi(value.c_str()));
+    } else if (name == "replay-dir") {
+        config.replayDir = value;
+    } else if (name == "replay-segment-mb") {
+        config.replaySegmentMb = max(1, atoi(value.c_str()));
+    } else if (name == "analytics-dir") {
+        config.analyticsDir = value;
+    } else if (name == "analytics-file-mb") {
+        config.analyticsFileMb = max(1, atoi(value.c_str()));
+    } else if (name == "leaderboard-dir") {
+        config.leaderboardDir = value;
+    } else if (name == "snapshot-every") {
+        config.snapshotEvery = max(1, atoi(value.c_str()));
+    } else if (name == "countdown-ms") {
+        config.countdownMs = max(0, atoi(value.c_str()));
+    } else if (name == "race-seconds") {
+        config.raceSeconds = max(0, atoi(value.c_str()));
+    } else if (name == "afk-seconds") {
+        config.afkSeconds = max(0, atoi(value.c_str()));
+    } else if (name == "idle-seconds") {
+        config.idleSeconds = max(0, atoi(value.c_str()));
+    } else if (name == "corpus") {
+        config.corpusPath = value;
+    } else if (name == "difficulty") {
+        config.filter.difficulty = atoi(value.c_str());
+    } else if (name == "length") {
+        config.filter.lengthClass = parseLengthClass(value);
+        if (config.filter.lengthClass < 0) {
+            error = "Unknown length: " + value;
+            return false;
+        }
+    } else if (name == "language") {
+        config.filter.language = languageCode(value);
+        if (config.filter.language == 0) {
+            error = "Unknown language: " + value;
+            return false;
+        }
+    } else {
+        error = "Unknown option: " + name;
+        return false;
+    }
+    return true;
+}
+
+// A config file holds the same options as the command line, one
+// "name = value" per line, with # starting a comment. bind may repeat.
+bool loadConfigFile(ServerConfig& config, const string& path, string& error) {
+    ifstream input(path);
+    if (!input) {
+        error = "Cannot open config file " + path;
+        return false;
+    }
+    string line;
+    int lineNumber = 0;
+    while (getline(input, line)) {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        size_t equals = line.find('=');
+        auto trim = [](const string& text) {
+            size_t first = text.find_first_not_of(" \t\r");
+            size_t last = text.find_last_not_of(" \t\r");
+            return first == string::npos ? string() : text.substr(first, last - first + 1);
+        };
+        if (trim(line).empty()) continue;
+        if (equals == string::npos) {
+            error = path + ":" + to_string(lineNumber) + ": expected name = value";
+            return false;
+        }
+        if (!applyOption(config, trim(line.substr(0, equals)), trim(line.substr(equals + 1)), error)) {
+            error = path + ":" + to_string(lineNumber) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    auto launched = chrono::steady_clock::now();
+
+    ServerConfig config;
+    config.workers = max(1u, thread::hardware_concurrency());
+
+    // Optional overrides, applied in order: --config FILE, --bind ADDR[:PORT]
+    // (repeatable), --port N, --workers N, --scorers N, --room-size N (at most
+    // MAX_ROOM_SIZE, 5957), --tick-ms N, --backlog N, --gather-ms N,
+    // --match-band X, --match-widen X, --pin-cpus 0|1,
+    // --countdown-ms N, --race-seconds N, --afk-seconds N, --idle-seconds N,
+    // --replay-dir DIR, --replay-segment-mb N, --analytics-dir DIR, --analytics-file-mb N,
+    // --leaderboard-dir DIR, --snapshot-every N,
+    // --corpus FILE, --difficulty 1-5, --length short|medium|long|endurance, --language xx,
+    // --admin-port N (0 turns the metrics endpoint off)
+    for (int i = 1; i < argc; i += 2) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0 || i + 1 >= argc) {
+            cerr << "Expected --option value, got: " << arg << endl;
+            return 1;
+        }
+        string error;
+        bool ok = arg == "--config" ? loadConfigFile(config, argv[i + 1], error)
+                                    : applyOption(config, arg.substr(2), argv[i + 1], error);
+        if (!ok) {
+            cerr << error << endl;
+            return 1;
+        }
+    }
+
+    TypingServer server(config);
+
+    cout << "Ready in "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - launched).count() << " ms"
+         << endl;
+    cout << "\nPress Ctrl+C to stop the server." << endl;
+    server.run();
+    
+    return 0;
+}
@@ -0,0 +1,475 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "analytics.h"
+#include "replay.h"
+
+using namespace std;
+
+// Batch statistics over the analytics files the server writes with
+// --analytics-dir:
+//
+//     stats [--threads N] [--top N] [--min-races N] [--corpus FILE]
+//           [--passage ID] FILE...
+//
+// prints WPM and accuracy percentiles, the hardest passages with the words
+// that cost the most edits, and the players improving and slowing down the
+// fastest, as the least-squares slope of their WPM over time. --passage ID
+// (in hex, as the leaderboard shows it) prints that passage's difficulty
+// curve instead: the mean edits per race for each of its words. Words are
+// shown by position, and as text with the corpus the passages came from.
+//
+// Files are mapped and their groups decoded on all threads at once. Each
+// thread folds a group into totals of its own a column at a time: rows are
+// first summed per dictionary entry in flat arrays, with forfeits masked out
+// arithmetically rather than branched around, so the hash tables are touched
+// once per passage and player in the group rather than once per row.
+
+const uint32_t WPM_BUCKETS = 65536;        // hundredths, up to 655.35 WPM
+const uint32_t ACCURACY_BUCKETS = 10001;   // hundredths of a percent
+// Slopes over less time than this say more about a good or bad day
+const double TREND_MIN_DAYS = 1.0;
+const double MS_PER_DAY = 86400000.0;
+
+struct PassageTotals {
+    uint32_t length = 0;
+    uint64_t races = 0;
+    uint64_t forfeits = 0;
+    uint64_t wpmSum = 0;          // hundredths, over finished races
+    uint64_t accuracySum = 0;
+    uint64_t brokenDown = 0;      // finished races with per-word errors
+    vector<uint64_t> wordErrors;  // summed over those
+};
+
+// Sums for a least-squares fit of WPM (w) against days since the
+// earliest file (t), over finished races
+struct PlayerTotals {
+    string name;
+    double races = 0;
+    double sumT = 0, sumTT = 0, sumW = 0, sumTW = 0;
+    uint64_t forfeits = 0;
+    uint64_t firstMs = UINT64_MAX;
+    uint64_t lastMs = 0;
+    uint32_t bestWpm = 0;
+
+    double slope() const {
+        double spread = races * sumTT - sumT * sumT;
+        return spread > 0 ? (races * sumTW - sumT * sumW) / spread : 0;
+    }
+};
+
+struct Totals {
+    uint64_t rows = 0;
+    uint64_t forfeits = 0;
+    uint64_t badGroups = 0;
+    vector<uint64_t> wpm = vector<uint64_t>(WPM_BUCKETS);
+    vector<uint64_t> accuracy = vector<uint64_t>(ACCURACY_BUCKETS);
+    unordered_map<uint64_t, PassageTotals> passages;
+    unordered_map<uint64_t, PlayerTotals> players;   // by a hash of the name, to look up views without a copy
+
+    void merge(Totals& other) {
+        rows += other.rows;
+        forfeits += other.forfeits;
+        badGroups += other.badGroups;
+        for (uint32_t i = 0; i < WPM_BUCKETS; i++) wpm[i] += other.wpm[i];
+        for (uint32_t i = 0; i < ACCURACY_BUCKETS; i++) accuracy[i] += other.accuracy[i];
+        for (auto& entry : other.passages) {
+            PassageTotals& into = passages[entry.first];
+            PassageTotals& from = entry.second;
+            into.length = max(into.length, from.length);
+            into.races += from.races;
+            into.forfeits += from.forfeits;
+            into.wpmSum += from.wpmSum;
+            into.accuracySum += from.accuracySum;
+            into.brokenDown += from.brokenDown;
+            if (into.wordErrors.size() < from.wordErrors.size()) into.wordErrors.resize(from.wordErrors.size());
+            for (size_t w = 0; w < from.wordErrors.size(); w++) into.wordErrors[w] += from.wordErrors[w];
+        }
+        for (auto& entry : other.players) {
+            PlayerTotals& into = players[entry.first];
+            const PlayerTotals& from = entry.second;
+            if (into.name.empty()) into.name = from.name;
+            into.races += from.races;
+            into.sumT += from.sumT;
+            into.sumTT += from.sumTT;
+            into.sumW += from.sumW;
+            into.sumTW += from.sumTW;
+            into.forfeits += from.forfeits;
+            into.firstMs = min(into.firstMs, from.firstMs);
+            into.lastMs = max(into.lastMs, from.lastMs);
+            into.bestWpm = max(into.bestWpm, from.bestWpm);
+        }
+        other = Totals();
+    }
+};
+
+// Per-thread arrays reused from group to group: one entry per row, then
+// one per dictionary entry
+struct Scratch {
+    vector<uint32_t> live;     // 1 for a finished race, 0 for a forfeit
+    vector<double> days;
+    vector<double> wpm;
+
+    vector<uint64_t> passageRaces, passageFinished, passageWpm, passageAccuracy;
+    vector<PassageTotals*> passageTotals;
+
+    vector<double> playerRaces, playerT, playerTT, playerW, playerTW;
+    vector<uint64_t> playerForfeits, playerFirst, playerLast;
+    vector<uint32_t> playerBest;
+};
+
+void foldGroup(const AnalyticsGroup& g, uint64_t referenceMs, Totals& totals, Scratch& s) {
+    const size_t rows = g.rows;
+    totals.rows += rows;
+
+    // Row-wise passes over whole columns, with no branches for the compiler
+    // to trip over
+    s.live.resize(rows);
+    s.days.resize(rows);
+    s.wpm.resize(rows);
+    uint64_t finished = 0;
+    for (size_t i = 0; i < rows; i++) {
+        s.live[i] = (g.flags[i] & ANALYTICS_FORFEIT) == 0;
+        finished += s.live[i];
+    }
+    totals.forfeits += rows - finished;
+    for (size_t i = 0; i < rows; i++) {
+        s.days[i] = static_cast<double>(static_cast<int64_t>(g.finishedAtMs[i] - referenceMs)) / MS_PER_DAY;
+        s.wpm[i] = g.wpm[i] * 0.01;
+    }
+    for (size_t i = 0; i < rows; i++) {
+        totals.wpm[min(g.wpm[i], WPM_BUCKETS - 1)] += s.live[i];
+        totals.accuracy[min<uint32_t>(g.accuracy[i], ACCURACY_BUCKETS - 1)] += s.live[i];
+    }
+
+    // Passages: sum per dictionary entry, then once into the table
+    size_t passages = g.passageIds.size();
+    s.passageRaces.assign(passages, uint64_t(0));
+    s.passageFinished.assign(passages, uint64_t(0));
+    s.passageWpm.assign(passages, uint64_t(0));
+    s.passageAccuracy.assign(passages, uint64_t(0));
+    for (size_t i = 0; i < rows; i++) {
+        uint32_t k = g.passage[i];
+        uint64_t live = s.live[i];
+        s.passageRaces[k]++;
+        s.passageFinished[k] += live;
+        s.passageWpm[k] += live * g.wpm[i];
+        s.passageAccuracy[k] += live * g.accuracy[i];
+    }
+    s.passageTotals.resize(passages);
+    for (size_t k = 0; k < passages; k++) {
+        PassageTotals& p = totals.passages[g.passageIds[k]];
+        p.length = max(p.length, g.passageLengths[k]);
+        p.races += s.passageRaces[k];
+        p.forfeits += s.passageRaces[k] - s.passageFinished[k];
+        p.wpmSum += s.passageWpm[k];
+        p.accuracySum += s.passageAccuracy[k];
+        s.passageTotals[k] = &p;
+    }
+    // Word errors are sparse, so they go straight to their passage
+    for (size_t i = 0; i < rows; i++) {
+        uint32_t words = g.wordCount[i];
+        if (words == 0 || !s.live[i]) continue;
+        PassageTotals& p = *s.passageTotals[g.passage[i]];
+        if (words > p.length + 1) continue;   // cannot have more words than characters
+        if (p.wordErrors.size() < words) p.wordErrors.resize(words);
+        p.brokenDown++;
+        for (uint32_t e = g.errorOffset[i]; e < g.errorOffset[i + 1]; e++) {
+            p.wordErrors[g.errorWord[e]] += g.errorCount[e];
+        }
+    }
+
+    // Players: the same, for the trend sums
+    size_t players = g.players.size();
+    s.playerRaces.assign(players, 0.0);
+    s.playerT.assign(players, 0.0);
+    s.playerTT.assign(players, 0.0);
+    s.playerW.assign(players, 0.0);
+    s.playerTW.assign(players, 0.0);
+    s.playerForfeits.assign(players, uint64_t(0));
+    s.playerFirst.assign(players, UINT64_MAX);
+    s.playerLast.assign(players, uint64_t(0));
+    s.playerBest.assign(players, 0u);
+    for (size_t i = 0; i < rows; i++) {
+        uint32_t k = g.player[i];
+        double live = s.live[i];
+        double t = s.days[i];
+        double w = s.wpm[i];
+        s.playerRaces[k] += live;
+        s.playerT[k] += live * t;
+        s.playerTT[k] += live * t * t;
+        s.playerW[k] += live * w;
+        s.playerTW[k] += live * t * w;
+        s.playerForfeits[k] += 1 - s.live[i];
+        s.playerFirst[k] = min(s.playerFirst[k], g.finishedAtMs[i]);
+        s.playerLast[k] = max(s.playerLast[k], g.finishedAtMs[i]);
+        s.playerBest[k] = max(s.playerBest[k], g.wpm[i] * s.live[i]);
+    }
+    for (size_t k = 0; k < players; k++) {
+        if (g.players[k].empty() || s.playerFirst[k] == UINT64_MAX) continue;   // unrated, or unused
+        PlayerTotals& p = totals.players[replayTextId(g.players[k])];
+        if (p.name.empty()) p.name = string(g.players[k]);
+        p.races += s.playerRaces[k];
+        p.sumT += s.playerT[k];
+        p.sumTT += s.playerTT[k];
+        p.sumW += s.playerW[k];
+        p.sumTW += s.playerTW[k];
+        p.forfeits += s.playerForfeits[k];
+        p.firstMs = min(p.firstMs, s.playerFirst[k]);
+        p.lastMs = max(p.lastMs, s.playerLast[k]);
+        p.bestWpm = max(p.bestWpm, s.playerBest[k]);
+    }
+}
+
+// Smallest bucket with at least the given share of the counts at or below it
+double percentile(const vector<uint64_t>& histogram, uint64_t total, double share) {
+    uint64_t wanted = max<uint64_t>(1, static_cast<uint64_t>(ceil(share * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        seen += histogram[i];
+        if (seen >= wanted) return i / 100.0;
+    }
+    return (histogram.size() - 1) / 100.0;
+}
+
+void printDistribution(const char* title, const vector<uint64_t>& histogram) {
+    uint64_t total = 0;
+    double sum = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        total += histogram[i];
+        sum += histogram[i] * (i / 100.0);
+    }
+    cout << left << setw(12) << title << right;
+    for (double share : {0.01, 0.10, 0.25, 0.50, 0.75, 0.90, 0.99}) {
+        cout << setw(9) << (total ? percentile(histogram, total, share) : 0.0);
+    }
+    cout << setw(9) << (total ? sum / total : 0.0) << endl;
+}
+
+string passageHex(uint64_t id) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(id));
+    return hex;
+}
+
+// The passage's words as scoring splits them, if the corpus has it
+vector<string_view> passageWords(const unordered_map<uint64_t, string_view>& texts, uint64_t id) {
+    vector<string_view> words;
+    auto text = texts.find(id);
+    if (text != texts.end()) accuracy_detail::splitWords(text->second, words);
+    return words;
+}
+
+string describeWord(const vector<string_view>& words, size_t index) {
+    string out = "#" + to_string(index + 1);
+    if (index < words.size()) out += " \"" + string(words[index]) + "\"";
+    return out;
+}
+
+void printPassages(const Totals& totals, const unordered_map<uint64_t, string_view>& texts, size_t top,
+                   uint64_t minRaces) {
+    vector<pair<double, uint64_t>> ranked;   // mean accuracy, id
+    for (const auto& entry : totals.passages) {
+        uint64_t finished = entry.second.races - entry.second.forfeits;
+        if (finished >= minRaces) ranked.emplace_back(entry.second.accuracySum / 100.0 / finished, entry.first);
+    }
+    sort(ranked.begin(), ranked.end());
+
+    cout << "\nHardest passages, by mean accuracy (" << ranked.size() << " of " << totals.passages.size()
+         << " passages with at least " << minRaces << " finished races):" << endl;
+    cout << "  passage            chars    races  forfeits  mean WPM  mean acc  costliest words (mean edits per race)"
+         << endl;
+    for (size_t r = 0; r < ranked.size() && r < top; r++) {
+        const PassageTotals& p = totals.passages.at(ranked[r].second);
+        uint64_t finished = p.races - p.forfeits;
+        cout << "  " << passageHex(ranked[r].second) << setw(7) << p.length << setw(9) << p.races << setw(9)
+             << 100.0 * p.forfeits / p.races << "%" << setw(10) << p.wpmSum / 100.0 / finished << setw(10)
+             << ranked[r].first << "  ";
+
+        vector<size_t> order(p.wordErrors.size());
+        for (size_t w = 0; w < order.size(); w++) order[w] = w;
+        size_t shown = min<size_t>(3, order.size());
+        partial_sort(order.begin(), order.begin() + shown, order.end(),
+                     [&](size_t a, size_t b) { return p.wordErrors[a] > p.wordErrors[b]; });
+        vector<string_view> words = passageWords(texts, ranked[r].second);
+        for (size_t w = 0; w < shown && p.wordErrors[order[w]] > 0; w++) {
+            cout << (w ? ", " : "") << describeWord(words, order[w]) << " "
+                 << static_cast<double>(p.wordErrors[order[w]]) / p.brokenDown;
+        }
+        cout << endl;
+    }
+}
+
+int printCurve(const Totals& totals, const unordered_map<uint64_t, string_view>& texts, uint64_t id) {
+    auto found = totals.passages.find(id);
+    if (found == totals.passages.end()) {
+        cerr << "No results for passage " << passageHex(id) << endl;
+        return 1;
+    }
+    const PassageTotals& p = found->second;
+    cout << "\nPassage " << passageHex(id) << ": " << p.length << " chars, " << p.races << " races, "
+         << p.brokenDown << " with per-word errors" << endl;
+    if (p.brokenDown == 0) return 0;
+
+    uint64_t worst = *max_element(p.wordErrors.begin(), p.wordErrors.end());
+    vector<string_view> words = passageWords(texts, id);
+    for (size_t w = 0; w < p.wordErrors.size(); w++) {
+        double mean = static_cast<double>(p.wordErrors[w]) / p.brokenDown;
+        size_t bar = worst ? static_cast<size_t>(40.0 * p.wordErrors[w] / worst + 0.5) : 0;
+        cout << "  " << left << setw(24) << describeWord(words, w) << right << setw(7) << mean;
+        if (bar > 0) cout << "  " << string(bar, '#');
+        cout << endl;
+    }
+    return 0;
+}
+
+void printPlayers(const Totals& totals, size_t top, uint64_t minRaces) {
+    vector<pair<double, const PlayerTotals*>> ranked;   // WPM per day
+    for (const auto& entry : totals.players) {
+        const PlayerTotals& p = entry.second;
+        if (p.races < minRaces || (p.lastMs - p.firstMs) / MS_PER_DAY < TREND_MIN_DAYS) continue;
+        ranked.emplace_back(p.slope(), &p);
+    }
+    sort(ranked.begin(), ranked.end());
+
+    cout << "\nPlayer trends, WPM per day over their races (" << ranked.size() << " of " << totals.players.size()
+         << " named players with at least " << minRaces << " finished races over " << TREND_MIN_DAYS
+         << " day or more):" << endl;
+    auto print = [&](size_t r) {
+        const PlayerTotals& p = *ranked[r].second;
+        cout << "  " << left << setw(20) << p.name << right << setw(8) << static_cast<uint64_t>(p.races)
+             << setw(9) << p.forfeits << setw(9) << (p.lastMs - p.firstMs) / MS_PER_DAY << setw(10) << p.sumW / p.races
+             << setw(10) << p.bestWpm / 100.0 << setw(10) << showpos << ranked[r].first << noshowpos << endl;
+    };
+    cout << "  improving fastest     races forfeits     days  mean WPM  best WPM   WPM/day" << endl;
+    for (size_t r = ranked.size(); r-- > 0 && ranked.size() - r <= top;) print(r);
+    cout << "  slowing down most     races forfeits     days  mean WPM  best WPM   WPM/day" << endl;
+    for (size_t r = 0; r < ranked.size() && r < top && ranked[r].first < 0; r++) print(r);
+}
+
+int usage(const char* program) {
+    cerr << "Usage: " << program
+         << " [--threads N] [--top N] [--min-races N] [--corpus FILE] [--passage ID] FILE..." << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    int threads = max(1u, thread::hardware_concurrency());
+    size_t top = 10;
+    uint64_t minRaces = 20;
+    string corpusPath;
+    bool curve = false;
+    uint64_t curveId = 0;
+    vector<string> paths;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--top" && i + 1 < argc) {
+            top = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--min-races" && i + 1 < argc) {
+            minRaces = max(1ULL, strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--corpus" && i + 1 < argc) {
+            corpusPath = argv[++i];
+        } else if (arg == "--passage" && i + 1 < argc) {
+            curve = true;
+            curveId = strtoull(argv[++i], nullptr, 16);
+        } else if (arg.compare(0, 2, "--") == 0) {
+            return usage(argv[0]);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) return usage(argv[0]);
+
+    vector<unique_ptr<AnalyticsFile>> files;
+    uint64_t referenceMs = UINT64_MAX;
+    for (const string& path : paths) {
+        string error;
+        unique_ptr<AnalyticsFile> file = AnalyticsFile::open(path, error);
+        if (!file) {
+            cerr << error << endl;
+            return 1;
+        }
+        if (file->tornBytes() > 0) {
+            cerr << path << ": ignoring " << file->tornBytes() << " bytes of an unfinished group at the end" << endl;
+        }
+        referenceMs = min(referenceMs, file->createdAtMs());
+        files.push_back(move(file));
+    }
+
+    shared_ptr<const Corpus> corpus;
+    unordered_map<uint64_t, string_view> texts;
+    if (!corpusPath.empty()) {
+        string error;
+        corpus = Corpus::open(corpusPath, error);
+        if (!corpus) {
+            cerr << error << endl;
+            return 1;
+        }
+        for (size_t i = 0; i < corpus->size(); i++) {
+            string_view text = corpus->passage(i).text;
+            texts.emplace(replayTextId(text), text);
+        }
+    }
+
+    // Groups are handed out one at a time; each is a few MB of columns
+    vector<pair<size_t, size_t>> groups;
+    uint64_t rows = 0;
+    for (size_t f = 0; f < files.size(); f++) {
+        for (size_t g = 0; g < files[f]->groups(); g++) groups.emplace_back(f, g);
+        rows += files[f]->rows();
+    }
+    threads = static_cast<int>(min<size_t>(threads, max<size_t>(1, groups.size())));
+
+    auto started = chrono::steady_clock::now();
+    atomic<size_t> nextGroup{0};
+    vector<Totals> partial(threads);
+    auto work = [&](int t) {
+        AnalyticsGroup group;
+        Scratch scratch;
+        size_t g;
+        while ((g = nextGroup.fetch_add(1)) < groups.size()) {
+            if (!files[groups[g].first]->decode(groups[g].second, group)) {
+                partial[t].badGroups++;
+                continue;
+            }
+            foldGroup(group, referenceMs, partial[t], scratch);
+        }
+    };
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) workers.emplace_back(work, t);
+    for (thread& worker : workers) worker.join();
+    Totals totals;
+    for (Totals& part : partial) totals.merge(part);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    cout << totals.rows << " results (" << totals.forfeits << " forfeits) from " << groups.size() << " groups in "
+         << files.size() << " files, read in " << fixed << setprecision(2) << seconds << " s on " << threads
+         << " threads (" << (seconds > 0 ? totals.rows / seconds / 1e6 : 0.0) << "M rows/s)" << endl;
+    if (totals.badGroups > 0) {
+        cerr << totals.badGroups << " damaged groups skipped, " << rows - totals.rows << " rows" << endl;
+    }
+
+    if (curve) return printCurve(totals, texts, curveId);
+
+    cout << "\nFinished races" << setw(7) << "p1" << setw(9) << "p10" << setw(9) << "p25" << setw(9) << "p50"
+         << setw(9) << "p75" << setw(9) << "p90" << setw(9) << "p99" << setw(9) << "mean" << endl;
+    printDistribution("  WPM", totals.wpm);
+    printDistribution("  Accuracy", totals.accuracy);
+    printPassages(totals, texts, top, minRaces);
+    printPlayers(totals, top, minRaces);
+    return totals.badGroups == 0 ? 0 : 2;
+}
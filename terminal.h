@@ -0,0 +1,144 @@
+#pragma once
+
+// Raw keyboard input for the client. While a RawKeyboard runs, the terminal
+// neither echoes nor waits for Enter, and a thread of its own reads keys as
+// they arrive and stamps each with the monotonic clock the moment the read
+// returns. Nothing else runs on that thread, so a busy network or a slow
+// redraw never shifts a key time.
+//
+// On Windows it reads console key events. Elsewhere it uses termios, and
+// also reads from a pipe, with the same timing, when stdin is not a terminal.
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <poll.h>
+    #include <termios.h>
+    #include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+// Keys as RawKeyboard reports them, whatever the terminal sends
+const uint8_t KEY_ENTER = '\n';
+const uint8_t KEY_ERASE = 0x7F;       // Backspace, sent as DEL or as ^H
+const uint8_t KEY_INTERRUPT = 0x03;   // Ctrl-C, a key like any other in raw mode
+const uint8_t KEY_ESCAPE = 0x1B;
+
+class RawKeyboard {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Called on the keyboard thread with each key and when it was read, and
+    // once with closed set when input ends
+    using KeyHandler = std::function<void(uint8_t key, Clock::time_point at, bool closed)>;
+
+    explicit RawKeyboard(KeyHandler handler) : handler(std::move(handler)), stopping(false), raw(false) {}
+
+    ~RawKeyboard() { stop(); }
+
+    RawKeyboard(const RawKeyboard&) = delete;
+    RawKeyboard& operator=(const RawKeyboard&) = delete;
+
+    // Switch the terminal to raw mode and start reading. False if there is
+    // nothing to read keys from.
+    bool start() {
+#ifdef _WIN32
+        input = GetStdHandle(STD_INPUT_HANDLE);
+        if (!GetConsoleMode(input, &savedMode)) return false;
+        // Ctrl-C arrives as a key instead of ending the process
+        SetConsoleMode(input, savedMode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT));
+        FlushConsoleInputBuffer(input);
+        raw = true;
+#else
+        if (tcgetattr(STDIN_FILENO, &saved) == 0) {
+            termios mode = saved;
+            // ISIG off as well, so Ctrl-C is a key and the terminal is always restored
+            mode.c_lflag &= ~(ICANON | ECHO | ISIG);
+            mode.c_iflag |= ICRNL;
+            mode.c_cc[VMIN] = 1;
+            mode.c_cc[VTIME] = 0;
+            // Anything typed ahead of the race is dropped
+            tcsetattr(STDIN_FILENO, TCSAFLUSH, &mode);
+            raw = true;
+        }
+#endif
+        thread = std::thread(&RawKeyboard::run, this);
+        return true;
+    }
+
+    // Stop reading and restore the terminal
+    void stop() {
+        stopping = true;
+        if (thread.joinable()) thread.join();
+        if (!raw) return;
+#ifdef _WIN32
+        SetConsoleMode(input, savedMode);
+#else
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+#endif
+        raw = false;
+    }
+
+private:
+    KeyHandler handler;
+    std::atomic<bool> stopping;
+    std::thread thread;
+    bool raw;
+#ifdef _WIN32
+    HANDLE input;
+    DWORD savedMode;
+#else
+    termios saved;
+#endif
+
+    // How often the thread looks at stopping while no key comes
+    static const int STOP_CHECK_MS = 50;
+
+    // An escape sequence (arrow keys, function keys) arrives as one burst
+    // beginning with ESC; the burst is dropped
+    void deliver(const char* keys, size_t count, Clock::time_point at) {
+        if (count > 1 && static_cast<uint8_t>(keys[0]) == KEY_ESCAPE) return;
+        for (size_t i = 0; i < count; i++) {
+            uint8_t key = static_cast<uint8_t>(keys[i]);
+            if (key == '\r') key = KEY_ENTER;
+            if (key == 0x08) key = KEY_ERASE;
+            handler(key, at, false);
+        }
+    }
+
+    void run() {
+#ifdef _WIN32
+        while (!stopping) {
+            if (WaitForSingleObject(input, STOP_CHECK_MS) != WAIT_OBJECT_0) continue;
+            INPUT_RECORD records[32];
+            DWORD count = 0;
+            if (!ReadConsoleInputA(input, records, 32, &count)) break;
+            Clock::time_point at = Clock::now();
+            char keys[64];
+            size_t n = 0;
+            for (DWORD i = 0; i < count && n < sizeof(keys); i++) {
+                const KEY_EVENT_RECORD& event = records[i].Event.KeyEvent;
+                if (records[i].EventType != KEY_EVENT || !event.bKeyDown || event.uChar.AsciiChar == 0) continue;
+                for (WORD r = 0; r < event.wRepeatCount && n < sizeof(keys); r++) keys[n++] = event.uChar.AsciiChar;
+            }
+            deliver(keys, n, at);
+        }
+#else
+        while (!stopping) {
+            pollfd wait = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&wait, 1, STOP_CHECK_MS) <= 0) continue;
+            char keys[64];
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            Clock::time_point at = Clock::now();
+            if (n <= 0) break;
+            deliver(keys, static_cast<size_t>(n), at);
+        }
+#endif
+        if (!stopping) handler(0, Clock::now(), true);
+    }
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+// Hierarchical timer wheel for one event loop thread.
+//
+// Four wheels of 256 slots; the first counts ticks of the resolution (10 ms
+// by default), each next one counts whole turns of the one before, so the
+// range is 2^32 ticks. Timers live inside the objects they belong to and sit
+// in intrusive doubly linked slot lists, so scheduling and cancelling are a
+// few pointer writes and never allocate. Advancing one tick touches only
+// the timers due in that tick, plus, once per turn of a wheel, the timers of
+// one slot of the next wheel as they move down. Work per tick follows the
+// number of timers that fire, not the number that are armed.
+//
+// Not thread-safe: only the owning loop's thread may touch its timers.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+class TimerWheel;
+
+class Timer {
+public:
+    Timer() : prev(nullptr), next(nullptr), expires(0), wheel(nullptr) {}
+    ~Timer() { cancel(); }
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    // Runs on the loop thread when the timer fires. Set before scheduling.
+    // It may reschedule, cancel or even destroy its own timer.
+    std::function<void()> callback;
+
+    bool armed() const { return next != nullptr; }
+
+    inline void cancel();
+
+private:
+    friend class TimerWheel;
+
+    void unlink() {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+
+    Timer* prev;
+    Timer* next;
+    uint64_t expires;    // tick it is due on
+    TimerWheel* wheel;
+};
+
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerWheel(std::chrono::milliseconds resolution = std::chrono::milliseconds(10))
+        : resolution(resolution), origin(Clock::now()), current(0), count(0) {
+        for (auto& level : slots) {
+            for (Timer& head : level) head.prev = head.next = &head;
+        }
+    }
+
+    ~TimerWheel() {
+        // Disarm whatever is left so the owners' destructors do not touch us
+        for (auto& level : slots) {
+            for (Timer& head : level) {
+                while (head.next != &head) head.next->unlink();
+                head.prev = head.next = nullptr;
+            }
+        }
+    }
+
+    // Arm a timer to fire after delay, rounded up to a whole tick. A timer
+    // that is already armed is moved.
+    void schedule(Timer& timer, std::chrono::milliseconds delay) {
+        if (timer.armed()) timer.cancel();
+        uint64_t ticks = delay.count() > 0 ? (delay.count() + resolution.count() - 1) / resolution.count() : 0;
+        // The current tick may be partly gone, so never fire early
+        timer.expires = current + ticks + 1;
+        timer.wheel = this;
+        insert(timer);
+        count++;
+    }
+
+    // Run every timer due by now
+    void advance(Clock::time_point now) {
+        uint64_t target = static_cast<uint64_t>((now - origin) / resolution);
+        while (current < target) {
+            current++;
+            cascade();
+
+            // Take the whole slot first, so callbacks can schedule and
+            // cancel freely, this slot included
+            Timer& head = slots[0][current & SLOT_MASK];
+            if (head.next == &head) continue;
+            Timer due;
+            due.prev = head.prev;
+            due.next = head.next;
+            due.prev->next = &due;
+            due.next->prev = &due;
+            head.prev = head.next = &head;
+            while (due.next != &due) {
+                Timer* timer = due.next;
+                timer->unlink();
+                count--;
+                // A copy, in case the callback frees the timer; callbacks
+                // that capture a pointer or two copy without allocating
+                std::function<void()> callback = timer->callback;
+                callback();
+            }
+            due.prev = due.next = nullptr;
+        }
+    }
+
+    // How long the loop may sleep before the next tick is due, or -1 when
+    // nothing is armed
+    int msUntilNextTick(Clock::time_point now) const {
+        if (count == 0) return -1;
+        auto due = origin + resolution * (current + 1);
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count();
+        return wait > 0 ? static_cast<int>(wait) : 0;
+    }
+
+    size_t size() const { return count; }
+
+private:
+    friend class Timer;
+
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 8;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    std::chrono::milliseconds resolution;
+    Clock::time_point origin;
+    uint64_t current;    // last tick processed
+    size_t count;
+    Timer slots[LEVELS][SLOTS];   // list heads
+
+    void insert(Timer& timer) {
+        uint64_t delta = timer.expires - current;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) level++;
+        uint64_t index = (timer.expires >> (SLOT_BITS * level)) & SLOT_MASK;
+        Timer& head = slots[level][index];
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    // When a wheel comes round, move the next wheel's slot for this turn
+    // down to where its timers now belong
+    void cascade() {
+        for (int level = 1; level < LEVELS; level++) {
+            if ((current & ((1ULL << (SLOT_BITS * level)) - 1)) != 0) return;
+            Timer& head = slots[level][(current >> (SLOT_BITS * level)) & SLOT_MASK];
+            while (head.next != &head) {
+                Timer* timer = head.next;
+                timer->unlink();
+                insert(*timer);
+            }
+        }
+    }
+
+    void removed() { count--; }
+};
+
+inline void Timer::cancel() {
+    if (!armed()) return;
+    unlink();
+    wheel->removed();
+}